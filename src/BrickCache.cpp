@@ -0,0 +1,80 @@
+#include "BrickCache.h"
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "PaletteGrid.h"
+
+
+
+BrickCache::BrickCache(const std::vector<int>& _plt, int metric,
+                       int pixelType) :
+  grid(_plt, true, metric, pixelType),
+  filled(new std::atomic<unsigned int>[PaletteGrid::BRICK_COUNT / 32])
+{
+
+  for (int i = 0; i < PaletteGrid::BRICK_COUNT / 32; ++i)
+    filled[i].store(0, std::memory_order_relaxed);
+
+  // Noisy footage can end up touching every brick, at which point the cache
+  // is as big as the table it stands in for, so it had better not be any
+  // wider than that table would have been.
+  if (_plt.size() <= 256)
+    bricks8.resize(PaletteGrid::BRICK_COUNT);
+  else if (_plt.size() <= 65536)
+    bricks16.resize(PaletteGrid::BRICK_COUNT);
+  else
+    bricks32.resize(PaletteGrid::BRICK_COUNT);
+
+}
+
+
+
+BrickCache::~BrickCache()
+{
+}
+
+
+
+template<typename T>
+static void storeBrick(std::vector<T>* entries, const int* pltIdx)
+{
+
+  entries->assign(pltIdx, pltIdx + PaletteGrid::BRICK_SIZE);
+
+}
+
+
+
+void BrickCache::fillBrick(int brick)
+{
+
+  // Avisynth+ may call GetFrame from several threads at once, and any of them
+  // can be the first to touch a given brick. Whoever gets the lock first does
+  // the work, and everyone else waiting on it finds the bit already set once
+  // they're let in. Locks are shared between bricks far enough apart that
+  // neighboring colors, which tend to be touched together, don't contend.
+  std::lock_guard<std::mutex> lock(locks[brick % LOCK_COUNT]);
+
+  unsigned int bit = 1u << (brick & 31);
+
+  if (filled[brick >> 5].load(std::memory_order_relaxed) & bit)
+    return;
+
+  int pltIdx[PaletteGrid::BRICK_SIZE];
+
+  grid.fillBrick(brick, pltIdx);
+
+  if (!bricks8.empty())
+    storeBrick(&bricks8[brick], pltIdx);
+  else if (!bricks16.empty())
+    storeBrick(&bricks16[brick], pltIdx);
+  else
+    storeBrick(&bricks32[brick], pltIdx);
+
+  // The release here pairs with the acquire in lookup, so a reader that sees
+  // the bit set is guaranteed to see the finished brick along with it.
+  filled[brick >> 5].fetch_or(bit, std::memory_order_release);
+
+}
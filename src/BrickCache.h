@@ -0,0 +1,64 @@
+#ifndef TURNSTILE_SRC_BRICKCACHE_H_INCLUDED
+#define TURNSTILE_SRC_BRICKCACHE_H_INCLUDED
+
+
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "PaletteGrid.h"
+
+
+
+class BrickCache
+{
+
+public:
+
+  BrickCache(const std::vector<int>& _plt, int metric, int pixelType);
+
+  ~BrickCache();
+
+  int lookup(int color)
+  {
+    int brick = PaletteGrid::colorToBrick(color);
+
+    if (!(filled[brick >> 5].load(std::memory_order_acquire) &
+          (1u << (brick & 31))))
+      fillBrick(brick);
+
+    int entry = PaletteGrid::colorToEntry(color);
+
+    if (!bricks8.empty())
+      return bricks8[brick][entry];
+    else if (!bricks16.empty())
+      return bricks16[brick][entry];
+    else
+      return bricks32[brick][entry];
+  }
+
+private:
+
+  static const int LOCK_COUNT = 64;
+
+  PaletteGrid grid;
+
+  std::unique_ptr<std::atomic<unsigned int>[]> filled;
+
+  // Only one of these is ever used, picked by palette size the same way as
+  // PaletteTable's full table.
+  std::vector<std::vector<unsigned char> > bricks8;
+  std::vector<std::vector<unsigned short> > bricks16;
+  std::vector<std::vector<int> > bricks32;
+
+  std::mutex locks[LOCK_COUNT];
+
+  void fillBrick(int brick);
+
+};
+
+
+
+#endif // TURNSTILE_SRC_BRICKCACHE_H_INCLUDED
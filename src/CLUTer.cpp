@@ -3,27 +3,49 @@
 #include <cmath>
 
 #include <algorithm>
+#include <atomic>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <vector>
 
+#include "ColorMetric.h"
 #include "interface.h"
+#include "PaletteQuantizer.h"
+#include "PaletteTable.h"
+#include "simd.h"
+#include "WorkerPool.h"
 
 
 
 CLUTer::CLUTer( PClip _child, PClip _palette,
-                int _pltFrame, bool _interlaced,
-                IScriptEnvironment* env) :
-  GenericVideoFilter(_child), spp(vi.BytesFromPixels(1)),
-  PLANAR(vi.IsPlanar()), YUYV(vi.IsYUY2()), BGRA(vi.IsRGB32()), BGR(vi.IsRGB24())
+                int _pltFrame, bool _interlaced, int _threads,
+                int _frameThreads, bool _lazy, bool _indexOut,
+                const char* _cacheDir, const char* _lookup, int _metric,
+                int _dither, bool _animated, int _colors, int _quantize,
+                int _samples, IScriptEnvironment* env) :
+  GenericVideoFilter(_child), palette(_palette), cacheDir(_cacheDir),
+  lookupMode(_lookup), spp(vi.BytesFromPixels(1)), threads(_threads),
+  frameThreads(_frameThreads), pixelType(vi.pixel_type), metric(_metric),
+  dither(_dither),
+  pltFrame(_pltFrame), pltLast(_palette->GetVideoInfo().num_frames - 1),
+  colors(_colors), quantize(_quantize), samples(_samples),
+  interlaced(_interlaced), lazy(_lazy), indexOut(_indexOut),
+  animated(_animated), PLANAR(vi.IsPlanar()), YUYV(vi.IsYUY2()),
+  BGRA(vi.IsRGB32()), BGR(vi.IsRGB24()), Y8(vi.IsY8())
 {
 
-  PVideoFrame plt = _palette->GetFrame(_pltFrame,env);
-  VideoInfo vi = _palette->GetVideoInfo();
-
+  // The index output is a single plane the size of the input clip, with one
+  // byte per pixel naming the palette entry it was matched to. Everything I
+  // need to know about the input has already been saved above, so it's safe to
+  // swap the colorspace out from under it here.
+  if (indexOut)
+    vi.pixel_type = VideoInfo::CS_Y8;
 
-  const unsigned char
-    * pltY = plt->GetReadPtr(PLANAR_Y),
-    * pltU = plt->GetReadPtr(PLANAR_U),
-    * pltV = plt->GetReadPtr(PLANAR_V);
+  VideoInfo vi = _palette->GetVideoInfo();
 
   if (vi.IsYUV() && !vi.IsY8()) {
     lumaW = 1 << vi.GetPlaneWidthSubsampling(PLANAR_U);
@@ -33,18 +55,12 @@ CLUTer::CLUTer( PClip _child, PClip _palette,
     lumaH = 1;
   }
 
-  if (vi.IsY8()) {
-    pltU = 0;
-    pltV = 0;
-  }
+  // Even an animated palette gets its first frame read now, so any problem
+  // with it turns up when the script is opened, rather than partway through.
+  std::vector<int> plt;
+  readPalette(pltFrame, &plt, env);
 
-
-  if (vi.IsPlanar())
-    buildPalettePlanar(
-      pltY, pltU, pltV, vi.width / lumaW, vi.height / lumaH,
-      plt->GetPitch(PLANAR_Y), plt->GetPitch(PLANAR_U));
-  else
-    buildPalettePacked(pltY, vi.width, vi.height, plt->GetPitch(PLANAR_Y));
+  recent.push_front(fillColorTable(plt, 0, env));
 
 }
 
@@ -59,6 +75,8 @@ CLUTer::~CLUTer()
 PVideoFrame __stdcall CLUTer::GetFrame(int n, IScriptEnvironment* env)
 {
 
+  std::shared_ptr<const Palette> pal = paletteForFrame(n, env);
+
   PVideoFrame
     src = child->GetFrame(n, env),
     dst = env->NewVideoFrame(vi);
@@ -80,16 +98,23 @@ PVideoFrame __stdcall CLUTer::GetFrame(int n, IScriptEnvironment* env)
     DST_PITCH_SAMPLES_Y = dst->GetPitch(PLANAR_Y),
     DST_PITCH_SAMPLES_U = dst->GetPitch(PLANAR_U);
 
-  if (vi.IsY8()) {
+  if (Y8) {
     srcU = 0;
     srcV = 0;
+  }
+
+  if (Y8 || indexOut) {
     dstU = 0;
     dstV = 0;
   }
 
 
-  if (vi.IsPlanar())
+  // The index output is always Y8, but it's the input's layout that decides
+  // how a frame gets read, so both kinds of output take the same path, and
+  // only part ways when it's time to write each row.
+  if (PLANAR)
     processFramePlanar(
+      *pal,
       srcY, srcU, srcV,
       dstY, dstU, dstV,
       vi.width / lumaW, vi.height / lumaH,
@@ -97,7 +122,7 @@ PVideoFrame __stdcall CLUTer::GetFrame(int n, IScriptEnvironment* env)
       DST_PITCH_SAMPLES_Y, DST_PITCH_SAMPLES_U);
   else
     processFramePacked(
-      srcY, dstY, vi.width, vi.height,
+      *pal, srcY, dstY, vi.width, vi.height,
       SRC_PITCH_SAMPLES_Y, DST_PITCH_SAMPLES_Y);
 
   return dst;
@@ -106,14 +131,190 @@ PVideoFrame __stdcall CLUTer::GetFrame(int n, IScriptEnvironment* env)
 
 
 
+std::shared_ptr<const CLUTer::Palette> CLUTer::paletteForFrame(
+  int n, IScriptEnvironment* env)
+{
+
+  // A fixed palette is read once, up front, and never changes after that, so
+  // there's no need to lock anything to get at it.
+  if (!animated)
+    return recent.front();
+
+  // An animated palette is read again for every frame, and matched against the
+  // few I've used most recently before anything gets built; the palette is
+  // sorted, so colors that merely trade places from one frame to the next, as
+  // they do when a palette cycles, still count as the same palette. Frames past
+  // the end of the palette clip keep using its last one, and each pair of
+  // fields shares the palette of the frame they came from.
+  int frame = std::min((interlaced ? n / 2 : n) + pltFrame, pltLast);
+
+  std::vector<int> plt;
+  if (colors)
+    quantizeFrame(frame, &plt, env);
+  else
+    readPalette(frame, &plt, env);
+
+  std::shared_ptr<const Palette> base;
+
+  {
+
+    std::lock_guard<std::mutex> lock(recentLock);
+
+    for (std::list<std::shared_ptr<const Palette> >::iterator i =
+           recent.begin(); i != recent.end(); ++i) {
+      if ((*i)->table->hasColors(plt)) {
+        recent.splice(recent.begin(), recent, i);
+        return recent.front();
+      }
+    }
+
+    base = recent.front();
+
+  }
+
+  // Anything new is built from the most recently used palette's table, which
+  // is usually the one that came just before, so only the parts of the table
+  // the change could have affected need searching again. Other threads carry
+  // on with their own frames in the meantime; if one of them is after the same
+  // palette, PaletteTable makes sure it only gets built once.
+  std::shared_ptr<const Palette> pal =
+    fillColorTable(plt, base->table.get(), env);
+
+  std::lock_guard<std::mutex> lock(recentLock);
+
+  for (std::list<std::shared_ptr<const Palette> >::iterator i =
+         recent.begin(); i != recent.end(); ++i) {
+    if ((*i)->table == pal->table) {
+      recent.splice(recent.begin(), recent, i);
+      return recent.front();
+    }
+  }
+
+  recent.push_front(pal);
+
+  if (recent.size() > RECENT_PALETTES)
+    recent.pop_back();
+
+  return pal;
+
+}
+
+
+
+void CLUTer::readPalette(
+  int frame, std::vector<int>* plt, IScriptEnvironment* env) const
+{
+
+  // With a number of colors to aim for, the palette clip is only a source of
+  // colors to choose from, rather than the palette itself; every pixel of the
+  // sample frames goes into a histogram, and the quantizer picks the palette
+  // from that. The samples are spread evenly from the palette frame to the
+  // end of the clip, and the histogram's counted one frame at a time, so only
+  // the histogram ever has to hold all of them at once.
+  if (colors) {
+
+    PaletteQuantizer quantizer(quantize, colors, threads);
+
+    int span = pltLast - frame + 1,
+        count = std::min(samples, span);
+
+    for (int i = 0; i < count; ++i) {
+      std::vector<int> packed;
+      readColors(frame + i * span / count, &packed, env);
+      quantizer.addColors(packed);
+    }
+
+    quantizer.quantize(plt);
+
+  } else {
+
+    readColors(frame, plt, env);
+
+  }
+
+  // Adding all colors from the input palette to the palette vector, then
+  // sorting it and stripping out the duplicate values, is frighteningly fast,
+  // and handily beats the std::find method I'd used previously.
+  std::sort(plt->begin(), plt->end());
+  plt->erase(std::unique(plt->begin(), plt->end()), plt->end());
+
+}
+
+
+
+void CLUTer::quantizeFrame(
+  int frame, std::vector<int>* plt, IScriptEnvironment* env)
+{
+
+  // Quantizing is by far the slowest part of picking an animated palette, and
+  // a palette clip often holds still for a stretch, so each frame's colors are
+  // compared against the last ones I quantized, and if nothing has changed,
+  // that palette gets used again. When something has, the work stays within
+  // frameThreads, like the rest of the frame, rather than spreading across the
+  // whole pool from every thread Avisynth+ has running.
+  std::vector<int> packed;
+  readColors(frame, &packed, env);
+
+  {
+    std::lock_guard<std::mutex> lock(quantizedLock);
+
+    if (packed == quantizedColors) {
+      *plt = quantizedPlt;
+      return;
+    }
+  }
+
+  PaletteQuantizer quantizer(quantize, colors, frameThreads);
+  quantizer.addColors(packed);
+  quantizer.quantize(plt);
+
+  std::sort(plt->begin(), plt->end());
+  plt->erase(std::unique(plt->begin(), plt->end()), plt->end());
+
+  std::lock_guard<std::mutex> lock(quantizedLock);
+
+  quantizedColors.swap(packed);
+  quantizedPlt = *plt;
+
+}
+
+
+
+void CLUTer::readColors(
+  int frame, std::vector<int>* packed, IScriptEnvironment* env) const
+{
+
+  PVideoFrame pltSrc = palette->GetFrame(frame, env);
+  const VideoInfo& vi = palette->GetVideoInfo();
+
+  const unsigned char
+    * pltY = pltSrc->GetReadPtr(PLANAR_Y),
+    * pltU = pltSrc->GetReadPtr(PLANAR_U),
+    * pltV = pltSrc->GetReadPtr(PLANAR_V);
+
+  if (vi.IsY8()) {
+    pltU = 0;
+    pltV = 0;
+  }
+
+  if (vi.IsPlanar())
+    buildPalettePlanar(
+      pltY, pltU, pltV, vi.width / lumaW, vi.height / lumaH,
+      pltSrc->GetPitch(PLANAR_Y), pltSrc->GetPitch(PLANAR_U), packed);
+  else
+    buildPalettePacked(
+      pltY, vi.width, vi.height, pltSrc->GetPitch(PLANAR_Y), packed);
+
+}
+
+
+
 void CLUTer::buildPalettePacked(
   const unsigned char* pltp,
   const int PLT_WIDTH, const int PLT_HEIGHT,
-  const int PLT_PITCH_SAMPLES)
+  const int PLT_PITCH_SAMPLES, std::vector<int>* palette) const
 {
 
-  std::vector<int> palette;
-
   for (int h = 0; h != PLT_HEIGHT; ++h) {
 
     int pltLine = PLT_PITCH_SAMPLES * h;
@@ -130,8 +331,8 @@ void CLUTer::buildPalettePacked(
             y2 = *(pltp + pltOfs + 2),
             v =  *(pltp + pltOfs + 3);
 
-        palette.push_back((y1 << 16) | (u << 8) | v);
-        palette.push_back((y2 << 16) | (u << 8) | v);
+        palette->push_back((y1 << 16) | (u << 8) | v);
+        palette->push_back((y2 << 16) | (u << 8) | v);
 
       } else {
 
@@ -139,7 +340,7 @@ void CLUTer::buildPalettePacked(
             g = *(pltp + pltOfs + 1),
             r = *(pltp + pltOfs + 2);
 
-        palette.push_back((r << 16) | (g << 8) | b);
+        palette->push_back((r << 16) | (g << 8) | b);
 
       }
 
@@ -147,61 +348,220 @@ void CLUTer::buildPalettePacked(
 
   }
 
-  fillComponentVectors(&palette);
-
 }
 
 
 
 void CLUTer::processFramePacked(
+  const Palette& pal,
   const unsigned char* srcp, unsigned char* dstp,
   const int SRC_WIDTH, const int SRC_HEIGHT,
   const int SRC_PITCH_SAMPLES, const int DST_PITCH_SAMPLES)
 {
 
-  for (int h = 0; h < SRC_HEIGHT; ++h) {
+  // Which kind of table is in use, and which colorspace is being processed,
+  // never changes from one pixel to the next, so rather than asking both
+  // questions for every pixel, I ask them once per frame here and hand off to
+  // a kernel built for that particular combination.
+  const PaletteTable* table = pal.table.get();
+
+  if (BrickCache* lazyCache = table->lazyCache())
+    remapPacked(
+      PaletteTable::Lazy(lazyCache), pal, srcp, dstp, SRC_WIDTH, SRC_HEIGHT,
+      SRC_PITCH_SAMPLES, DST_PITCH_SAMPLES);
+  else if (const PaletteSearch* search = table->directSearch())
+    remapPacked(
+      PaletteTable::Search(search), pal, srcp, dstp, SRC_WIDTH, SRC_HEIGHT,
+      SRC_PITCH_SAMPLES, DST_PITCH_SAMPLES);
+  else if (table->table8())
+    remapPacked(
+      PaletteTable::Direct<unsigned char>(table->table8()), pal, srcp, dstp,
+      SRC_WIDTH, SRC_HEIGHT, SRC_PITCH_SAMPLES, DST_PITCH_SAMPLES);
+  else if (table->table16())
+    remapPacked(
+      PaletteTable::Direct<unsigned short>(table->table16()), pal, srcp, dstp,
+      SRC_WIDTH, SRC_HEIGHT, SRC_PITCH_SAMPLES, DST_PITCH_SAMPLES);
+  else
+    remapPacked(
+      PaletteTable::Direct<int>(table->table32()), pal, srcp, dstp,
+      SRC_WIDTH, SRC_HEIGHT, SRC_PITCH_SAMPLES, DST_PITCH_SAMPLES);
 
-    int srcLine = SRC_PITCH_SAMPLES * h,
-        dstLine = DST_PITCH_SAMPLES * h;
+}
 
-    for (int w = 0; w < SRC_WIDTH; w += lumaW) {
 
-      int sample = w * spp;
 
-      int srcOfs = srcLine + sample,
-          dstOfs = dstLine + sample;
+template<bool IS_YUYV>
+static inline int readPacked(const unsigned char* srcp)
+{
 
-      if (YUYV) {
+  if (IS_YUYV)
+    return (srcp[0] << 16) | (srcp[1] << 8) | srcp[3];
+  else
+    return (srcp[2] << 16) | (srcp[1] << 8) | srcp[0];
 
-        unsigned char y = *(srcp + srcOfs),
-                      u = *(srcp + srcOfs + 1),
-                      v = *(srcp + srcOfs + 3);
+}
 
-        int packed = (y << 16) | (u << 8) | v;
 
-        *(dstp + dstOfs) = vecYR[packed];
-        *(dstp + dstOfs + 1) = vecUG[packed];
-        *(dstp + dstOfs + 2) = vecYR[packed];
-        *(dstp + dstOfs + 3) = vecVB[packed];
 
-      } else {
+template<bool IS_YUYV>
+static inline void writePacked(unsigned char* dstp, int outInt)
+{
 
-        unsigned char b = *(srcp + srcOfs),
-                      g = *(srcp + srcOfs + 1),
-                      r = *(srcp + srcOfs + 2);
+  unsigned char yr = (outInt >> 16) & 255,
+                ug = (outInt >> 8) & 255,
+                vb = outInt & 255;
 
-        int packed = (r << 16) | (g << 8) | b;
+  if (IS_YUYV) {
+    dstp[0] = yr;
+    dstp[1] = ug;
+    dstp[2] = yr;
+    dstp[3] = vb;
+  } else {
+    dstp[0] = vb;
+    dstp[1] = ug;
+    dstp[2] = yr;
+  }
 
-        *(dstp + dstOfs) = vecVB[packed];
-        *(dstp + dstOfs + 1) = vecUG[packed];
-        *(dstp + dstOfs + 2) = vecYR[packed];
+}
 
-      }
+
+
+// Every kernel below works a row at a time, reading a run of pixels into packed
+// colors, matching them, then writing the results back out, and only these
+// structs know how a particular frame is laid out. Rows are numbered from the
+// top of the picture; RGB is stored bottom to top, so those frames are handed
+// in starting from their last line, with a negative pitch. COUNT is in pixels,
+// or in macropixels for YUY2, which share one lookup between two pixels.
+template<int SPP, bool IS_YUYV, bool INDEX_OUT>
+struct PackedRows
+{
+
+  const unsigned char* srcp;
+  unsigned char* dstp;
+  int srcPitch, dstPitch, count, height;
+  const int* plt;
+
+  void read(int h, int w, int run, int* packed) const
+  {
+
+    const unsigned char* src = srcp + srcPitch * h + w * SPP;
+
+    for (int i = 0; i < run; ++i)
+      packed[i] = readPacked<IS_YUYV>(src + i * SPP);
+
+  }
+
+  void write(int h, int w, int run, const int* pltIdx) const
+  {
+
+    // Anything written through a char pointer might, as far as the compiler
+    // knows, have changed the members, so they're copied out first to keep
+    // them from being reloaded for every byte.
+    const int* colors = plt;
+
+    // The index plane has one byte per pixel, so a YUY2 macropixel's index
+    // is written out twice.
+    if (INDEX_OUT) {
+
+      const int PIXELS = IS_YUYV ? 2 : 1;
+
+      unsigned char* dst = dstp + dstPitch * h + w * PIXELS;
+
+      for (int i = 0; i < run; ++i)
+        for (int j = 0; j < PIXELS; ++j)
+          dst[i * PIXELS + j] = static_cast<unsigned char>(pltIdx[i]);
+
+    } else {
+
+      unsigned char* dst = dstp + dstPitch * h + w * SPP;
+
+      for (int i = 0; i < run; ++i)
+        writePacked<IS_YUYV>(dst + i * SPP, colors[pltIdx[i]]);
 
     }
 
   }
 
+};
+
+
+
+template<int SPP, bool IS_YUYV, bool INDEX_OUT>
+static PackedRows<SPP, IS_YUYV, INDEX_OUT> makePackedRows(
+  const unsigned char* srcp, unsigned char* dstp,
+  int count, int height, int srcPitch, int dstPitch, const int* plt)
+{
+
+  PackedRows<SPP, IS_YUYV, INDEX_OUT> rows;
+
+  rows.srcp = srcp;
+  rows.dstp = dstp;
+  rows.srcPitch = srcPitch;
+  rows.dstPitch = dstPitch;
+  rows.count = count;
+  rows.height = height;
+  rows.plt = plt;
+
+  // Only the index plane goes top to bottom no matter what.
+  if (!IS_YUYV) {
+    rows.srcp += srcPitch * (height - 1);
+    rows.srcPitch = -srcPitch;
+    if (!INDEX_OUT) {
+      rows.dstp += dstPitch * (height - 1);
+      rows.dstPitch = -dstPitch;
+    }
+  }
+
+  return rows;
+
+}
+
+
+
+template<typename Tlookup>
+void CLUTer::remapPacked(
+  const Tlookup& lookup, const Palette& pal,
+  const unsigned char* srcp, unsigned char* dstp,
+  const int SRC_WIDTH, const int SRC_HEIGHT,
+  const int SRC_PITCH_SAMPLES, const int DST_PITCH_SAMPLES) const
+{
+
+  if (BGRA)
+    remapPackedRows<Tlookup, 4, false>(
+      lookup, pal, srcp, dstp, SRC_WIDTH, SRC_HEIGHT,
+      SRC_PITCH_SAMPLES, DST_PITCH_SAMPLES);
+  else if (BGR)
+    remapPackedRows<Tlookup, 3, false>(
+      lookup, pal, srcp, dstp, SRC_WIDTH, SRC_HEIGHT,
+      SRC_PITCH_SAMPLES, DST_PITCH_SAMPLES);
+  else
+    remapPackedRows<Tlookup, 4, true>(
+      lookup, pal, srcp, dstp, SRC_WIDTH / 2, SRC_HEIGHT,
+      SRC_PITCH_SAMPLES, DST_PITCH_SAMPLES);
+
+}
+
+
+
+template<typename Tlookup, int SPP, bool IS_YUYV>
+void CLUTer::remapPackedRows(
+  const Tlookup& lookup, const Palette& pal,
+  const unsigned char* srcp, unsigned char* dstp,
+  const int COUNT, const int SRC_HEIGHT,
+  const int SRC_PITCH_SAMPLES, const int DST_PITCH_SAMPLES) const
+{
+
+  const int* plt = pal.table->colors();
+
+  if (indexOut)
+    processRows(lookup, pal, makePackedRows<SPP, IS_YUYV, true>(
+      srcp, dstp, COUNT, SRC_HEIGHT,
+      SRC_PITCH_SAMPLES, DST_PITCH_SAMPLES, plt));
+  else
+    processRows(lookup, pal, makePackedRows<SPP, IS_YUYV, false>(
+      srcp, dstp, COUNT, SRC_HEIGHT,
+      SRC_PITCH_SAMPLES, DST_PITCH_SAMPLES, plt));
+
 }
 
 
@@ -211,11 +571,10 @@ void CLUTer::buildPalettePlanar(
   const unsigned char* srcU,
   const unsigned char* srcV,
   const int PLT_WIDTH_U, const int PLT_HEIGHT_U,
-  const int PLT_PITCH_SAMPLES_Y, const int PLT_PITCH_SAMPLES_U)
+  const int PLT_PITCH_SAMPLES_Y, const int PLT_PITCH_SAMPLES_U,
+  std::vector<int>* palette) const
 {
 
-  std::vector<int> palette;
-
   for (int h = 0; h != PLT_HEIGHT_U; ++h) {
 
     int srcLineY = PLT_PITCH_SAMPLES_Y * h * lumaH,
@@ -243,7 +602,7 @@ void CLUTer::buildPalettePlanar(
         for (int j = 0; j < lumaW; ++j) {
 
           unsigned char y = *(srcY + srcOfsY + (PLT_PITCH_SAMPLES_Y * i) + j);
-          palette.push_back((y << 16) | (u << 8) | v);
+          palette->push_back((y << 16) | (u << 8) | v);
 
         }
 
@@ -253,13 +612,12 @@ void CLUTer::buildPalettePlanar(
 
   }
 
-  fillComponentVectors(&palette);
-
 }
 
 
 
 void CLUTer::processFramePlanar(
+  const Palette& pal,
   const unsigned char* srcY,
   const unsigned char* srcU,
   const unsigned char* srcV,
@@ -271,121 +629,527 @@ void CLUTer::processFramePlanar(
   const int DST_PITCH_SAMPLES_Y, const int DST_PITCH_SAMPLES_U)
 {
 
-  for (int h = 0; h != SRC_HEIGHT_U; ++h) {
+  const PaletteTable* table = pal.table.get();
 
-    int srcLineY = SRC_PITCH_SAMPLES_Y * h * lumaH,
-        dstLineY = DST_PITCH_SAMPLES_Y * h * lumaH;
+  if (BrickCache* lazyCache = table->lazyCache())
+    remapPlanar(
+      PaletteTable::Lazy(lazyCache), pal, srcY, srcU, srcV, dstY, dstU, dstV,
+      SRC_WIDTH_U, SRC_HEIGHT_U, SRC_PITCH_SAMPLES_Y, SRC_PITCH_SAMPLES_U,
+      DST_PITCH_SAMPLES_Y, DST_PITCH_SAMPLES_U);
+  else if (const PaletteSearch* search = table->directSearch())
+    remapPlanar(
+      PaletteTable::Search(search), pal, srcY, srcU, srcV, dstY, dstU, dstV,
+      SRC_WIDTH_U, SRC_HEIGHT_U, SRC_PITCH_SAMPLES_Y, SRC_PITCH_SAMPLES_U,
+      DST_PITCH_SAMPLES_Y, DST_PITCH_SAMPLES_U);
+  else if (table->table8())
+    remapPlanar(
+      PaletteTable::Direct<unsigned char>(table->table8()), pal,
+      srcY, srcU, srcV, dstY, dstU, dstV,
+      SRC_WIDTH_U, SRC_HEIGHT_U, SRC_PITCH_SAMPLES_Y, SRC_PITCH_SAMPLES_U,
+      DST_PITCH_SAMPLES_Y, DST_PITCH_SAMPLES_U);
+  else if (table->table16())
+    remapPlanar(
+      PaletteTable::Direct<unsigned short>(table->table16()), pal,
+      srcY, srcU, srcV, dstY, dstU, dstV,
+      SRC_WIDTH_U, SRC_HEIGHT_U, SRC_PITCH_SAMPLES_Y, SRC_PITCH_SAMPLES_U,
+      DST_PITCH_SAMPLES_Y, DST_PITCH_SAMPLES_U);
+  else
+    remapPlanar(
+      PaletteTable::Direct<int>(table->table32()), pal,
+      srcY, srcU, srcV, dstY, dstU, dstV,
+      SRC_WIDTH_U, SRC_HEIGHT_U, SRC_PITCH_SAMPLES_Y, SRC_PITCH_SAMPLES_U,
+      DST_PITCH_SAMPLES_Y, DST_PITCH_SAMPLES_U);
 
-    int srcLineU = SRC_PITCH_SAMPLES_U * h,
-        dstLineU = DST_PITCH_SAMPLES_U * h;
+}
 
-    for (int w = 0; w != SRC_WIDTH_U; ++w) {
 
-      int sampleY = w * lumaW,
-          sampleU = w;
 
-      int srcOfsY = srcLineY + sampleY,
-          srcOfsU = srcLineU + sampleU;
+// The planar counterpart to PackedRows, one chroma sample at a time. Planar
+// frames are always stored top to bottom.
+template<int LUMA_W, int LUMA_H, bool HAS_CHROMA, bool INDEX_OUT>
+struct PlanarRows
+{
 
-      int dstOfsY = dstLineY + sampleY,
-          dstOfsU = dstLineU + sampleU;
+  const unsigned char* srcY, * srcU, * srcV;
+  unsigned char* dstY, * dstU, * dstV;
+  int srcPitchY, srcPitchU, dstPitchY, dstPitchU, count, height;
+  const int* plt;
 
-      unsigned char y = *(srcY + srcOfsY),
-                    u = 0,
-                    v = 0;
+  void read(int h, int w, int run, int* packed) const
+  {
 
-      if (srcU)
-        u = *(srcU + srcOfsU);
-      if (srcV)
-        v = *(srcV + srcOfsU);
+    const unsigned char* srcLineY = srcY + srcPitchY * h * LUMA_H;
+
+    const unsigned char
+      * srcLineU = HAS_CHROMA ? srcU + srcPitchU * h : 0,
+      * srcLineV = HAS_CHROMA ? srcV + srcPitchU * h : 0;
+
+    for (int i = 0; i < run; ++i)
+      packed[i] = (srcLineY[(w + i) * LUMA_W] << 16) |
+                  (HAS_CHROMA ? (srcLineU[w + i] << 8) | srcLineV[w + i] : 0);
+
+  }
+
+  void write(int h, int w, int run, const int* pltIdx) const
+  {
 
-      int packed = (y << 16) | (u << 8) | v;
+    // As in PackedRows, the members are copied out before any writing starts.
+    const int* colors = plt;
+    const int PITCH_Y = dstPitchY;
+
+    unsigned char* dstLineY = dstY + PITCH_Y * h * LUMA_H;
+
+    unsigned char
+      * dstLineU = HAS_CHROMA && !INDEX_OUT ? dstU + dstPitchU * h : 0,
+      * dstLineV = HAS_CHROMA && !INDEX_OUT ? dstV + dstPitchU * h : 0;
+
+    for (int i = 0; i < run; ++i) {
+
+      // Same as the colors, the whole macropixel gets one palette entry, so it
+      // gets one index as well.
+      if (INDEX_OUT) {
+
+        unsigned char idx = static_cast<unsigned char>(pltIdx[i]);
+
+        for (int j = 0; j < LUMA_H; ++j)
+          for (int k = 0; k < LUMA_W; ++k)
+            dstLineY[PITCH_Y * j + (w + i) * LUMA_W + k] = idx;
+
+        continue;
+
+      }
+
+      int outInt = colors[pltIdx[i]];
 
       // TurnsTile can get away with simply zeroing its tileW_U and tileH_U
-      // members for Y8, since its fillTile function skips copying data if the
-      // height is zero. CLUTer can't use such a copy function, so I need these
-      // conditions to only write U and V if the pointers are valid.
-      if (dstU)
-        *(dstU + dstOfsU) = vecUG[packed];
-      if (dstV)
-        *(dstV + dstOfsU) = vecVB[packed];
+      // members for Y8, since its fillTile function skips copying data if
+      // the height is zero. CLUTer can't use such a copy function, so Y8
+      // gets a kernel of its own that never touches U and V.
+      if (HAS_CHROMA) {
+        dstLineU[w + i] = (outInt >> 8) & 255;
+        dstLineV[w + i] = outInt & 255;
+      }
 
       // I set each luma component in the macropixel to the same value, as
       // otherwise it'd be possible to end up with colors in the output that
-      // aren't in the palette. The only solution I can think of would involve
-      // a little too much block-by-block calculation for my taste, and
-      // wouldn't be worth the effort. CLUTer is, after all, meant to be used
-      // with TurnsTile, which will typically involve tiles large enough to
-      // hide my little shortcut.
-      for (int i = 0; i < lumaH; ++i)
-        for (int j = 0; j < lumaW; ++j)
-          *(dstY + dstOfsY + (DST_PITCH_SAMPLES_Y * i) + j) = vecYR[packed];
+      // aren't in the palette. The only solution I can think of would
+      // involve a little too much block-by-block calculation for my taste,
+      // and wouldn't be worth the effort. CLUTer is, after all, meant to be
+      // used with TurnsTile, which will typically involve tiles large enough
+      // to hide my little shortcut.
+      unsigned char outY = (outInt >> 16) & 255;
+
+      for (int j = 0; j < LUMA_H; ++j)
+        for (int k = 0; k < LUMA_W; ++k)
+          dstLineY[PITCH_Y * j + (w + i) * LUMA_W + k] = outY;
 
     }
 
   }
 
+};
+
+
+
+template<int LUMA_W, int LUMA_H, bool HAS_CHROMA, bool INDEX_OUT>
+static PlanarRows<LUMA_W, LUMA_H, HAS_CHROMA, INDEX_OUT> makePlanarRows(
+  const unsigned char* srcY,
+  const unsigned char* srcU,
+  const unsigned char* srcV,
+  unsigned char* dstY,
+  unsigned char* dstU,
+  unsigned char* dstV,
+  int count, int height,
+  int srcPitchY, int srcPitchU, int dstPitchY, int dstPitchU,
+  const int* plt)
+{
+
+  PlanarRows<LUMA_W, LUMA_H, HAS_CHROMA, INDEX_OUT> rows;
+
+  rows.srcY = srcY;
+  rows.srcU = srcU;
+  rows.srcV = srcV;
+  rows.dstY = dstY;
+  rows.dstU = dstU;
+  rows.dstV = dstV;
+  rows.srcPitchY = srcPitchY;
+  rows.srcPitchU = srcPitchU;
+  rows.dstPitchY = dstPitchY;
+  rows.dstPitchU = dstPitchU;
+  rows.count = count;
+  rows.height = height;
+  rows.plt = plt;
+
+  return rows;
+
 }
 
 
 
-void CLUTer::fillComponentVectors(std::vector<int>* plt)
+template<typename Tlookup>
+void CLUTer::remapPlanar(
+  const Tlookup& lookup, const Palette& pal,
+  const unsigned char* srcY,
+  const unsigned char* srcU,
+  const unsigned char* srcV,
+  unsigned char* dstY,
+  unsigned char* dstU,
+  unsigned char* dstV,
+  const int SRC_WIDTH_U, const int SRC_HEIGHT_U,
+  const int SRC_PITCH_SAMPLES_Y, const int SRC_PITCH_SAMPLES_U,
+  const int DST_PITCH_SAMPLES_Y, const int DST_PITCH_SAMPLES_U) const
 {
 
-  // Adding all colors from the input palette to the palette vector, then
-  // sorting it and stripping out the duplicate values, is frighteningly fast,
-  // and handily beats the std::find method I'd used previously.
-  std::sort(plt->begin(), plt->end());
-  plt->erase(std::unique(plt->begin(), plt->end()), plt->end());
+  // Y8 has no chroma planes at all, and the rest only differ in how many luma
+  // samples go with each chroma sample, so every supported planar format gets
+  // its own kernel with those numbers fixed at compile time.
+  if (Y8)
+    remapPlanarRows<Tlookup, 1, 1, false>(
+      lookup, pal, srcY, srcU, srcV, dstY, dstU, dstV,
+      SRC_WIDTH_U, SRC_HEIGHT_U,
+      SRC_PITCH_SAMPLES_Y, SRC_PITCH_SAMPLES_U,
+      DST_PITCH_SAMPLES_Y, DST_PITCH_SAMPLES_U);
+  else if (lumaW == 1 && lumaH == 1)
+    remapPlanarRows<Tlookup, 1, 1, true>(
+      lookup, pal, srcY, srcU, srcV, dstY, dstU, dstV,
+      SRC_WIDTH_U, SRC_HEIGHT_U,
+      SRC_PITCH_SAMPLES_Y, SRC_PITCH_SAMPLES_U,
+      DST_PITCH_SAMPLES_Y, DST_PITCH_SAMPLES_U);
+  else if (lumaW == 2 && lumaH == 1)
+    remapPlanarRows<Tlookup, 2, 1, true>(
+      lookup, pal, srcY, srcU, srcV, dstY, dstU, dstV,
+      SRC_WIDTH_U, SRC_HEIGHT_U,
+      SRC_PITCH_SAMPLES_Y, SRC_PITCH_SAMPLES_U,
+      DST_PITCH_SAMPLES_Y, DST_PITCH_SAMPLES_U);
+  else if (lumaW == 2 && lumaH == 2)
+    remapPlanarRows<Tlookup, 2, 2, true>(
+      lookup, pal, srcY, srcU, srcV, dstY, dstU, dstV,
+      SRC_WIDTH_U, SRC_HEIGHT_U,
+      SRC_PITCH_SAMPLES_Y, SRC_PITCH_SAMPLES_U,
+      DST_PITCH_SAMPLES_Y, DST_PITCH_SAMPLES_U);
+  else
+    remapPlanarRows<Tlookup, 4, 1, true>(
+      lookup, pal, srcY, srcU, srcV, dstY, dstU, dstV,
+      SRC_WIDTH_U, SRC_HEIGHT_U,
+      SRC_PITCH_SAMPLES_Y, SRC_PITCH_SAMPLES_U,
+      DST_PITCH_SAMPLES_Y, DST_PITCH_SAMPLES_U);
+
+}
+
+
+
+template<typename Tlookup, int LUMA_W, int LUMA_H, bool HAS_CHROMA>
+void CLUTer::remapPlanarRows(
+  const Tlookup& lookup, const Palette& pal,
+  const unsigned char* srcY,
+  const unsigned char* srcU,
+  const unsigned char* srcV,
+  unsigned char* dstY,
+  unsigned char* dstU,
+  unsigned char* dstV,
+  const int SRC_WIDTH_U, const int SRC_HEIGHT_U,
+  const int SRC_PITCH_SAMPLES_Y, const int SRC_PITCH_SAMPLES_U,
+  const int DST_PITCH_SAMPLES_Y, const int DST_PITCH_SAMPLES_U) const
+{
+
+  const int* plt = pal.table->colors();
+
+  if (indexOut)
+    processRows(lookup, pal, makePlanarRows<LUMA_W, LUMA_H, HAS_CHROMA, true>(
+      srcY, srcU, srcV, dstY, dstU, dstV, SRC_WIDTH_U, SRC_HEIGHT_U,
+      SRC_PITCH_SAMPLES_Y, SRC_PITCH_SAMPLES_U,
+      DST_PITCH_SAMPLES_Y, DST_PITCH_SAMPLES_U, plt));
+  else
+    processRows(lookup, pal, makePlanarRows<LUMA_W, LUMA_H, HAS_CHROMA, false>(
+      srcY, srcU, srcV, dstY, dstU, dstV, SRC_WIDTH_U, SRC_HEIGHT_U,
+      SRC_PITCH_SAMPLES_Y, SRC_PITCH_SAMPLES_U,
+      DST_PITCH_SAMPLES_Y, DST_PITCH_SAMPLES_U, plt));
+
+}
+
+
+
+template<typename Tlookup, typename Trows>
+void CLUTer::processRows(
+  const Tlookup& lookup, const Palette& pal, const Trows& rows) const
+{
+
+  if (dither == DITHER_FLOYD || dither == DITHER_ATKINSON)
+    diffuseRows(lookup, rows);
+  else
+    remapRows(lookup, pal, rows);
+
+}
+
+
+
+template<typename Tlookup, typename Trows>
+void CLUTer::remapRows(
+  const Tlookup& lookup, const Palette& pal, const Trows& rows) const
+{
+
+  // Rather than looking up each pixel as I read it, I gather a run of them
+  // first, look the whole run up in one go, then write it out. With a table,
+  // every lookup in the run is independent of the others, so the processor can
+  // have plenty of them in flight at once instead of waiting on each trip out
+  // to memory in turn; a direct search gets to test several pixels at once.
+  // Ordered dithering doesn't change that, since each pixel's offset depends
+  // only on where it is, so it's applied to the whole run before the lookup.
+  const bool ORDERED = dither == DITHER_BAYER;
+
+  int packed[RUN_LENGTH], pltIdx[RUN_LENGTH];
+
+  for (int h = 0; h < rows.height; ++h) {
+
+    for (int w = 0; w < rows.count; w += RUN_LENGTH) {
+
+      int run = std::min(static_cast<int>(RUN_LENGTH), rows.count - w);
+
+      rows.read(h, w, run, packed);
+
+      if (ORDERED)
+        ditherOrdered(pal, packed, run, h);
+
+      lookup(packed, pltIdx, run);
+
+      rows.write(h, w, run, pltIdx);
 
-  // All unique colors have been read from the input, and the palette's been
-  // loaded; now it's time to find the closest match for each possible output.
-  // This is another of my naive brute force techniques, but it works, and until
-  // I get smarter I'll take working over efficient.
-  for (int i = 0; i < 16777216; ++i) {
+    }
+
+  }
+
+}
+
+
+
+void CLUTer::ditherOrdered(
+  const Palette& pal, int* packed, int count, int h) const
+{
+
+  // Every run starts on a multiple of the matrix width, so each pixel's column
+  // in it is simply its position in the run. Offsets are split into what gets
+  // added and what gets taken away, each copied into every component's byte,
+  // which lets saturating byte arithmetic do the clamping.
+  const int* add = pal.bayerAdd + (h & 7) * 8,
+           * sub = pal.bayerSub + (h & 7) * 8;
+
+  int i = 0;
+
+#ifdef TURNSTILE_SSE2
+  const __m128i
+    add0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(add)),
+    add1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(add + 4)),
+    sub0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(sub)),
+    sub1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(sub + 4));
+
+  for (; i + 8 <= count; i += 8) {
+
+    __m128i* p = reinterpret_cast<__m128i*>(packed + i);
+
+    _mm_storeu_si128(p, _mm_subs_epu8(
+                          _mm_adds_epu8(_mm_loadu_si128(p), add0), sub0));
+    _mm_storeu_si128(p + 1, _mm_subs_epu8(
+                              _mm_adds_epu8(_mm_loadu_si128(p + 1), add1),
+                              sub1));
+
+  }
+#endif
+
+  for (; i < count; ++i) {
+
+    int outInt = 0;
+
+    for (int shift = 0; shift <= 16; shift += 8) {
+      int c = std::min(((packed[i] >> shift) & 255) +
+                       ((add[i & 7] >> shift) & 255), 255);
+      c = std::max(c - ((sub[i & 7] >> shift) & 255), 0);
+      outInt |= c << shift;
+    }
+
+    packed[i] = outInt;
+
+  }
+
+}
+
+
+
+static inline int clampByte(int c)
+{
+
+  return c < 0 ? 0 : c > 255 ? 255 : c;
+
+}
+
+
+
+template<typename Tlookup, typename Trows>
+void CLUTer::diffuseRows(const Tlookup& lookup, const Trows& rows) const
+{
+
+  // Error diffusion can't be done a run at a time like everything else, since
+  // each pixel depends on the ones before it, and every row on the one above.
+  // But a pixel only needs the row above it to have gotten a couple of pixels
+  // past it, so rows can still be worked on side by side, each one trailing
+  // just behind the last, like a wavefront moving down and across the frame.
+  // Rows are handed out in order, to whichever worker asks for one next, and
+  // each keeps track of how far along it is, so the row beneath it knows when
+  // it's safe to carry on.
+  //
+  // No row's errors reach more than two rows down, and no more rows than there
+  // are workers are ever in progress at once, so only that many rows of errors,
+  // plus two, need to be kept around. Rows also finish in order, since each
+  // one can only finish once the one above it has, so a row never reuses the
+  // errors of one that's still being worked on.
+  int workers = std::max(std::min(frameThreads, rows.height), 1),
+      slots = workers + 2;
+
+  std::vector<int> errors(slots * (rows.count + 4) * 3, 0);
+
+  std::unique_ptr<std::atomic<int>[]> done(new std::atomic<int>[rows.height]);
+  for (int i = 0; i < rows.height; ++i)
+    done[i].store(0, std::memory_order_relaxed);
+
+  std::atomic<int> nextRow(0);
+
+  // The pool gets one task per worker, and each of them keeps taking rows
+  // until there are none left, so the range the pool hands it doesn't matter.
+  // However few of them get a thread to themselves, the pool never has more
+  // running than there are tasks, which keeps the count of rows in progress
+  // within what the errors have room for.
+  WorkerPool::run(workers, workers,
+                  std::bind(&CLUTer::diffuseWorker<Tlookup, Trows>, this,
+                            std::cref(lookup), std::cref(rows),
+                            &errors[0], slots, done.get(), &nextRow));
+
+}
+
+
+
+template<typename Tlookup, typename Trows>
+void CLUTer::diffuseWorker(
+  const Tlookup& lookup, const Trows& rows,
+  int* errors, int slots, std::atomic<int>* done,
+  std::atomic<int>* nextRow) const
+{
+
+  // Errors are kept in sixteenths, for Floyd-Steinberg's sake, with two spare
+  // pixels on either side of each row so the edges need no special treatment.
+  // Atkinson only passes on three quarters of the error, which is what keeps
+  // its highlights and shadows from muddying.
+  const int STRIDE = (rows.count + 4) * 3;
+
+  const bool FLOYD = dither == DITHER_FLOYD;
 
-    int inYR = (i >> 16) & 255,
-        inUG = (i >> 8) & 255,
-        inVB = i & 255;
+  const int* plt = rows.plt;
 
-    int base = (*plt)[0];
+  int packed[RUN_LENGTH], pltIdx[RUN_LENGTH];
 
-    int pltYR = (base >> 16) & 255,
-        pltUG = (base >> 8) & 255,
-        pltVB = base & 255;
+  for (int h = nextRow->fetch_add(1); h < rows.height;
+       h = nextRow->fetch_add(1)) {
 
-    // For my use, the sum of absolute differences provides the same results
-    // as the Euclidean distance approach I'd been using; I'd implemented that
-    // incompletely anyway, and it worked well enough, so I have no qualms
-    // using an even simpler, faster technique.
-    int sumPrev = abs(inYR - pltYR) +
-                  abs(inUG - pltUG) +
-                  abs(inVB - pltVB);
+    int* cur = errors + (h % slots) * STRIDE + 6,
+       * next = errors + ((h + 1) % slots) * STRIDE + 6,
+       * after = errors + ((h + 2) % slots) * STRIDE + 6;
 
-    int outInt = base;
+    for (int w = 0; w < rows.count; w += RUN_LENGTH) {
 
-    for (std::vector<int>::iterator j = plt->begin(); j != plt->end(); ++j) {
+      int run = std::min(static_cast<int>(RUN_LENGTH), rows.count - w);
 
-      int pltInt = *j;
+      if (h > 0) {
+        int need = std::min(w + run + 1, rows.count);
+        while (done[h - 1].load(std::memory_order_acquire) < need)
+          std::this_thread::yield();
+      }
+
+      rows.read(h, w, run, packed);
+
+      for (int i = 0; i < run; ++i) {
+
+        int x = (w + i) * 3;
+
+        int in[3] = {
+          clampByte(((packed[i] >> 16) & 255) + ((cur[x] + 8) >> 4)),
+          clampByte(((packed[i] >> 8) & 255) + ((cur[x + 1] + 8) >> 4)),
+          clampByte((packed[i] & 255) + ((cur[x + 2] + 8) >> 4))
+        };
+
+        cur[x] = cur[x + 1] = cur[x + 2] = 0;
 
-      pltYR = (pltInt >> 16) & 255;
-      pltUG = (pltInt >> 8) & 255;
-      pltVB = pltInt & 255;
+        int inInt = (in[0] << 16) | (in[1] << 8) | in[2];
 
-      int sumCur = abs(inYR - pltYR) +
-                   abs(inUG - pltUG) +
-                   abs(inVB - pltVB);
+        lookup(&inInt, &pltIdx[i], 1);
+
+        int outInt = plt[pltIdx[i]];
+
+        for (int c = 0; c < 3; ++c) {
+
+          int err = in[c] - ((outInt >> (16 - c * 8)) & 255);
+
+          if (FLOYD) {
+            cur[x + 3 + c] += err * 7;
+            next[x - 3 + c] += err * 3;
+            next[x + c] += err * 5;
+            next[x + 3 + c] += err;
+          } else {
+            cur[x + 3 + c] += err * 2;
+            cur[x + 6 + c] += err * 2;
+            next[x - 3 + c] += err * 2;
+            next[x + c] += err * 2;
+            next[x + 3 + c] += err * 2;
+            after[x + c] += err * 2;
+          }
+
+        }
 
-      if (sumCur < sumPrev) {
-        sumPrev = sumCur;
-        outInt = pltInt;
       }
 
+      rows.write(h, w, run, pltIdx);
+
+      done[h].store(w + run, std::memory_order_release);
+
     }
 
-    vecYR.push_back((outInt >> 16) & 255);
-    vecUG.push_back((outInt >> 8) & 255);
-    vecVB.push_back(outInt & 255);
+  }
+
+}
+
+
+
+void CLUTer::buildBayerMatrix(Palette* pal) const
+{
+
+  // The usual recursive Bayer matrix, built directly: each threshold's bits
+  // come from interleaving the bits of its row with those of its row XOR its
+  // column, in reverse order. Offsets span a single step between palette
+  // colors, guessing at how far apart those are from how many there are, as
+  // if they were spread evenly over each component.
+  int pltSize = pal->table->size();
+
+  double levels = Y8 ? pltSize : std::cbrt(static_cast<double>(pltSize));
+
+  int spread = levels > 1.0 ?
+               std::min(static_cast<int>(255.0 / (levels - 1.0) + 0.5), 255) :
+               0;
+
+  // Y8 only has luma to work with, so the other components are left alone,
+  // just as they come in.
+  const int COMPONENTS = Y8 ? 0x010000 : 0x010101;
+
+  for (int y = 0; y < 8; ++y) {
+
+    for (int x = 0; x < 8; ++x) {
+
+      int t = 0;
+      for (int bit = 0; bit < 3; ++bit)
+        t = (t << 2) | ((((x ^ y) >> bit) & 1) << 1) | ((y >> bit) & 1);
+
+      int offset = (t * 2 - 63) * spread / 128;
+
+      pal->bayerAdd[y * 8 + x] = std::max(offset, 0) * COMPONENTS;
+      pal->bayerSub[y * 8 + x] = std::max(-offset, 0) * COMPONENTS;
+
+    }
 
   }
 
@@ -393,6 +1157,44 @@ void CLUTer::fillComponentVectors(std::vector<int>* plt)
 
 
 
+std::shared_ptr<const CLUTer::Palette> CLUTer::fillColorTable(
+  const std::vector<int>& plt, const PaletteTable* base,
+  IScriptEnvironment* env) const
+{
+
+  // Left to decide for myself, I search small palettes directly and use a
+  // table for anything bigger. The direct search only knows the sum of
+  // absolute differences, so any other metric always gets a table. A palette
+  // too big to search is reported before any table gets built, rather than
+  // wasting time building one only to throw it away.
+  int pltSize = static_cast<int>(plt.size());
+
+  if (lookupMode == "direct" && pltSize > PaletteSearch::MAX_COLORS)
+    env->ThrowError(
+      "CLUTer: direct lookup needs a palette of %d colors or fewer!",
+      PaletteSearch::MAX_COLORS);
+
+  if (indexOut && pltSize > 256)
+    env->ThrowError(
+      "CLUTer: index output needs a palette of 256 colors or fewer!");
+
+  bool direct = lookupMode == "direct" ||
+                (lookupMode == "auto" && metric == ColorMetric::SAD &&
+                 pltSize <= PaletteSearch::AUTO_COLORS);
+
+  std::shared_ptr<Palette> pal(new Palette);
+
+  pal->table = PaletteTable::acquire(
+    plt, pixelType, metric, lazy, direct, threads, cacheDir, base);
+
+  buildBayerMatrix(pal.get());
+
+  return pal;
+
+}
+
+
+
 int __stdcall CLUTer::SetCacheHints(int cachehints, int frame_range)
 {
 
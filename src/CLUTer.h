@@ -3,9 +3,15 @@
 
 
 
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <vector>
 
 #include "interface.h"
+#include "PaletteTable.h"
 
 
 
@@ -14,9 +20,13 @@ class CLUTer : public GenericVideoFilter
 
 public:
 
+  enum { DITHER_NONE, DITHER_BAYER, DITHER_FLOYD, DITHER_ATKINSON };
+
   CLUTer(PClip _child, PClip _palette,
-         int _pltFrame, bool _interlaced,
-         IScriptEnvironment* env);
+         int _pltFrame, bool _interlaced, int _threads, int _frameThreads,
+         bool _lazy, bool _indexOut, const char* _cacheDir,
+         const char* _lookup, int _metric, int _dither, bool _animated,
+         int _colors, int _quantize, int _samples, IScriptEnvironment* env);
 
   ~CLUTer();
 
@@ -27,29 +37,80 @@ public:
 
 private:
 
-  std::vector<unsigned char> vecYR, vecUG, vecVB;
+  static const int RUN_LENGTH = 64;
+
+  static const size_t RECENT_PALETTES = 4;
+
+  // A palette's table, along with a Bayer matrix scaled to suit it.
+  struct Palette
+  {
+    std::shared_ptr<PaletteTable> table;
+    int bayerAdd[64], bayerSub[64];
+  };
+
+  PClip palette;
+
+  std::list<std::shared_ptr<const Palette> > recent;
+
+  std::mutex recentLock;
+
+  std::vector<int> quantizedColors, quantizedPlt;
+
+  std::mutex quantizedLock;
+
+  std::string cacheDir, lookupMode;
+
+  int spp, lumaW, lumaH, threads, frameThreads, pixelType, metric, dither,
+      pltFrame, pltLast, colors, quantize, samples;
+
+  bool interlaced, lazy, indexOut, animated, PLANAR, YUYV, BGRA, BGR, Y8;
 
-  int spp, lumaW, lumaH;
+  std::shared_ptr<const Palette> paletteForFrame(
+    int n, IScriptEnvironment* env);
+
+  void readPalette(
+    int frame, std::vector<int>* plt, IScriptEnvironment* env) const;
+
+  void quantizeFrame(
+    int frame, std::vector<int>* plt, IScriptEnvironment* env);
 
-  bool PLANAR, YUYV, BGRA, BGR;
+  void readColors(
+    int frame, std::vector<int>* packed, IScriptEnvironment* env) const;
 
   void buildPalettePacked(
     const unsigned char* pltp, int width, int height,
-    const int PLT_PITCH_SAMPLES);
+    const int PLT_PITCH_SAMPLES, std::vector<int>* plt) const;
 
   void processFramePacked(
+    const Palette& pal,
     const unsigned char* srcp, unsigned char* dstp,
     int width, int height,
     const int SRC_PITCH_SAMPLES, const int DST_PITCH_SAMPLES);
 
+  template<typename Tlookup>
+  void remapPacked(
+    const Tlookup& lookup, const Palette& pal,
+    const unsigned char* srcp, unsigned char* dstp,
+    int width, int height,
+    const int SRC_PITCH_SAMPLES, const int DST_PITCH_SAMPLES) const;
+
+  template<typename Tlookup, int SPP, bool IS_YUYV>
+  void remapPackedRows(
+    const Tlookup& lookup, const Palette& pal,
+    const unsigned char* srcp, unsigned char* dstp,
+    int count, int height,
+    const int SRC_PITCH_SAMPLES, const int DST_PITCH_SAMPLES) const;
+
   void buildPalettePlanar(
     const unsigned char* pltY,
     const unsigned char* pltU,
     const unsigned char* pltV,
     int widthU, int heightU,
-    const int PLT_PITCH_SAMPLES_Y, const int PLT_PITCH_SAMPLES_U);
+    const int PLT_PITCH_SAMPLES_Y, const int PLT_PITCH_SAMPLES_U,
+    std::vector<int>* plt) const;
 
   void processFramePlanar(
+    const Palette& pal,
     const unsigned char* srcY,
     const unsigned char* srcU,
     const unsigned char* srcV,
@@ -60,7 +121,56 @@ private:
     const int SRC_PITCH_SAMPLES_Y, const int SRC_PITCH_SAMPLES_U,
     const int DST_PITCH_SAMPLES_Y, const int DST_PITCH_SAMPLES_U);
 
-  void fillComponentVectors(std::vector<int>* pltMain);
+  template<typename Tlookup>
+  void remapPlanar(
+    const Tlookup& lookup, const Palette& pal,
+    const unsigned char* srcY,
+    const unsigned char* srcU,
+    const unsigned char* srcV,
+    unsigned char* dstY,
+    unsigned char* dstU,
+    unsigned char* dstV,
+    const int SRC_WIDTH_U, const int SRC_HEIGHT_U,
+    const int SRC_PITCH_SAMPLES_Y, const int SRC_PITCH_SAMPLES_U,
+    const int DST_PITCH_SAMPLES_Y, const int DST_PITCH_SAMPLES_U) const;
+
+  template<typename Tlookup, int LUMA_W, int LUMA_H, bool HAS_CHROMA>
+  void remapPlanarRows(
+    const Tlookup& lookup, const Palette& pal,
+    const unsigned char* srcY,
+    const unsigned char* srcU,
+    const unsigned char* srcV,
+    unsigned char* dstY,
+    unsigned char* dstU,
+    unsigned char* dstV,
+    const int SRC_WIDTH_U, const int SRC_HEIGHT_U,
+    const int SRC_PITCH_SAMPLES_Y, const int SRC_PITCH_SAMPLES_U,
+    const int DST_PITCH_SAMPLES_Y, const int DST_PITCH_SAMPLES_U) const;
+
+  template<typename Tlookup, typename Trows>
+  void processRows(
+    const Tlookup& lookup, const Palette& pal, const Trows& rows) const;
+
+  template<typename Tlookup, typename Trows>
+  void remapRows(
+    const Tlookup& lookup, const Palette& pal, const Trows& rows) const;
+
+  void ditherOrdered(const Palette& pal, int* packed, int count, int h) const;
+
+  template<typename Tlookup, typename Trows>
+  void diffuseRows(const Tlookup& lookup, const Trows& rows) const;
+
+  template<typename Tlookup, typename Trows>
+  void diffuseWorker(
+    const Tlookup& lookup, const Trows& rows,
+    int* errors, int slots, std::atomic<int>* done,
+    std::atomic<int>* nextRow) const;
+
+  void buildBayerMatrix(Palette* pal) const;
+
+  std::shared_ptr<const Palette> fillColorTable(
+    const std::vector<int>& plt, const PaletteTable* base,
+    IScriptEnvironment* env) const;
 
 };
 
@@ -0,0 +1,261 @@
+#include "ColorMetric.h"
+
+#include <cmath>
+#include <cstring>
+
+#include <algorithm>
+
+#include "interface.h"
+
+
+
+// Rec. 601 at TV range, which is what Avisynth assumes of YUV unless told
+// otherwise, offset so the input is (Y - 16, U - 128, V - 128).
+static const float YUV_TO_RGB[3][3] = {
+  { 1.164383f,  0.000000f,  1.596027f },
+  { 1.164383f, -0.391762f, -0.812968f },
+  { 1.164383f,  2.017232f,  0.000000f }
+};
+
+// Linear sRGB to CIE XYZ, with each row already divided through by the D65
+// white point, so the results can go straight into the Lab transfer function.
+static const float RGB_TO_XYZ[3][3] = {
+  { 0.4124564f / 0.95047f, 0.3575761f / 0.95047f, 0.1804375f / 0.95047f },
+  { 0.2126729f,            0.7151522f,            0.0721750f            },
+  { 0.0193339f / 1.08883f, 0.1191920f / 1.08883f, 0.9503041f / 1.08883f }
+};
+
+// The transfer function's outputs to L*, a*, and b*; L* is offset by -16.
+static const float F_TO_LAB[3][3] = {
+  {   0.0f,  116.0f,    0.0f },
+  { 500.0f, -500.0f,    0.0f },
+  {   0.0f,  200.0f, -200.0f }
+};
+
+// Björn Ottosson's OKLab, linear sRGB to cone responses, then the cube roots
+// of those to L, a, and b.
+static const float RGB_TO_LMS[3][3] = {
+  { 0.4122214708f, 0.5363325363f, 0.0514459929f },
+  { 0.2119034982f, 0.6806995451f, 0.1073969566f },
+  { 0.0883024619f, 0.2817188376f, 0.6299787005f }
+};
+
+static const float LMS_TO_OKLAB[3][3] = {
+  { 0.2104542553f,  0.7936177850f, -0.0040720468f },
+  { 1.9779984951f, -2.4285922050f,  0.4505937099f },
+  { 0.0259040371f,  0.7827717662f, -0.8086757660f }
+};
+
+
+
+// Every step of every conversion works on a range of values rather than just
+// one, so the same code that converts a single color can also say where an
+// entire box of colors might end up. With a matrix, each output is smallest
+// when every input with a positive coefficient is at its low end and every one
+// with a negative coefficient is at its high end, and the other way around for
+// the largest. Floating point rounding never reverses the order of two values,
+// so a color's converted value always lands inside its box's converted range,
+// and it's exactly the value the single color conversion gives, since that's
+// the same arithmetic done on a range of width zero.
+static void transform(
+  const float m[3][3], const float* inLo, const float* inHi,
+  float* outLo, float* outHi)
+{
+
+  for (int i = 0; i < 3; ++i) {
+
+    float lo = 0.0f, hi = 0.0f;
+
+    for (int j = 0; j < 3; ++j) {
+      if (m[i][j] >= 0.0f) {
+        lo += m[i][j] * inLo[j];
+        hi += m[i][j] * inHi[j];
+      } else {
+        lo += m[i][j] * inHi[j];
+        hi += m[i][j] * inLo[j];
+      }
+    }
+
+    outLo[i] = lo;
+    outHi[i] = hi;
+
+  }
+
+}
+
+
+
+static inline float labTransfer(float t)
+{
+
+  const float DELTA = 6.0f / 29.0f;
+
+  return t > DELTA * DELTA * DELTA ? std::cbrt(t) :
+                                     t / (3.0f * DELTA * DELTA) + 4.0f / 29.0f;
+
+}
+
+
+
+ColorMetric::ColorMetric(int _metric, int _pixelType) :
+  metric(_metric)
+{
+
+  VideoInfo vi = VideoInfo();
+  vi.pixel_type = _pixelType;
+
+  yuv = vi.IsYUV();
+  y8 = vi.IsY8();
+
+  // Weighted RGB is plain Euclidean distance, but with green counting for
+  // the most and blue for the least, which is a cheap and well worn stand-in
+  // for how sensitive the eye is to each.
+  w[0] = w[1] = w[2] = 1.0f;
+  if (metric == WRGB) {
+    w[0] = 2.0f;
+    w[1] = 4.0f;
+    w[2] = 3.0f;
+  }
+
+  for (int i = 0; i < 256; ++i) {
+    float c = i / 255.0f;
+    linear[i] = c <= 0.04045f ? c / 12.92f :
+                                static_cast<float>(
+                                  std::pow((c + 0.055f) / 1.055f, 2.4f));
+  }
+
+}
+
+
+
+ColorMetric::~ColorMetric()
+{
+}
+
+
+
+int ColorMetric::parse(const char* name)
+{
+
+  return strcmp(name, "sad") == 0 ?       SAD :
+         strcmp(name, "wrgb") == 0 ?      WRGB :
+         strcmp(name, "euclidean") == 0 ? EUCLIDEAN :
+         strcmp(name, "lab") == 0 ?       LAB :
+         strcmp(name, "oklab") == 0 ?     OKLAB :
+                                          -1;
+
+}
+
+
+
+void ColorMetric::toSpace(int packed, float* out) const
+{
+
+  float unused[3];
+
+  int yr = (packed >> 16) & 255,
+      ug = (packed >> 8) & 255,
+      vb = packed & 255;
+
+  boxToSpace(yr, ug, vb, yr, ug, vb, out, unused);
+
+}
+
+
+
+void ColorMetric::boxToSpace(
+  int loYR, int loUG, int loVB, int hiYR, int hiUG, int hiVB,
+  float* outLo, float* outHi) const
+{
+
+  float lo[3] = { static_cast<float>(loYR),
+                  static_cast<float>(loUG),
+                  static_cast<float>(loVB) },
+        hi[3] = { static_cast<float>(hiYR),
+                  static_cast<float>(hiUG),
+                  static_cast<float>(hiVB) };
+
+  // Euclidean distance is taken on the components as they are, whatever the
+  // colorspace, just like the sum of absolute differences.
+  if (metric == EUCLIDEAN) {
+    for (int i = 0; i < 3; ++i) {
+      outLo[i] = lo[i];
+      outHi[i] = hi[i];
+    }
+    return;
+  }
+
+  // Everything else is defined in terms of RGB, so YUV gets converted first,
+  // and rounded back to whole values, as if it were headed for the screen. Y8
+  // has no chroma to speak of, so I treat every color as a shade of gray.
+  int rgbLo[3] = { loYR, loUG, loVB },
+      rgbHi[3] = { hiYR, hiUG, hiVB };
+
+  if (yuv) {
+
+    float yuvLo[3] = { lo[0] - 16.0f, lo[1] - 128.0f, lo[2] - 128.0f },
+          yuvHi[3] = { hi[0] - 16.0f, hi[1] - 128.0f, hi[2] - 128.0f };
+
+    if (y8)
+      yuvLo[1] = yuvLo[2] = yuvHi[1] = yuvHi[2] = 0.0f;
+
+    float rgbfLo[3], rgbfHi[3];
+    transform(YUV_TO_RGB, yuvLo, yuvHi, rgbfLo, rgbfHi);
+
+    for (int i = 0; i < 3; ++i) {
+      rgbLo[i] = static_cast<int>(
+        std::floor(std::min(std::max(rgbfLo[i], 0.0f), 255.0f) + 0.5f));
+      rgbHi[i] = static_cast<int>(
+        std::floor(std::min(std::max(rgbfHi[i], 0.0f), 255.0f) + 0.5f));
+    }
+
+  }
+
+  if (metric == WRGB) {
+    for (int i = 0; i < 3; ++i) {
+      outLo[i] = static_cast<float>(rgbLo[i]);
+      outHi[i] = static_cast<float>(rgbHi[i]);
+    }
+    return;
+  }
+
+  float linLo[3], linHi[3];
+  for (int i = 0; i < 3; ++i) {
+    linLo[i] = linear[rgbLo[i]];
+    linHi[i] = linear[rgbHi[i]];
+  }
+
+  // The cube roots are by far the most expensive part of either conversion,
+  // so they're skipped for the high end of a range that's only one value wide.
+  float midLo[3], midHi[3];
+
+  if (metric == LAB) {
+
+    transform(RGB_TO_XYZ, linLo, linHi, midLo, midHi);
+
+    for (int i = 0; i < 3; ++i) {
+      bool same = midLo[i] == midHi[i];
+      midLo[i] = labTransfer(midLo[i]);
+      midHi[i] = same ? midLo[i] : labTransfer(midHi[i]);
+    }
+
+    transform(F_TO_LAB, midLo, midHi, outLo, outHi);
+
+    outLo[0] -= 16.0f;
+    outHi[0] -= 16.0f;
+
+  } else {
+
+    transform(RGB_TO_LMS, linLo, linHi, midLo, midHi);
+
+    for (int i = 0; i < 3; ++i) {
+      bool same = midLo[i] == midHi[i];
+      midLo[i] = std::cbrt(midLo[i]);
+      midHi[i] = same ? midLo[i] : std::cbrt(midHi[i]);
+    }
+
+    transform(LMS_TO_OKLAB, midLo, midHi, outLo, outHi);
+
+  }
+
+}
@@ -0,0 +1,43 @@
+#ifndef TURNSTILE_SRC_COLORMETRIC_H_INCLUDED
+#define TURNSTILE_SRC_COLORMETRIC_H_INCLUDED
+
+
+
+class ColorMetric
+{
+
+public:
+
+  enum { SAD, WRGB, EUCLIDEAN, LAB, OKLAB };
+
+  ColorMetric(int _metric, int _pixelType);
+
+  ~ColorMetric();
+
+  static int parse(const char* name);
+
+  int id() const { return metric; }
+
+  const float* weights() const { return w; }
+
+  void toSpace(int packed, float* out) const;
+
+  void boxToSpace(
+    int loYR, int loUG, int loVB, int hiYR, int hiUG, int hiVB,
+    float* outLo, float* outHi) const;
+
+private:
+
+  int metric;
+
+  bool yuv, y8;
+
+  float w[3];
+
+  float linear[256];
+
+};
+
+
+
+#endif // TURNSTILE_SRC_COLORMETRIC_H_INCLUDED
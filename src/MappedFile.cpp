@@ -0,0 +1,202 @@
+#include "MappedFile.h"
+
+#include <cstdio>
+
+#include <chrono>
+#include <fstream>
+#include <string>
+
+#ifdef _WIN32
+  #ifndef WIN32_LEAN_AND_MEAN
+    #define WIN32_LEAN_AND_MEAN
+  #endif
+  #ifndef NOMINMAX
+    #define NOMINMAX
+  #endif
+  #include <windows.h>
+#else
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
+
+
+MappedFile::MappedFile() :
+  ptr(0), len(0)
+#ifdef _WIN32
+  , file(INVALID_HANDLE_VALUE), mapping(0)
+#endif
+{
+}
+
+
+
+MappedFile::~MappedFile()
+{
+
+  close();
+
+}
+
+
+
+bool MappedFile::open(const std::string& path)
+{
+
+  close();
+
+#ifdef _WIN32
+
+  file = CreateFileA(
+    path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, 0,
+    OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+  if (file == INVALID_HANDLE_VALUE)
+    return false;
+
+  LARGE_INTEGER fileSize;
+  if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+    close();
+    return false;
+  }
+
+  mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+  if (!mapping) {
+    close();
+    return false;
+  }
+
+  ptr = static_cast<const unsigned char*>(
+    MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+  if (!ptr) {
+    close();
+    return false;
+  }
+
+  len = static_cast<size_t>(fileSize.QuadPart);
+
+#else
+
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    ::close(fd);
+    return false;
+  }
+
+  // Once the mapping exists it holds its own reference to the file, so the
+  // descriptor isn't needed any longer.
+  void* view = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (view == MAP_FAILED)
+    return false;
+
+  ptr = static_cast<const unsigned char*>(view);
+  len = static_cast<size_t>(st.st_size);
+
+#endif
+
+  return true;
+
+}
+
+
+
+void MappedFile::close()
+{
+
+#ifdef _WIN32
+
+  if (ptr)
+    UnmapViewOfFile(ptr);
+  if (mapping)
+    CloseHandle(mapping);
+  if (file != INVALID_HANDLE_VALUE)
+    CloseHandle(file);
+
+  mapping = 0;
+  file = INVALID_HANDLE_VALUE;
+
+#else
+
+  if (ptr)
+    munmap(const_cast<unsigned char*>(ptr), len);
+
+#endif
+
+  ptr = 0;
+  len = 0;
+
+}
+
+
+
+bool MappedFile::replace(
+  const std::string& path, const void* const* chunks, const size_t* sizes,
+  int count)
+{
+
+  // Other processes may be opening the same file while it's being written, so
+  // everything goes to a uniquely named temporary file first, which is then
+  // renamed over the real one. A reader will either find no file at all or a
+  // complete one, never half of one. Windows won't replace a file somebody
+  // else has mapped, but in that case their file is as good as mine.
+  std::string tmpPath = path + "." + std::to_string(
+    std::chrono::steady_clock::now().time_since_epoch().count()) + ".tmp";
+
+  {
+
+    std::ofstream out(tmpPath.c_str(), std::ios::binary | std::ios::trunc);
+
+    for (int i = 0; i < count && out; ++i)
+      out.write(static_cast<const char*>(chunks[i]), sizes[i]);
+
+    if (!out) {
+      out.close();
+      std::remove(tmpPath.c_str());
+      return false;
+    }
+
+  }
+
+#ifdef _WIN32
+  bool renamed = MoveFileExA(
+    tmpPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+  bool renamed = std::rename(tmpPath.c_str(), path.c_str()) == 0;
+#endif
+
+  if (!renamed) {
+    std::remove(tmpPath.c_str());
+    return false;
+  }
+
+  return true;
+
+}
+
+
+
+bool MappedFile::isDirectory(const std::string& path)
+{
+
+#ifdef _WIN32
+
+  DWORD attrs = GetFileAttributesA(path.c_str());
+
+  return attrs != INVALID_FILE_ATTRIBUTES &&
+         (attrs & FILE_ATTRIBUTE_DIRECTORY);
+
+#else
+
+  struct stat st;
+
+  return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+
+#endif
+
+}
@@ -0,0 +1,54 @@
+#ifndef TURNSTILE_SRC_MAPPEDFILE_H_INCLUDED
+#define TURNSTILE_SRC_MAPPEDFILE_H_INCLUDED
+
+
+
+#include <cstddef>
+
+#include <string>
+
+
+
+class MappedFile
+{
+
+public:
+
+  MappedFile();
+
+  ~MappedFile();
+
+  bool open(const std::string& path);
+
+  void close();
+
+  const unsigned char* data() const { return ptr; }
+
+  size_t size() const { return len; }
+
+  static bool replace(
+    const std::string& path, const void* const* chunks, const size_t* sizes,
+    int count);
+
+  static bool isDirectory(const std::string& path);
+
+private:
+
+  MappedFile(const MappedFile&);
+
+  MappedFile& operator=(const MappedFile&);
+
+  const unsigned char* ptr;
+
+  size_t len;
+
+#ifdef _WIN32
+  void* file;
+  void* mapping;
+#endif
+
+};
+
+
+
+#endif // TURNSTILE_SRC_MAPPEDFILE_H_INCLUDED
@@ -0,0 +1,891 @@
+#include "PaletteGrid.h"
+
+#include <cfloat>
+#include <cstdlib>
+
+#include <algorithm>
+#include <vector>
+
+#include "ColorMetric.h"
+#include "simd.h"
+
+
+
+// The coarse level of the grid divides the color cube into 8x8x8 cells, each
+// holding four bricks on a side.
+static const int COARSE_DIM = 32;
+static const int COARSE_PER_DIM = 256 / COARSE_DIM;
+
+// With this few candidates left in a box, it's quicker to test every color in
+// it than to keep subdividing.
+static const int LEAF_CANDIDATES = 16;
+
+
+
+static inline int brickEntry(int yr, int ug, int vb)
+{
+
+  const int MASK = PaletteGrid::BRICK_DIM - 1;
+
+  return ((yr & MASK) << (PaletteGrid::BRICK_SHIFT * 2)) |
+         ((ug & MASK) << PaletteGrid::BRICK_SHIFT) |
+         (vb & MASK);
+
+}
+
+
+
+PaletteGrid::PaletteGrid(
+  const std::vector<int>& _plt, bool _simd, int _metric, int _pixelType) :
+  simd(_simd), metric(_metric, _pixelType)
+{
+
+  // Any metric besides the sum of absolute differences measures distance
+  // somewhere other than the color cube itself, so each palette entry is
+  // converted just once, up front, and the grid prunes and searches in that
+  // space instead; see filterPoints.
+  if (metric.id() != ColorMetric::SAD) {
+
+    Points all;
+    all.resize(static_cast<int>(_plt.size()));
+    all.count = static_cast<int>(_plt.size());
+
+    for (int i = 0; i < all.count; ++i) {
+      float p[3];
+      metric.toSpace(_plt[i], p);
+      all.x[i] = p[0];
+      all.y[i] = p[1];
+      all.z[i] = p[2];
+      all.idx[i] = i;
+    }
+
+    coarsePoints.resize(COARSE_PER_DIM * COARSE_PER_DIM * COARSE_PER_DIM);
+
+    for (int y = 0; y < COARSE_PER_DIM; ++y)
+      for (int u = 0; u < COARSE_PER_DIM; ++u)
+        for (int v = 0; v < COARSE_PER_DIM; ++v)
+          filterPoints(
+            all, &coarsePoints[(y * COARSE_PER_DIM + u) * COARSE_PER_DIM + v],
+            y * COARSE_DIM, u * COARSE_DIM, v * COARSE_DIM, COARSE_DIM);
+
+    return;
+
+  }
+
+  Candidates all;
+
+  for (std::vector<int>::const_iterator i = _plt.begin(); i != _plt.end(); ++i) {
+    all.yr.push_back((*i >> 16) & 255);
+    all.ug.push_back((*i >> 8) & 255);
+    all.vb.push_back(*i & 255);
+    all.idx.push_back(static_cast<int>(i - _plt.begin()));
+  }
+  all.count = static_cast<int>(_plt.size());
+  all.dist.resize(all.count);
+
+  coarse.resize(COARSE_PER_DIM * COARSE_PER_DIM * COARSE_PER_DIM);
+
+  for (std::vector<Candidates>::iterator i = coarse.begin();
+       i != coarse.end(); ++i)
+    i->resize(all.count);
+
+  for (int y = 0; y < COARSE_PER_DIM; ++y)
+    for (int u = 0; u < COARSE_PER_DIM; ++u)
+      for (int v = 0; v < COARSE_PER_DIM; ++v)
+        filterCandidates(
+          all, &coarse[(y * COARSE_PER_DIM + u) * COARSE_PER_DIM + v],
+          y * COARSE_DIM, u * COARSE_DIM, v * COARSE_DIM, COARSE_DIM);
+
+}
+
+
+
+PaletteGrid::~PaletteGrid()
+{
+}
+
+
+
+void PaletteGrid::fillBrick(int brick, int* pltIdx) const
+{
+
+  if (metric.id() != ColorMetric::SAD) {
+    fillBrickMetric(brick, pltIdx);
+    return;
+  }
+
+  int by = brick >> 10,
+      bu = (brick >> 5) & 31,
+      bv = brick & 31;
+
+  const int BRICKS_PER_COARSE = COARSE_DIM / BRICK_DIM;
+
+  const Candidates& parent =
+    coarse[((by / BRICKS_PER_COARSE) * COARSE_PER_DIM +
+            (bu / BRICKS_PER_COARSE)) * COARSE_PER_DIM +
+            (bv / BRICKS_PER_COARSE)];
+
+  // One scratch level per halving of the box, from the brick itself down to a
+  // single color; no level can ever hold more candidates than its parent.
+  std::vector<Candidates> levels(BRICK_SHIFT + 1);
+  for (std::vector<Candidates>::iterator i = levels.begin();
+       i != levels.end(); ++i)
+    i->resize(parent.count);
+
+  fillBox(
+    parent, levels, 0,
+    by * BRICK_DIM, bu * BRICK_DIM, bv * BRICK_DIM, BRICK_DIM,
+    pltIdx);
+
+}
+
+
+
+bool PaletteGrid::brickMayUse(
+  int brick, const std::vector<bool>& entries) const
+{
+
+  // The same pruning fillBrick starts with already keeps every entry that could
+  // be the closest match for any color in the brick, ties included, so if none
+  // of the given entries survive it, none of them can win anywhere in it. Most
+  // coarse cells don't hold any of them to begin with, so those are ruled out
+  // before doing any real work.
+  int by = brick >> 10,
+      bu = (brick >> 5) & 31,
+      bv = brick & 31;
+
+  const int BRICKS_PER_COARSE = COARSE_DIM / BRICK_DIM;
+
+  const int CELL = ((by / BRICKS_PER_COARSE) * COARSE_PER_DIM +
+                    (bu / BRICKS_PER_COARSE)) * COARSE_PER_DIM +
+                    (bv / BRICKS_PER_COARSE);
+
+  if (metric.id() != ColorMetric::SAD) {
+
+    const Points& parent = coarsePoints[CELL];
+
+    bool any = false;
+    for (int i = 0; i < parent.count && !any; ++i)
+      any = entries[parent.idx[i]];
+
+    if (!any)
+      return false;
+
+    Points cands;
+    filterPoints(
+      parent, &cands,
+      by * BRICK_DIM, bu * BRICK_DIM, bv * BRICK_DIM, BRICK_DIM);
+
+    for (int i = 0; i < cands.count; ++i)
+      if (entries[cands.idx[i]])
+        return true;
+
+    return false;
+
+  }
+
+  const Candidates& parent = coarse[CELL];
+
+  bool any = false;
+  for (int i = 0; i < parent.count && !any; ++i)
+    any = entries[parent.idx[i]];
+
+  if (!any)
+    return false;
+
+  Candidates cands;
+  cands.resize(parent.count);
+
+  filterCandidates(
+    parent, &cands,
+    by * BRICK_DIM, bu * BRICK_DIM, bv * BRICK_DIM, BRICK_DIM);
+
+  for (int i = 0; i < cands.count; ++i)
+    if (entries[cands.idx[i]])
+      return true;
+
+  return false;
+
+}
+
+
+
+int PaletteGrid::brickToColor(int brick, int entry)
+{
+
+  int yr = ((brick >> 10) << BRICK_SHIFT) | (entry >> (BRICK_SHIFT * 2)),
+      ug = (((brick >> 5) & 31) << BRICK_SHIFT) |
+           ((entry >> BRICK_SHIFT) & (BRICK_DIM - 1)),
+      vb = ((brick & 31) << BRICK_SHIFT) | (entry & (BRICK_DIM - 1));
+
+  return (yr << 16) | (ug << 8) | vb;
+
+}
+
+
+
+void PaletteGrid::filterCandidates(
+  const Candidates& in, Candidates* out,
+  int loYR, int loUG, int loVB, int dim) const
+{
+
+  // A palette entry can only be the closest match for some color in the box if
+  // its minimum possible distance to the box is no greater than the smallest
+  // maximum distance of any entry. That alone doesn't narrow things down much
+  // when entries differ in only one component, though, so anything that's
+  // farther than the best entry's worst case for every color in the box gets
+  // thrown out as well. With the sum of absolute differences, that comparison
+  // works one component at a time, and each component's contribution is
+  // smallest at one end of the box or the other.
+  //
+  // Anything that ties is kept, in palette order, so the final pick is the
+  // same first-found winner the old brute force search produced.
+  Box box;
+  box.loYR = loYR;
+  box.loUG = loUG;
+  box.loVB = loVB;
+  box.hiYR = loYR + dim - 1;
+  box.hiUG = loUG + dim - 1;
+  box.hiVB = loVB + dim - 1;
+
+  int best = 766, bestIdx = 0, start = 0;
+
+#ifdef TURNSTILE_SSE2
+  if (simd) {
+    start = in.count & ~15;
+    findBestSSE2(in, start, box, out, &best, &bestIdx);
+  }
+#endif
+
+  findBestC(in, start, in.count, box, &best, &bestIdx);
+
+  int count = 0;
+
+#ifdef TURNSTILE_SSE2
+  if (simd)
+    count = keepCandidatesSSE2(in, start, box, best, bestIdx, out);
+#endif
+
+  count = keepCandidatesC(in, start, in.count, box, best, bestIdx, out, count);
+
+  out->count = count;
+
+}
+
+
+
+void PaletteGrid::findBestC(
+  const Candidates& in, int first, int last, const Box& box,
+  int* best, int* bestIdx)
+{
+
+  for (int i = first; i < last; ++i) {
+
+    int yr = in.yr[i],
+        ug = in.ug[i],
+        vb = in.vb[i];
+
+    int dmax = std::max(yr - box.loYR, box.hiYR - yr) +
+               std::max(ug - box.loUG, box.hiUG - ug) +
+               std::max(vb - box.loVB, box.hiVB - vb);
+
+    if (dmax < *best) {
+      *best = dmax;
+      *bestIdx = i;
+    }
+
+  }
+
+}
+
+
+
+int PaletteGrid::keepCandidatesC(
+  const Candidates& in, int first, int last, const Box& box,
+  int best, int bestIdx, Candidates* out, int count)
+{
+
+  int bestYR = in.yr[bestIdx],
+      bestUG = in.ug[bestIdx],
+      bestVB = in.vb[bestIdx];
+
+  for (int i = first; i < last; ++i) {
+
+    int yr = in.yr[i],
+        ug = in.ug[i],
+        vb = in.vb[i];
+
+    int dmin = std::max(box.loYR - yr, 0) + std::max(yr - box.hiYR, 0) +
+               std::max(box.loUG - ug, 0) + std::max(ug - box.hiUG, 0) +
+               std::max(box.loVB - vb, 0) + std::max(vb - box.hiVB, 0);
+
+    if (dmin > best)
+      continue;
+
+    int margin =
+      std::min(abs(box.loYR - yr) - abs(box.loYR - bestYR),
+               abs(box.hiYR - yr) - abs(box.hiYR - bestYR)) +
+      std::min(abs(box.loUG - ug) - abs(box.loUG - bestUG),
+               abs(box.hiUG - ug) - abs(box.hiUG - bestUG)) +
+      std::min(abs(box.loVB - vb) - abs(box.loVB - bestVB),
+               abs(box.hiVB - vb) - abs(box.hiVB - bestVB));
+
+    if (margin > 0)
+      continue;
+
+    out->yr[count] = yr;
+    out->ug[count] = ug;
+    out->vb[count] = vb;
+    out->idx[count] = in.idx[i];
+    ++count;
+
+  }
+
+  return count;
+
+}
+
+
+
+void PaletteGrid::searchBoxC(
+  const Candidates& cands, int loYR, int loUG, int loVB, int dim,
+  int* pltIdx)
+{
+
+  for (int y = loYR; y < loYR + dim; ++y) {
+
+    for (int u = loUG; u < loUG + dim; ++u) {
+
+      for (int v = loVB; v < loVB + dim; ++v) {
+
+        int best = 766, win = 0;
+
+        for (int i = 0; i < cands.count; ++i) {
+
+          int sum = abs(y - cands.yr[i]) +
+                    abs(u - cands.ug[i]) +
+                    abs(v - cands.vb[i]);
+
+          if (sum < best) {
+            best = sum;
+            win = cands.idx[i];
+          }
+
+        }
+
+        pltIdx[brickEntry(y, u, v)] = win;
+
+      }
+
+    }
+
+  }
+
+}
+
+
+
+// Both the pruning and the search below add up a metric's distance in exactly
+// this order, so a bound and the distance it stands in for are always rounded
+// the same way.
+static inline float spaceDistance(
+  const float* w, float dx, float dy, float dz)
+{
+
+  return w[0] * (dx * dx) + w[1] * (dy * dy) + w[2] * (dz * dz);
+
+}
+
+
+
+void PaletteGrid::filterPoints(
+  const Points& in, Points* out,
+  int loYR, int loUG, int loVB, int dim) const
+{
+
+  // This is the same test filterCandidates starts with, only in the metric's
+  // own space. The box is converted as a range, which gives limits on every
+  // coordinate any of its colors can end up with, and from those, the nearest
+  // and farthest each entry could possibly be. Without the extra margin test,
+  // this keeps a few more candidates than it strictly needs to, but the search
+  // that follows is exact either way.
+  float lo[3], hi[3];
+
+  metric.boxToSpace(
+    loYR, loUG, loVB, loYR + dim - 1, loUG + dim - 1, loVB + dim - 1, lo, hi);
+
+  const float* w = metric.weights();
+
+  float best = FLT_MAX;
+
+  for (int i = 0; i < in.count; ++i) {
+
+    float dmax = spaceDistance(w,
+                               std::max(in.x[i] - lo[0], hi[0] - in.x[i]),
+                               std::max(in.y[i] - lo[1], hi[1] - in.y[i]),
+                               std::max(in.z[i] - lo[2], hi[2] - in.z[i]));
+
+    best = std::min(best, dmax);
+
+  }
+
+  out->resize(in.count);
+
+  int count = 0;
+
+  for (int i = 0; i < in.count; ++i) {
+
+    float dmin = spaceDistance(
+                   w,
+                   std::max(std::max(lo[0] - in.x[i], in.x[i] - hi[0]), 0.0f),
+                   std::max(std::max(lo[1] - in.y[i], in.y[i] - hi[1]), 0.0f),
+                   std::max(std::max(lo[2] - in.z[i], in.z[i] - hi[2]), 0.0f));
+
+    if (dmin > best)
+      continue;
+
+    out->x[count] = in.x[i];
+    out->y[count] = in.y[i];
+    out->z[count] = in.z[i];
+    out->idx[count] = in.idx[i];
+    ++count;
+
+  }
+
+  out->count = count;
+
+}
+
+
+
+void PaletteGrid::fillBrickMetric(int brick, int* pltIdx) const
+{
+
+  int by = brick >> 10,
+      bu = (brick >> 5) & 31,
+      bv = brick & 31;
+
+  const int BRICKS_PER_COARSE = COARSE_DIM / BRICK_DIM;
+
+  const Points& parent =
+    coarsePoints[((by / BRICKS_PER_COARSE) * COARSE_PER_DIM +
+                  (bu / BRICKS_PER_COARSE)) * COARSE_PER_DIM +
+                  (bv / BRICKS_PER_COARSE)];
+
+  Points cands;
+  filterPoints(
+    parent, &cands, by * BRICK_DIM, bu * BRICK_DIM, bv * BRICK_DIM, BRICK_DIM);
+
+  // A brick with only one entry in reach never needs its colors converted.
+  if (cands.count == 1) {
+    std::fill(pltIdx, pltIdx + BRICK_SIZE, cands.idx[0]);
+    return;
+  }
+
+  Points colors;
+  colors.resize(BRICK_SIZE);
+  colors.count = BRICK_SIZE;
+
+  for (int i = 0; i < BRICK_SIZE; ++i) {
+    float p[3];
+    metric.toSpace(brickToColor(brick, i), p);
+    colors.x[i] = p[0];
+    colors.y[i] = p[1];
+    colors.z[i] = p[2];
+  }
+
+#ifdef TURNSTILE_SSE2
+  if (simd) {
+    searchPointsSSE2(cands, colors, metric.weights(), pltIdx);
+    return;
+  }
+#endif
+
+  searchPointsC(cands, colors, metric.weights(), pltIdx);
+
+}
+
+
+
+void PaletteGrid::searchPointsC(
+  const Points& cands, const Points& colors, const float* w, int* pltIdx)
+{
+
+  for (int i = 0; i < colors.count; ++i) {
+
+    float best = FLT_MAX;
+    int win = 0;
+
+    for (int j = 0; j < cands.count; ++j) {
+
+      float dist = spaceDistance(w,
+                                 colors.x[i] - cands.x[j],
+                                 colors.y[i] - cands.y[j],
+                                 colors.z[i] - cands.z[j]);
+
+      if (dist < best) {
+        best = dist;
+        win = cands.idx[j];
+      }
+
+    }
+
+    pltIdx[i] = win;
+
+  }
+
+}
+
+
+
+#ifdef TURNSTILE_SSE2
+
+// Each component of a palette entry is a byte, and so is every per component
+// distance to the edges of a box, which means saturating byte arithmetic can
+// work on sixteen entries at once. The three components only need widening to
+// 16 bits when they're summed, since their total can reach 765.
+static inline __m128i absDiffEpu8(__m128i a, __m128i b)
+{
+
+  return _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+
+}
+
+
+
+static inline __m128i widenEpu8(__m128i a, int half)
+{
+
+  return half ? _mm_unpackhi_epi8(a, _mm_setzero_si128()) :
+                _mm_unpacklo_epi8(a, _mm_setzero_si128());
+
+}
+
+
+
+void PaletteGrid::findBestSSE2(
+  const Candidates& in, int last, const Box& box,
+  Candidates* scratch, int* best, int* bestIdx)
+{
+
+  if (last == 0)
+    return;
+
+  const __m128i
+    loYR = _mm_set1_epi8(static_cast<char>(box.loYR)),
+    loUG = _mm_set1_epi8(static_cast<char>(box.loUG)),
+    loVB = _mm_set1_epi8(static_cast<char>(box.loVB)),
+    hiYR = _mm_set1_epi8(static_cast<char>(box.hiYR)),
+    hiUG = _mm_set1_epi8(static_cast<char>(box.hiUG)),
+    hiVB = _mm_set1_epi8(static_cast<char>(box.hiVB));
+
+  __m128i minDist = _mm_set1_epi16(766);
+
+  unsigned short* dist = &scratch->dist[0];
+
+  for (int i = 0; i < last; i += 16) {
+
+    __m128i yr = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&in.yr[i])),
+            ug = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&in.ug[i])),
+            vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&in.vb[i]));
+
+    __m128i
+      dYR = _mm_max_epu8(_mm_subs_epu8(yr, loYR), _mm_subs_epu8(hiYR, yr)),
+      dUG = _mm_max_epu8(_mm_subs_epu8(ug, loUG), _mm_subs_epu8(hiUG, ug)),
+      dVB = _mm_max_epu8(_mm_subs_epu8(vb, loVB), _mm_subs_epu8(hiVB, vb));
+
+    __m128i
+      dLo = _mm_add_epi16(
+              _mm_add_epi16(widenEpu8(dYR, 0), widenEpu8(dUG, 0)),
+              widenEpu8(dVB, 0)),
+      dHi = _mm_add_epi16(
+              _mm_add_epi16(widenEpu8(dYR, 1), widenEpu8(dUG, 1)),
+              widenEpu8(dVB, 1));
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dist + i), dLo);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dist + i + 8), dHi);
+
+    minDist = _mm_min_epi16(minDist, _mm_min_epi16(dLo, dHi));
+
+  }
+
+  minDist = _mm_min_epi16(minDist, _mm_srli_si128(minDist, 8));
+  minDist = _mm_min_epi16(minDist, _mm_srli_si128(minDist, 4));
+  minDist = _mm_min_epi16(minDist, _mm_srli_si128(minDist, 2));
+
+  *best = _mm_extract_epi16(minDist, 0);
+
+  // The scalar search that follows only replaces the winner with a strictly
+  // closer entry, so finding the first entry at the minimum here is enough to
+  // keep the usual palette order tie breaking.
+  __m128i target = _mm_set1_epi16(static_cast<short>(*best));
+
+  for (int i = 0; i < last; i += 8) {
+
+    __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dist + i));
+
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi16(d, target));
+
+    if (mask) {
+      int bit = 0;
+      while (!(mask & (1 << bit)))
+        bit += 2;
+      *bestIdx = i + bit / 2;
+      return;
+    }
+
+  }
+
+}
+
+
+
+int PaletteGrid::keepCandidatesSSE2(
+  const Candidates& in, int last, const Box& box,
+  int best, int bestIdx, Candidates* out)
+{
+
+  const __m128i zero = _mm_setzero_si128();
+
+  const __m128i
+    loYR = _mm_set1_epi8(static_cast<char>(box.loYR)),
+    loUG = _mm_set1_epi8(static_cast<char>(box.loUG)),
+    loVB = _mm_set1_epi8(static_cast<char>(box.loVB)),
+    hiYR = _mm_set1_epi8(static_cast<char>(box.hiYR)),
+    hiUG = _mm_set1_epi8(static_cast<char>(box.hiUG)),
+    hiVB = _mm_set1_epi8(static_cast<char>(box.hiVB));
+
+  int bestYR = in.yr[bestIdx],
+      bestUG = in.ug[bestIdx],
+      bestVB = in.vb[bestIdx];
+
+  // The best entry's distances to each corner of the box are the same for
+  // every candidate, so they're subtracted as constants.
+  const __m128i
+    bestLoYR = _mm_set1_epi16(static_cast<short>(abs(box.loYR - bestYR))),
+    bestLoUG = _mm_set1_epi16(static_cast<short>(abs(box.loUG - bestUG))),
+    bestLoVB = _mm_set1_epi16(static_cast<short>(abs(box.loVB - bestVB))),
+    bestHiYR = _mm_set1_epi16(static_cast<short>(abs(box.hiYR - bestYR))),
+    bestHiUG = _mm_set1_epi16(static_cast<short>(abs(box.hiUG - bestUG))),
+    bestHiVB = _mm_set1_epi16(static_cast<short>(abs(box.hiVB - bestVB)));
+
+  const __m128i limit = _mm_set1_epi16(static_cast<short>(best + 1)),
+                one = _mm_set1_epi16(1);
+
+  int count = 0;
+
+  for (int i = 0; i < last; i += 16) {
+
+    __m128i yr = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&in.yr[i])),
+            ug = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&in.ug[i])),
+            vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&in.vb[i]));
+
+    // Only one of the two saturating differences can be nonzero, so OR-ing
+    // them gives the distance from each component to the box.
+    __m128i
+      mYR = _mm_or_si128(_mm_subs_epu8(loYR, yr), _mm_subs_epu8(yr, hiYR)),
+      mUG = _mm_or_si128(_mm_subs_epu8(loUG, ug), _mm_subs_epu8(ug, hiUG)),
+      mVB = _mm_or_si128(_mm_subs_epu8(loVB, vb), _mm_subs_epu8(vb, hiVB));
+
+    __m128i
+      aLoYR = absDiffEpu8(loYR, yr), aHiYR = absDiffEpu8(hiYR, yr),
+      aLoUG = absDiffEpu8(loUG, ug), aHiUG = absDiffEpu8(hiUG, ug),
+      aLoVB = absDiffEpu8(loVB, vb), aHiVB = absDiffEpu8(hiVB, vb);
+
+    int mask = 0;
+
+    for (int half = 0; half < 2; ++half) {
+
+      __m128i dmin = _mm_add_epi16(
+                       _mm_add_epi16(widenEpu8(mYR, half), widenEpu8(mUG, half)),
+                       widenEpu8(mVB, half));
+
+      __m128i margin = _mm_add_epi16(
+        _mm_add_epi16(
+          _mm_min_epi16(_mm_sub_epi16(widenEpu8(aLoYR, half), bestLoYR),
+                        _mm_sub_epi16(widenEpu8(aHiYR, half), bestHiYR)),
+          _mm_min_epi16(_mm_sub_epi16(widenEpu8(aLoUG, half), bestLoUG),
+                        _mm_sub_epi16(widenEpu8(aHiUG, half), bestHiUG))),
+        _mm_min_epi16(_mm_sub_epi16(widenEpu8(aLoVB, half), bestLoVB),
+                      _mm_sub_epi16(widenEpu8(aHiVB, half), bestHiVB)));
+
+      __m128i keep = _mm_and_si128(_mm_cmplt_epi16(dmin, limit),
+                                   _mm_cmplt_epi16(margin, one));
+
+      mask |= _mm_movemask_epi8(_mm_packs_epi16(keep, zero)) << (half * 8);
+
+    }
+
+    for (int bit = 0; mask; ++bit, mask >>= 1) {
+
+      if (!(mask & 1))
+        continue;
+
+      out->yr[count] = in.yr[i + bit];
+      out->ug[count] = in.ug[i + bit];
+      out->vb[count] = in.vb[i + bit];
+      out->idx[count] = in.idx[i + bit];
+      ++count;
+
+    }
+
+  }
+
+  return count;
+
+}
+
+
+void PaletteGrid::searchBoxSSE2(
+  const Candidates& cands, int loYR, int loUG, int loVB, int dim,
+  int* pltIdx)
+{
+
+  // Here the work is spread across colors instead of palette entries; a box is
+  // never more than eight colors on a side, so one register holds a whole row
+  // of them, and each candidate is tested against the entire row at once. The
+  // winning candidate's position is tracked instead of its palette index, since
+  // that's guaranteed to fit in 16 bits.
+  const __m128i lanes = _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7);
+
+  __m128i vb = _mm_add_epi16(_mm_set1_epi16(static_cast<short>(loVB)), lanes);
+
+  __m128i pltVB[LEAF_CANDIDATES];
+  for (int i = 0; i < cands.count; ++i)
+    pltVB[i] = _mm_set1_epi16(cands.vb[i]);
+
+  for (int y = loYR; y < loYR + dim; ++y) {
+
+    for (int u = loUG; u < loUG + dim; ++u) {
+
+      __m128i best = _mm_set1_epi16(766),
+              win = _mm_setzero_si128();
+
+      for (int i = 0; i < cands.count; ++i) {
+
+        __m128i sum = _mm_add_epi16(
+          _mm_max_epi16(_mm_sub_epi16(vb, pltVB[i]), _mm_sub_epi16(pltVB[i], vb)),
+          _mm_set1_epi16(
+            static_cast<short>(abs(y - cands.yr[i]) + abs(u - cands.ug[i]))));
+
+        __m128i closer = _mm_cmplt_epi16(sum, best);
+
+        best = _mm_min_epi16(sum, best);
+        win = _mm_or_si128(
+                _mm_and_si128(closer, _mm_set1_epi16(static_cast<short>(i))),
+                _mm_andnot_si128(closer, win));
+
+      }
+
+      short winners[8];
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(winners), win);
+
+      for (int v = 0; v < dim; ++v)
+        pltIdx[brickEntry(y, u, loVB + v)] = cands.idx[winners[v]];
+
+    }
+
+  }
+
+}
+
+
+
+void PaletteGrid::searchPointsSSE2(
+  const Points& cands, const Points& colors, const float* w, int* pltIdx)
+{
+
+  // Four colors to a register, with each candidate tested against all of them
+  // at once, the same way searchBoxSSE2 does it; the arithmetic is the same as
+  // spaceDistance's, one lane at a time, so the results match the C search.
+  const __m128 w0 = _mm_set1_ps(w[0]),
+               w1 = _mm_set1_ps(w[1]),
+               w2 = _mm_set1_ps(w[2]);
+
+  // A brick's worth of colors always divides evenly into registers.
+  for (int i = 0; i < colors.count; i += 4) {
+
+    __m128 x = _mm_loadu_ps(&colors.x[i]),
+           y = _mm_loadu_ps(&colors.y[i]),
+           z = _mm_loadu_ps(&colors.z[i]);
+
+    __m128 best = _mm_set1_ps(FLT_MAX);
+    __m128i win = _mm_setzero_si128();
+
+    for (int j = 0; j < cands.count; ++j) {
+
+      __m128 dx = _mm_sub_ps(x, _mm_set1_ps(cands.x[j])),
+             dy = _mm_sub_ps(y, _mm_set1_ps(cands.y[j])),
+             dz = _mm_sub_ps(z, _mm_set1_ps(cands.z[j]));
+
+      __m128 dist = _mm_add_ps(
+                      _mm_add_ps(_mm_mul_ps(w0, _mm_mul_ps(dx, dx)),
+                                 _mm_mul_ps(w1, _mm_mul_ps(dy, dy))),
+                      _mm_mul_ps(w2, _mm_mul_ps(dz, dz)));
+
+      __m128i closer = _mm_castps_si128(_mm_cmplt_ps(dist, best));
+
+      best = _mm_min_ps(dist, best);
+      win = _mm_or_si128(_mm_and_si128(closer, _mm_set1_epi32(cands.idx[j])),
+                         _mm_andnot_si128(closer, win));
+
+    }
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(pltIdx + i), win);
+
+  }
+
+}
+
+#endif // TURNSTILE_SSE2
+
+
+
+void PaletteGrid::fillBox(
+  const Candidates& parent, std::vector<Candidates>& levels, int depth,
+  int loYR, int loUG, int loVB, int dim,
+  int* pltIdx) const
+{
+
+  Candidates& cur = levels[depth];
+
+  filterCandidates(parent, &cur, loYR, loUG, loVB, dim);
+
+  // Once a single entry is left, or the box has shrunk to a single color, the
+  // first remaining candidate wins everything in the box.
+  if (cur.count == 1 || dim == 1) {
+
+    int win = cur.idx[0];
+
+    for (int y = loYR; y < loYR + dim; ++y)
+      for (int u = loUG; u < loUG + dim; ++u)
+        for (int v = loVB; v < loVB + dim; ++v)
+          pltIdx[brickEntry(y, u, v)] = win;
+
+    return;
+
+  }
+
+  // Splitting the box any further costs more than just checking the handful of
+  // entries that are left against every color in it.
+  if (cur.count <= LEAF_CANDIDATES) {
+
+#ifdef TURNSTILE_SSE2
+    if (simd)
+      searchBoxSSE2(cur, loYR, loUG, loVB, dim, pltIdx);
+    else
+#endif
+    searchBoxC(cur, loYR, loUG, loVB, dim, pltIdx);
+
+    return;
+
+  }
+
+  int half = dim / 2;
+
+  for (int y = loYR; y < loYR + dim; y += half)
+    for (int u = loUG; u < loUG + dim; u += half)
+      for (int v = loVB; v < loVB + dim; v += half)
+        fillBox(cur, levels, depth + 1, y, u, v, half, pltIdx);
+
+}
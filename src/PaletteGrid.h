@@ -0,0 +1,151 @@
+#ifndef TURNSTILE_SRC_PALETTEGRID_H_INCLUDED
+#define TURNSTILE_SRC_PALETTEGRID_H_INCLUDED
+
+
+
+#include <vector>
+
+#include "ColorMetric.h"
+#include "simd.h"
+
+
+
+class PaletteGrid
+{
+
+public:
+
+  // Bricks are BRICK_DIM colors on a side, and the 24 bit color cube is
+  // BRICKS_PER_DIM bricks on a side.
+  static const int BRICK_DIM = 8;
+  static const int BRICK_SHIFT = 3;
+  static const int BRICK_SIZE = BRICK_DIM * BRICK_DIM * BRICK_DIM;
+  static const int BRICKS_PER_DIM = 256 / BRICK_DIM;
+  static const int BRICK_COUNT = BRICKS_PER_DIM * BRICKS_PER_DIM * BRICKS_PER_DIM;
+
+  PaletteGrid(const std::vector<int>& _plt, bool _simd = true,
+              int _metric = ColorMetric::SAD, int _pixelType = 0);
+
+  ~PaletteGrid();
+
+  void fillBrick(int brick, int* pltIdx) const;
+
+  bool brickMayUse(int brick, const std::vector<bool>& entries) const;
+
+  static int brickToColor(int brick, int entry);
+
+  static int colorToBrick(int color)
+  {
+    return ((color >> (16 + BRICK_SHIFT)) << 10) |
+           (((color >> (8 + BRICK_SHIFT)) & 31) << 5) |
+           ((color >> BRICK_SHIFT) & 31);
+  }
+
+  static int colorToEntry(int color)
+  {
+    const int MASK = BRICK_DIM - 1;
+
+    return (((color >> 16) & MASK) << (BRICK_SHIFT * 2)) |
+           (((color >> 8) & MASK) << BRICK_SHIFT) |
+           (color & MASK);
+  }
+
+private:
+
+  struct Candidates
+  {
+    std::vector<unsigned char> yr, ug, vb;
+    std::vector<unsigned short> dist;
+    std::vector<int> idx;
+    int count;
+
+    void resize(int n)
+    {
+      yr.resize(n);
+      ug.resize(n);
+      vb.resize(n);
+      dist.resize(n);
+      idx.resize(n);
+    }
+  };
+
+  struct Box
+  {
+    int loYR, loUG, loVB, hiYR, hiUG, hiVB;
+  };
+
+  struct Points
+  {
+    std::vector<float> x, y, z;
+    std::vector<int> idx;
+    int count;
+
+    void resize(int n)
+    {
+      x.resize(n);
+      y.resize(n);
+      z.resize(n);
+      idx.resize(n);
+    }
+  };
+
+  bool simd;
+
+  ColorMetric metric;
+
+  std::vector<Candidates> coarse;
+
+  std::vector<Points> coarsePoints;
+
+  void filterCandidates(
+    const Candidates& in, Candidates* out,
+    int loYR, int loUG, int loVB, int dim) const;
+
+  void fillBox(
+    const Candidates& parent, std::vector<Candidates>& levels, int depth,
+    int loYR, int loUG, int loVB, int dim,
+    int* pltIdx) const;
+
+  static void findBestC(
+    const Candidates& in, int first, int last, const Box& box,
+    int* best, int* bestIdx);
+
+  static int keepCandidatesC(
+    const Candidates& in, int first, int last, const Box& box,
+    int best, int bestIdx, Candidates* out, int count);
+
+  static void searchBoxC(
+    const Candidates& cands, int loYR, int loUG, int loVB, int dim,
+    int* pltIdx);
+
+  void filterPoints(
+    const Points& in, Points* out,
+    int loYR, int loUG, int loVB, int dim) const;
+
+  void fillBrickMetric(int brick, int* pltIdx) const;
+
+  static void searchPointsC(
+    const Points& cands, const Points& colors, const float* w, int* pltIdx);
+
+#ifdef TURNSTILE_SSE2
+  static void findBestSSE2(
+    const Candidates& in, int last, const Box& box,
+    Candidates* scratch, int* best, int* bestIdx);
+
+  static int keepCandidatesSSE2(
+    const Candidates& in, int last, const Box& box,
+    int best, int bestIdx, Candidates* out);
+
+  static void searchBoxSSE2(
+    const Candidates& cands, int loYR, int loUG, int loVB, int dim,
+    int* pltIdx);
+
+  static void searchPointsSSE2(
+    const Points& cands, const Points& colors, const float* w, int* pltIdx);
+#endif
+
+};
+
+
+
+#endif // TURNSTILE_SRC_PALETTEGRID_H_INCLUDED
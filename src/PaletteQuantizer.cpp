@@ -0,0 +1,527 @@
+#include "PaletteQuantizer.h"
+
+#include <cfloat>
+#include <cstring>
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+#include "simd.h"
+#include "WorkerPool.h"
+
+
+
+// Below this many colors per thread, handing them out to the worker pool takes
+// longer than just counting everything on one.
+static const int THREAD_COLORS = 65536;
+
+
+
+PaletteQuantizer::PaletteQuantizer(
+  int _method, int _colors, int _threads, bool _simd) :
+  method(_method), colors(_colors), threads(std::max(_threads, 1)),
+  simd(_simd)
+{
+
+  hist.resize(BIN_COUNT);
+
+}
+
+
+
+PaletteQuantizer::~PaletteQuantizer()
+{
+}
+
+
+
+int PaletteQuantizer::parse(const char* name)
+{
+
+  return strcmp(name, "mediancut") == 0 ? MEDIAN_CUT :
+         strcmp(name, "kmeans") == 0 ?    KMEANS :
+                                          -1;
+
+}
+
+
+
+void PaletteQuantizer::addColors(const std::vector<int>& packed)
+{
+
+  // Every thread counts its own share of the colors into a histogram of its
+  // own, and they're all added together at the end, so no two threads ever
+  // touch the same bin. The counts are integers, so the total is the same no
+  // matter how the work was split up.
+  int count = static_cast<int>(packed.size()),
+      workers = std::min(threads, count / THREAD_COLORS);
+
+  if (workers <= 1) {
+    if (count > 0)
+      countColors(&packed[0], count, &hist);
+    return;
+  }
+
+  std::vector<Histogram> partial(workers);
+
+  WorkerPool::run(workers, workers,
+                  std::bind(&PaletteQuantizer::countShares, &packed, &partial,
+                            std::placeholders::_1, std::placeholders::_2));
+
+  for (int i = 0; i < workers; ++i) {
+    for (int bin = 0; bin < BIN_COUNT; ++bin) {
+      hist.count[bin] += partial[i].count[bin];
+      hist.yr[bin] += partial[i].yr[bin];
+      hist.ug[bin] += partial[i].ug[bin];
+      hist.vb[bin] += partial[i].vb[bin];
+    }
+  }
+
+}
+
+
+
+void PaletteQuantizer::countShares(
+  const std::vector<int>* packed, std::vector<Histogram>* partial,
+  int first, int last)
+{
+
+  const long long COUNT = static_cast<long long>(packed->size()),
+                  SHARES = static_cast<long long>(partial->size());
+
+  for (int i = first; i < last; ++i) {
+
+    int firstColor = static_cast<int>(COUNT * i / SHARES),
+        lastColor = static_cast<int>(COUNT * (i + 1) / SHARES);
+
+    (*partial)[i].resize(BIN_COUNT);
+
+    countColors(&(*packed)[firstColor], lastColor - firstColor,
+                &(*partial)[i]);
+
+  }
+
+}
+
+
+
+void PaletteQuantizer::countColors(
+  const int* packed, int count, Histogram* out)
+{
+
+  // Each bin keeps the sum of every color that landed in it, as well as how
+  // many there were, so the colors that come out at the end are true averages,
+  // rather than just the middle of whichever bins they came from. A bin that
+  // only ever saw one color averages out to exactly that color.
+  const int SHIFT = 8 - BIN_BITS;
+
+  for (int i = 0; i < count; ++i) {
+
+    int yr = (packed[i] >> 16) & 255,
+        ug = (packed[i] >> 8) & 255,
+        vb = packed[i] & 255;
+
+    int bin = binIndex(yr >> SHIFT, ug >> SHIFT, vb >> SHIFT);
+
+    ++out->count[bin];
+    out->yr[bin] += yr;
+    out->ug[bin] += ug;
+    out->vb[bin] += vb;
+
+  }
+
+}
+
+
+
+void PaletteQuantizer::quantize(std::vector<int>* plt) const
+{
+
+  if (method == KMEANS)
+    kMeans(plt);
+  else
+    medianCut(plt);
+
+}
+
+
+
+void PaletteQuantizer::shrinkBox(Box* box) const
+{
+
+  int lo[3] = { BIN_DIM, BIN_DIM, BIN_DIM },
+      hi[3] = { -1, -1, -1 };
+
+  unsigned long long count = 0;
+
+  for (int y = box->lo[0]; y <= box->hi[0]; ++y) {
+    for (int u = box->lo[1]; u <= box->hi[1]; ++u) {
+      for (int v = box->lo[2]; v <= box->hi[2]; ++v) {
+
+        unsigned int n = hist.count[binIndex(y, u, v)];
+
+        if (!n)
+          continue;
+
+        count += n;
+
+        lo[0] = std::min(lo[0], y);
+        lo[1] = std::min(lo[1], u);
+        lo[2] = std::min(lo[2], v);
+        hi[0] = std::max(hi[0], y);
+        hi[1] = std::max(hi[1], u);
+        hi[2] = std::max(hi[2], v);
+
+      }
+    }
+  }
+
+  box->count = count;
+
+  if (!count)
+    return;
+
+  for (int i = 0; i < 3; ++i) {
+    box->lo[i] = lo[i];
+    box->hi[i] = hi[i];
+  }
+
+}
+
+
+
+bool PaletteQuantizer::splitBox(Box* box, Box* upper) const
+{
+
+  // The box is cut across its longest side, at the point where half of the
+  // colors in it fall on either side. Boxes are always shrunk to fit the bins
+  // they actually use, so both ends of every side hold at least one color, and
+  // neither half can come out empty.
+  int axis = 0;
+
+  for (int i = 1; i < 3; ++i)
+    if (box->hi[i] - box->lo[i] > box->hi[axis] - box->lo[axis])
+      axis = i;
+
+  if (box->hi[axis] == box->lo[axis])
+    return false;
+
+  unsigned long long below = 0;
+  int cut = box->lo[axis];
+
+  for (; cut < box->hi[axis] - 1; ++cut) {
+
+    int lo[3] = { box->lo[0], box->lo[1], box->lo[2] },
+        hi[3] = { box->hi[0], box->hi[1], box->hi[2] };
+
+    lo[axis] = hi[axis] = cut;
+
+    for (int y = lo[0]; y <= hi[0]; ++y)
+      for (int u = lo[1]; u <= hi[1]; ++u)
+        for (int v = lo[2]; v <= hi[2]; ++v)
+          below += hist.count[binIndex(y, u, v)];
+
+    if (below * 2 >= box->count)
+      break;
+
+  }
+
+  *upper = *box;
+  box->hi[axis] = cut;
+  upper->lo[axis] = cut + 1;
+
+  shrinkBox(box);
+  shrinkBox(upper);
+
+  return true;
+
+}
+
+
+
+int PaletteQuantizer::boxColor(const Box& box) const
+{
+
+  unsigned long long sum[3] = { 0, 0, 0 };
+
+  for (int y = box.lo[0]; y <= box.hi[0]; ++y) {
+    for (int u = box.lo[1]; u <= box.hi[1]; ++u) {
+      for (int v = box.lo[2]; v <= box.hi[2]; ++v) {
+        int bin = binIndex(y, u, v);
+        sum[0] += hist.yr[bin];
+        sum[1] += hist.ug[bin];
+        sum[2] += hist.vb[bin];
+      }
+    }
+  }
+
+  int c[3];
+  for (int i = 0; i < 3; ++i)
+    c[i] = static_cast<int>((sum[i] + box.count / 2) / box.count);
+
+  return (c[0] << 16) | (c[1] << 8) | c[2];
+
+}
+
+
+
+void PaletteQuantizer::medianCut(std::vector<int>* plt) const
+{
+
+  // Heckbert's median cut: start with one box around every color in the
+  // histogram, and keep splitting boxes in two until there are as many as I
+  // need colors. The box split next is the one with the most colors in it,
+  // weighted by its longest side, so big areas of a single shade don't
+  // hog the palette, and neither do a few stray colors spread far apart.
+  Box all = { { 0, 0, 0 }, { BIN_DIM - 1, BIN_DIM - 1, BIN_DIM - 1 }, 0 };
+  shrinkBox(&all);
+
+  if (!all.count)
+    return;
+
+  std::vector<Box> boxes(1, all);
+
+  while (static_cast<int>(boxes.size()) < colors) {
+
+    int pick = -1;
+    unsigned long long best = 0;
+
+    for (size_t i = 0; i < boxes.size(); ++i) {
+
+      int side = std::max(std::max(boxes[i].hi[0] - boxes[i].lo[0],
+                                   boxes[i].hi[1] - boxes[i].lo[1]),
+                          boxes[i].hi[2] - boxes[i].lo[2]);
+
+      unsigned long long score = boxes[i].count * side;
+
+      if (score > best) {
+        best = score;
+        pick = static_cast<int>(i);
+      }
+
+    }
+
+    // Every box is down to a single bin, so there's nothing left to split.
+    if (pick < 0)
+      break;
+
+    Box upper;
+    splitBox(&boxes[pick], &upper);
+    boxes.push_back(upper);
+
+  }
+
+  for (size_t i = 0; i < boxes.size(); ++i)
+    plt->push_back(boxColor(boxes[i]));
+
+}
+
+
+
+void PaletteQuantizer::kMeans(std::vector<int>* plt) const
+{
+
+  // k-means only ever improves on where it starts, and a poor start leaves it
+  // stuck with a poor palette, so I start it from the median cut palette,
+  // which also means the results never change from one run to the next. Each
+  // bin in use counts as a single point at the average of its colors, weighted
+  // by how many there were, which keeps every pass quick no matter how big
+  // the frames were.
+  std::vector<int> seeds;
+  medianCut(&seeds);
+
+  if (seeds.empty())
+    return;
+
+  Points points;
+  points.count = 0;
+
+  for (int bin = 0; bin < BIN_COUNT; ++bin) {
+
+    unsigned int n = hist.count[bin];
+
+    if (!n)
+      continue;
+
+    double scale = 1.0 / n;
+
+    points.x.push_back(static_cast<float>(hist.yr[bin] * scale));
+    points.y.push_back(static_cast<float>(hist.ug[bin] * scale));
+    points.z.push_back(static_cast<float>(hist.vb[bin] * scale));
+    points.bin.push_back(bin);
+    ++points.count;
+
+  }
+
+  int k = static_cast<int>(seeds.size());
+
+  std::vector<float> centers(k * 3);
+  for (int i = 0; i < k; ++i) {
+    centers[i * 3] = static_cast<float>((seeds[i] >> 16) & 255);
+    centers[i * 3 + 1] = static_cast<float>((seeds[i] >> 8) & 255);
+    centers[i * 3 + 2] = static_cast<float>(seeds[i] & 255);
+  }
+
+  std::vector<int> cluster(points.count, -1), prev;
+  std::vector<unsigned long long> count(k), sum(k * 3);
+
+  // Only the search for each point's nearest center takes any real time, and
+  // every point can be searched independently, so that's the part that gets
+  // spread across threads. The new centers are worked out from the integer
+  // sums in the histogram, so they never depend on how the points were split.
+  int workers = std::min(threads,
+                         std::max(points.count * k / THREAD_COLORS, 1));
+
+  for (int pass = 0; pass < KMEANS_PASSES; ++pass) {
+
+    prev = cluster;
+
+    WorkerPool::run(points.count, workers,
+                    std::bind(&PaletteQuantizer::assignPoints, this,
+                              std::cref(points), std::cref(centers),
+                              &cluster[0],
+                              std::placeholders::_1, std::placeholders::_2));
+
+    if (cluster == prev)
+      break;
+
+    std::fill(count.begin(), count.end(), 0);
+    std::fill(sum.begin(), sum.end(), 0);
+
+    for (int i = 0; i < points.count; ++i) {
+      int c = cluster[i], bin = points.bin[i];
+      count[c] += hist.count[bin];
+      sum[c * 3] += hist.yr[bin];
+      sum[c * 3 + 1] += hist.ug[bin];
+      sum[c * 3 + 2] += hist.vb[bin];
+    }
+
+    // A center nobody chose stays where it was; it may yet pick up a few
+    // points as its neighbors move.
+    for (int i = 0; i < k; ++i)
+      if (count[i])
+        for (int j = 0; j < 3; ++j)
+          centers[i * 3 + j] = static_cast<float>(
+            static_cast<double>(sum[i * 3 + j]) / count[i]);
+
+  }
+
+  for (int i = 0; i < k; ++i) {
+
+    int c[3];
+    for (int j = 0; j < 3; ++j)
+      c[j] = std::min(std::max(
+               static_cast<int>(centers[i * 3 + j] + 0.5f), 0), 255);
+
+    plt->push_back((c[0] << 16) | (c[1] << 8) | c[2]);
+
+  }
+
+}
+
+
+
+void PaletteQuantizer::assignPoints(
+  const Points& points, const std::vector<float>& centers,
+  int* cluster, int first, int last) const
+{
+
+#ifdef TURNSTILE_SSE2
+  if (simd) {
+    assignPointsSSE2(points, centers, cluster, first, last);
+    return;
+  }
+#endif
+
+  assignPointsC(points, centers, cluster, first, last);
+
+}
+
+
+
+void PaletteQuantizer::assignPointsC(
+  const Points& points, const std::vector<float>& centers,
+  int* cluster, int first, int last)
+{
+
+  int k = static_cast<int>(centers.size() / 3);
+
+  for (int i = first; i < last; ++i) {
+
+    float best = FLT_MAX;
+    int win = 0;
+
+    for (int j = 0; j < k; ++j) {
+
+      float dx = points.x[i] - centers[j * 3],
+            dy = points.y[i] - centers[j * 3 + 1],
+            dz = points.z[i] - centers[j * 3 + 2];
+
+      float dist = dx * dx + dy * dy + dz * dz;
+
+      if (dist < best) {
+        best = dist;
+        win = j;
+      }
+
+    }
+
+    cluster[i] = win;
+
+  }
+
+}
+
+
+
+#ifdef TURNSTILE_SSE2
+
+void PaletteQuantizer::assignPointsSSE2(
+  const Points& points, const std::vector<float>& centers,
+  int* cluster, int first, int last)
+{
+
+  // Four points to a register, each tested against one center at a time, just
+  // like PaletteGrid::searchPointsSSE2; the arithmetic matches the C version
+  // lane for lane, so both always pick the same centers.
+  int k = static_cast<int>(centers.size() / 3);
+
+  int i = first;
+
+  for (; i + 4 <= last; i += 4) {
+
+    __m128 x = _mm_loadu_ps(&points.x[i]),
+           y = _mm_loadu_ps(&points.y[i]),
+           z = _mm_loadu_ps(&points.z[i]);
+
+    __m128 best = _mm_set1_ps(FLT_MAX);
+    __m128i win = _mm_setzero_si128();
+
+    for (int j = 0; j < k; ++j) {
+
+      __m128 dx = _mm_sub_ps(x, _mm_set1_ps(centers[j * 3])),
+             dy = _mm_sub_ps(y, _mm_set1_ps(centers[j * 3 + 1])),
+             dz = _mm_sub_ps(z, _mm_set1_ps(centers[j * 3 + 2]));
+
+      __m128 dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx),
+                                          _mm_mul_ps(dy, dy)),
+                               _mm_mul_ps(dz, dz));
+
+      __m128i closer = _mm_castps_si128(_mm_cmplt_ps(dist, best));
+
+      best = _mm_min_ps(dist, best);
+      win = _mm_or_si128(_mm_and_si128(closer, _mm_set1_epi32(j)),
+                         _mm_andnot_si128(closer, win));
+
+    }
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(cluster + i), win);
+
+  }
+
+  assignPointsC(points, centers, cluster, i, last);
+
+}
+
+#endif // TURNSTILE_SSE2
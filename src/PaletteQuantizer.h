@@ -0,0 +1,112 @@
+#ifndef TURNSTILE_SRC_PALETTEQUANTIZER_H_INCLUDED
+#define TURNSTILE_SRC_PALETTEQUANTIZER_H_INCLUDED
+
+
+
+#include <vector>
+
+#include "simd.h"
+
+
+
+class PaletteQuantizer
+{
+
+public:
+
+  enum { MEDIAN_CUT, KMEANS };
+
+  // The histogram keeps the top BIN_BITS bits of each component, giving
+  // BIN_COUNT bins in all.
+  static const int BIN_BITS = 5;
+  static const int BIN_DIM = 1 << BIN_BITS;
+  static const int BIN_COUNT = BIN_DIM * BIN_DIM * BIN_DIM;
+
+  PaletteQuantizer(int _method, int _colors, int _threads, bool _simd = true);
+
+  ~PaletteQuantizer();
+
+  static int parse(const char* name);
+
+  void addColors(const std::vector<int>& packed);
+
+  void quantize(std::vector<int>* plt) const;
+
+private:
+
+  static const int KMEANS_PASSES = 16;
+
+  struct Histogram
+  {
+    std::vector<unsigned int> count;
+    std::vector<unsigned long long> yr, ug, vb;
+
+    void resize(int n)
+    {
+      count.assign(n, 0);
+      yr.assign(n, 0);
+      ug.assign(n, 0);
+      vb.assign(n, 0);
+    }
+  };
+
+  struct Box
+  {
+    int lo[3], hi[3];
+    unsigned long long count;
+  };
+
+  struct Points
+  {
+    std::vector<float> x, y, z;
+    std::vector<int> bin;
+    int count;
+  };
+
+  int method, colors, threads;
+
+  bool simd;
+
+  Histogram hist;
+
+  static void countShares(
+    const std::vector<int>* packed, std::vector<Histogram>* partial,
+    int first, int last);
+
+  static void countColors(
+    const int* packed, int count, Histogram* out);
+
+  static int binIndex(int yr, int ug, int vb)
+  {
+    return (yr << (BIN_BITS * 2)) | (ug << BIN_BITS) | vb;
+  }
+
+  void shrinkBox(Box* box) const;
+
+  bool splitBox(Box* box, Box* upper) const;
+
+  int boxColor(const Box& box) const;
+
+  void medianCut(std::vector<int>* plt) const;
+
+  void kMeans(std::vector<int>* plt) const;
+
+  void assignPoints(
+    const Points& points, const std::vector<float>& centers,
+    int* cluster, int first, int last) const;
+
+  static void assignPointsC(
+    const Points& points, const std::vector<float>& centers,
+    int* cluster, int first, int last);
+
+#ifdef TURNSTILE_SSE2
+  static void assignPointsSSE2(
+    const Points& points, const std::vector<float>& centers,
+    int* cluster, int first, int last);
+#endif
+
+};
+
+
+
+#endif // TURNSTILE_SRC_PALETTEQUANTIZER_H_INCLUDED
@@ -0,0 +1,173 @@
+#include "PaletteSearch.h"
+
+#include <cstdlib>
+
+#include <vector>
+
+#include "simd.h"
+
+
+
+PaletteSearch::PaletteSearch(const std::vector<int>& _plt, bool _simd) :
+  simd(_simd), pltSize(static_cast<int>(_plt.size()))
+{
+
+  // A lookup table costs 16 MB no matter how few colors it holds, and with only
+  // a handful of them it's cheaper to just check every one for each pixel than
+  // to wait on a table that won't stay in cache. Each component of each entry
+  // is stored eight times over, so the SIMD search can load it straight into a
+  // register, ready to compare against eight pixels at once.
+  vecYR.resize(pltSize * 8);
+  vecUG.resize(pltSize * 8);
+  vecVB.resize(pltSize * 8);
+
+  for (int i = 0; i < pltSize; ++i) {
+
+    for (int j = 0; j < 8; ++j) {
+      vecYR[i * 8 + j] = static_cast<short>((_plt[i] >> 16) & 255);
+      vecUG[i * 8 + j] = static_cast<short>((_plt[i] >> 8) & 255);
+      vecVB[i * 8 + j] = static_cast<short>(_plt[i] & 255);
+    }
+
+  }
+
+}
+
+
+
+PaletteSearch::~PaletteSearch()
+{
+}
+
+
+
+void PaletteSearch::nearest(const int* packed, int* pltIdx, int count) const
+{
+
+#ifdef TURNSTILE_SSE2
+  if (simd) {
+    nearestSSE2(packed, pltIdx, count);
+    return;
+  }
+#endif
+
+  nearestC(packed, pltIdx, count);
+
+}
+
+
+
+void PaletteSearch::nearestC(const int* packed, int* pltIdx, int count) const
+{
+
+  for (int i = 0; i < count; ++i) {
+
+    int inYR = (packed[i] >> 16) & 255,
+        inUG = (packed[i] >> 8) & 255,
+        inVB = packed[i] & 255;
+
+    int best = 766, win = 0;
+
+    for (int j = 0; j < pltSize; ++j) {
+
+      int sum = abs(inYR - vecYR[j * 8]) +
+                abs(inUG - vecUG[j * 8]) +
+                abs(inVB - vecVB[j * 8]);
+
+      if (sum < best) {
+        best = sum;
+        win = j;
+      }
+
+    }
+
+    pltIdx[i] = win;
+
+  }
+
+}
+
+
+
+#ifdef TURNSTILE_SSE2
+
+static inline __m128i absDiffEpi16(__m128i a, __m128i b)
+{
+
+  return _mm_max_epi16(_mm_sub_epi16(a, b), _mm_sub_epi16(b, a));
+
+}
+
+
+
+static inline __m128i loadComponent(__m128i lo, __m128i hi, int shift)
+{
+
+  const __m128i mask = _mm_set1_epi32(255);
+
+  return _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(lo, shift), mask),
+                         _mm_and_si128(_mm_srli_epi32(hi, shift), mask));
+
+}
+
+
+
+void PaletteSearch::nearestSSE2(const int* packed, int* pltIdx, int count) const
+{
+
+  // Working across pixels rather than palette entries means there's never any
+  // need to find the smallest of several values within one register, which is
+  // slow with SSE2; every pixel in a register is tested against one entry at a
+  // time, and keeps track of the best one it's seen so far. Only a strictly
+  // closer entry replaces the winner, so ties go to the lower index as usual.
+  const __m128i zero = _mm_setzero_si128(),
+                one = _mm_set1_epi16(1);
+
+  int i = 0;
+
+  for (; i + 8 <= count; i += 8) {
+
+    __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(packed + i)),
+            hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(packed + i + 4));
+
+    __m128i inYR = loadComponent(lo, hi, 16),
+            inUG = loadComponent(lo, hi, 8),
+            inVB = loadComponent(lo, hi, 0);
+
+    __m128i best = _mm_set1_epi16(766),
+            win = zero,
+            cur = zero;
+
+    for (int j = 0; j < pltSize; ++j) {
+
+      __m128i sum = _mm_add_epi16(
+        _mm_add_epi16(
+          absDiffEpi16(inYR, _mm_loadu_si128(
+                               reinterpret_cast<const __m128i*>(&vecYR[j * 8]))),
+          absDiffEpi16(inUG, _mm_loadu_si128(
+                               reinterpret_cast<const __m128i*>(&vecUG[j * 8])))),
+        absDiffEpi16(inVB, _mm_loadu_si128(
+                             reinterpret_cast<const __m128i*>(&vecVB[j * 8]))));
+
+      __m128i closer = _mm_cmplt_epi16(sum, best);
+
+      best = _mm_min_epi16(sum, best);
+      win = _mm_or_si128(_mm_and_si128(closer, cur),
+                         _mm_andnot_si128(closer, win));
+
+      cur = _mm_add_epi16(cur, one);
+
+    }
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(pltIdx + i),
+                     _mm_unpacklo_epi16(win, zero));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(pltIdx + i + 4),
+                     _mm_unpackhi_epi16(win, zero));
+
+  }
+
+  nearestC(packed + i, pltIdx + i, count - i);
+
+}
+
+#endif // TURNSTILE_SSE2
@@ -0,0 +1,62 @@
+#ifndef TURNSTILE_SRC_PALETTESEARCH_H_INCLUDED
+#define TURNSTILE_SRC_PALETTESEARCH_H_INCLUDED
+
+
+
+#include <vector>
+
+#include "simd.h"
+
+
+
+class PaletteSearch
+{
+
+public:
+
+  // Past this many colors, searching every entry for every pixel can't
+  // compete with a lookup table, so it isn't allowed at all.
+  static const int MAX_COLORS = 256;
+
+  // Up to this many colors, searching the palette directly beats a lookup
+  // table, even one that's already warm in cache; see the "Direct search" case
+  // in test/src/benchmark.cpp. One pixel at a time, the search never catches
+  // up, so without SIMD a table is always the better choice.
+#ifdef TURNSTILE_SSE2
+  static const int AUTO_COLORS = 8;
+#else
+  static const int AUTO_COLORS = 0;
+#endif
+
+  PaletteSearch(const std::vector<int>& _plt, bool _simd = true);
+
+  ~PaletteSearch();
+
+  void nearest(const int* packed, int* pltIdx, int count) const;
+
+  int nearest(int packed) const
+  {
+    int pltIdx;
+    nearest(&packed, &pltIdx, 1);
+    return pltIdx;
+  }
+
+private:
+
+  bool simd;
+
+  int pltSize;
+
+  std::vector<short> vecYR, vecUG, vecVB;
+
+  void nearestC(const int* packed, int* pltIdx, int count) const;
+
+#ifdef TURNSTILE_SSE2
+  void nearestSSE2(const int* packed, int* pltIdx, int count) const;
+#endif
+
+};
+
+
+
+#endif // TURNSTILE_SRC_PALETTESEARCH_H_INCLUDED
@@ -0,0 +1,519 @@
+#include "PaletteTable.h"
+
+#include <cstdio>
+#include <cstring>
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "BrickCache.h"
+#include "MappedFile.h"
+#include "PaletteGrid.h"
+#include "PaletteSearch.h"
+#include "WorkerPool.h"
+
+
+
+PaletteTable::PaletteTable(const std::vector<int>& _plt, int _pixelType,
+                           int _metric, bool lazy, bool direct, int threads,
+                           const std::string& cacheDir,
+                           const PaletteTable* base) :
+  vecPlt(_plt), tblIdx8(0), tblIdx16(0), tblIdx32(0), pixelType(_pixelType),
+  metric(_metric)
+{
+
+  // All unique colors have been read from the input, and the palette's been
+  // loaded; now it's time to find the closest match for each possible output.
+  // The brute force search I used to do here compared all sixteen million
+  // colors against every palette entry, which with a big palette meant billions
+  // of comparisons. PaletteGrid instead narrows the palette down to the few
+  // entries that could possibly win for a given block of the color cube, and
+  // only searches those, while still picking exactly the same entry.
+  //
+  // For my use, the sum of absolute differences provides the same results
+  // as the Euclidean distance approach I'd been using; I'd implemented that
+  // incompletely anyway, and it worked well enough, so I have no qualms
+  // using an even simpler, faster technique. Not everyone agrees, though, so
+  // other metrics are available too; PaletteGrid takes care of those the same
+  // way, after converting the palette to the metric's own space just once.
+  //
+  // Building the table is quick these days, but not free, and a script that
+  // gets opened over and over with the same palette shouldn't have to pay for
+  // it every time. With a cache directory set, a table built once is saved
+  // there, and from then on just mapped into memory straight from the file.
+  // The operating system only reads in the pages that actually get used, and
+  // shares them between every process that maps the same file.
+  //
+  // None of that is worth it for a tiny palette, though, where searching every
+  // entry for each pixel as it comes is quicker than looking it up in a table
+  // that won't stay in cache. In direct mode there's no table at all.
+  if (direct) {
+    search.reset(new PaletteSearch(vecPlt));
+    return;
+  }
+
+  std::string path;
+
+  if (!cacheDir.empty()) {
+    path = tablePath(cacheDir);
+    if (loadTable(path))
+      return;
+  }
+
+  // A sixteen million entry table adds up quickly with a lot of CLUTer
+  // instances in one script, though, and real footage rarely touches more than
+  // a sliver of the color cube. In lazy mode I hand the palette to a BrickCache
+  // instead, which only searches a brick of colors the first time a frame
+  // needs one.
+  if (lazy) {
+    cache.reset(new BrickCache(vecPlt, metric, pixelType));
+    return;
+  }
+
+  PaletteGrid grid(vecPlt, true, metric, pixelType);
+
+  // The table stores which palette entry each color maps to, rather than the
+  // color itself, since the palette is small enough to stay in cache and an
+  // index takes less room than a color. Most palettes fit in a byte, which
+  // brings the table down to sixteen megabytes; only absurdly large ones need
+  // more than two.
+  if (vecPlt.size() <= 256) {
+    vecIdx8.resize(16777216);
+    tblIdx8 = &vecIdx8[0];
+  } else if (vecPlt.size() <= 65536) {
+    vecIdx16.resize(16777216);
+    tblIdx16 = &vecIdx16[0];
+  } else {
+    vecIdx32.resize(16777216);
+    tblIdx32 = &vecIdx32[0];
+  }
+
+  // An animated palette often only changes a few colors from one frame to the
+  // next, and the table that went with the last one is still around, so most
+  // of this one can simply be carried over from it; see patchTable.
+  bool patched = base && patchTable(base, &grid, threads);
+
+  // Every brick is independent of every other, so with the tables sized up
+  // front the work can be dealt out to the worker pool. Some parts of the color
+  // cube take much longer to search than others, but whichever threads finish
+  // their share early just steal some of what the others have left.
+  if (!patched)
+    WorkerPool::run(PaletteGrid::BRICK_COUNT, threads,
+                    std::bind(&PaletteTable::fillBricks, this, &grid,
+                              std::placeholders::_1, std::placeholders::_2));
+
+  if (!path.empty())
+    saveTable(path);
+
+}
+
+
+
+PaletteTable::~PaletteTable()
+{
+}
+
+
+
+// Tables are keyed by everything that goes into building one: the colorspace,
+// the metric, whether it's filled lazily or searched directly, and the palette
+// itself. The registry only holds weak references, so a table still goes away
+// as soon as the last CLUTer using it does.
+struct RegistrySlot
+{
+  std::weak_ptr<PaletteTable> table;
+  bool building;
+
+  RegistrySlot() : building(false) {}
+};
+
+static std::mutex registryLock;
+static std::condition_variable registryBuilt;
+static std::map<std::vector<int>, RegistrySlot> registry;
+
+
+
+std::shared_ptr<PaletteTable> PaletteTable::acquire(
+  const std::vector<int>& plt, int pixelType, int metric, bool lazy,
+  bool direct, int threads, const std::string& cacheDir,
+  const PaletteTable* base)
+{
+
+  // It's common enough for a script to call CLUTer several times with the same
+  // palette, and there's no reason for each one to have a table of its own;
+  // once built, a table never changes, so they can all share one. If another
+  // thread is already building the table I'm after, I wait for it to finish
+  // rather than building a second copy alongside it. Whatever table it gets
+  // patched from, the result is the same, so the base isn't part of the key.
+  std::vector<int> key;
+  key.push_back(pixelType);
+  key.push_back(metric);
+  key.push_back(lazy);
+  key.push_back(direct);
+  key.insert(key.end(), plt.begin(), plt.end());
+
+  std::unique_lock<std::mutex> lock(registryLock);
+
+  for (std::map<std::vector<int>, RegistrySlot>::iterator i = registry.begin();
+       i != registry.end();) {
+    if (!i->second.building && i->second.table.expired() && i->first != key)
+      registry.erase(i++);
+    else
+      ++i;
+  }
+
+  for (;;) {
+
+    RegistrySlot& slot = registry[key];
+
+    std::shared_ptr<PaletteTable> table = slot.table.lock();
+    if (table)
+      return table;
+
+    if (!slot.building)
+      break;
+
+    registryBuilt.wait(lock);
+
+  }
+
+  registry[key].building = true;
+
+  lock.unlock();
+
+  std::shared_ptr<PaletteTable> table;
+
+  try {
+    table.reset(new PaletteTable(plt, pixelType, metric, lazy, direct, threads,
+                                 cacheDir, base));
+  } catch (...) {
+    lock.lock();
+    registry[key].building = false;
+    registryBuilt.notify_all();
+    throw;
+  }
+
+  lock.lock();
+
+  RegistrySlot& slot = registry[key];
+  slot.table = table;
+  slot.building = false;
+
+  registryBuilt.notify_all();
+
+  return table;
+
+}
+
+
+
+template <typename T>
+static void scatterBrick(std::vector<T>& vecIdx, int brick, const int* pltIdx)
+{
+
+  for (int entry = 0; entry < PaletteGrid::BRICK_SIZE; ++entry)
+    vecIdx[PaletteGrid::brickToColor(brick, entry)] =
+      static_cast<T>(pltIdx[entry]);
+
+}
+
+
+
+void PaletteTable::fillBricks(const PaletteGrid* grid, int first, int last)
+{
+
+  std::vector<int> pltIdx(PaletteGrid::BRICK_SIZE);
+
+  for (int brick = first; brick < last; ++brick) {
+    grid->fillBrick(brick, &pltIdx[0]);
+    storeBrick(brick, &pltIdx[0]);
+  }
+
+}
+
+
+
+void PaletteTable::storeBrick(int brick, const int* pltIdx)
+{
+
+  if (!vecIdx8.empty())
+    scatterBrick(vecIdx8, brick, pltIdx);
+  else if (!vecIdx16.empty())
+    scatterBrick(vecIdx16, brick, pltIdx);
+  else
+    scatterBrick(vecIdx32, brick, pltIdx);
+
+}
+
+
+
+// Past this fraction of the palette changing, so many bricks need searching
+// again that carrying the rest over stops paying for itself.
+static const int PATCH_FRACTION = 4;
+
+
+
+bool PaletteTable::patchTable(
+  const PaletteTable* base, const PaletteGrid* grid, int threads)
+{
+
+  // Only a finished table, built for the same colorspace and metric, can be
+  // patched; a lazy or direct one has nothing to carry over.
+  if ((!base->tblIdx8 && !base->tblIdx16 && !base->tblIdx32) ||
+      base->pixelType != pixelType || base->metric != metric)
+    return false;
+
+  // Both palettes are sorted, so one pass over them both tells me where each
+  // entry that survived has moved to, which ones are gone, and which are new.
+  const int BASE_SIZE = base->size(),
+            SIZE = size();
+
+  std::vector<int> remap(BASE_SIZE, -1);
+  std::vector<bool> added(SIZE, true);
+
+  int changed = 0;
+
+  for (int i = 0, j = 0; i < BASE_SIZE || j < SIZE;) {
+    if (j == SIZE || (i < BASE_SIZE && base->vecPlt[i] < vecPlt[j])) {
+      ++changed;
+      ++i;
+    } else if (i == BASE_SIZE || vecPlt[j] < base->vecPlt[i]) {
+      ++changed;
+      ++j;
+    } else {
+      remap[i++] = j;
+      added[j++] = false;
+    }
+  }
+
+  if (changed * PATCH_FRACTION > SIZE)
+    return false;
+
+  WorkerPool::run(PaletteGrid::BRICKS_PER_DIM, threads,
+                  std::bind(&PaletteTable::patchSlabs, this, grid, base,
+                            &remap, &added,
+                            std::placeholders::_1, std::placeholders::_2));
+
+  return true;
+
+}
+
+
+
+template <typename T>
+static void remapColors(
+  std::vector<T>& vecIdx, const PaletteTable* base, const int* remap,
+  int first, int last, std::vector<bool>* dirty)
+{
+
+  const unsigned char* base8 = base->table8();
+  const unsigned short* base16 = base->table16();
+  const int* base32 = base->table32();
+
+  T* tbl = &vecIdx[0];
+
+  for (int color = first; color < last; ++color) {
+
+    int idx = remap[base8 ? base8[color] :
+                    base16 ? base16[color] :
+                             base32[color]];
+
+    if (idx < 0) {
+      (*dirty)[PaletteGrid::colorToBrick(color) & 1023] = true;
+      idx = 0;
+    }
+
+    tbl[color] = static_cast<T>(idx);
+
+  }
+
+}
+
+
+
+void PaletteTable::patchSlabs(
+  const PaletteGrid* grid, const PaletteTable* base,
+  const std::vector<int>* remap, const std::vector<bool>* added,
+  int first, int last)
+{
+
+  // Entries are only ever added or taken away, never moved, so a color can
+  // only end up matched differently if its old match is gone, or a new entry
+  // is closer. Everything gets renumbered first, straight through the table in
+  // order, and only the bricks where either could have happened are searched
+  // again from scratch. Surviving entries keep their order, so ties still go
+  // the same way they did before. Work is dealt out a slab at a time, each one
+  // a single layer of bricks, so no two threads ever share one.
+  const int SLAB_BRICKS = PaletteGrid::BRICKS_PER_DIM *
+                          PaletteGrid::BRICKS_PER_DIM,
+            SLAB_COLORS = SLAB_BRICKS * PaletteGrid::BRICK_SIZE;
+
+  std::vector<bool> dirty(SLAB_BRICKS);
+  std::vector<int> pltIdx(PaletteGrid::BRICK_SIZE);
+
+  for (int slab = first; slab < last; ++slab) {
+
+    std::fill(dirty.begin(), dirty.end(), false);
+
+    int firstColor = slab * SLAB_COLORS,
+        lastColor = firstColor + SLAB_COLORS;
+
+    if (!vecIdx8.empty())
+      remapColors(vecIdx8, base, &(*remap)[0], firstColor, lastColor, &dirty);
+    else if (!vecIdx16.empty())
+      remapColors(vecIdx16, base, &(*remap)[0], firstColor, lastColor, &dirty);
+    else
+      remapColors(vecIdx32, base, &(*remap)[0], firstColor, lastColor, &dirty);
+
+    for (int i = 0; i < SLAB_BRICKS; ++i) {
+
+      int brick = slab * SLAB_BRICKS + i;
+
+      if (dirty[i] || grid->brickMayUse(brick, *added)) {
+        grid->fillBrick(brick, &pltIdx[0]);
+        storeBrick(brick, &pltIdx[0]);
+      }
+
+    }
+
+  }
+
+}
+
+
+
+// The table file starts with a small header identifying what's in it, then the
+// palette itself, and finally the table of indices. Everything is written in
+// the machine's native byte order, since a cache directory is hardly something
+// to share between different architectures.
+struct TableHeader
+{
+  char magic[8];
+  int version, pixelType, metric, pltSize, idxBytes;
+};
+
+static const char TABLE_MAGIC[8] = { 'C', 'L', 'U', 'T', 'e', 'r', 0, 0 };
+static const int TABLE_VERSION = 2;
+
+
+
+std::string PaletteTable::tablePath(const std::string& cacheDir)
+{
+
+  // 64-bit FNV-1a over the colorspace, the metric, and every palette entry.
+  // Different palettes could in theory produce the same hash, so loadTable
+  // checks the palette stored in the file too; the hash only needs to be good
+  // enough that it rarely has to reject one.
+  unsigned long long hash = 14695981039346656037ULL;
+
+  std::vector<int> key(1, pixelType);
+  key.push_back(metric);
+  key.insert(key.end(), vecPlt.begin(), vecPlt.end());
+
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&key[0]);
+
+  for (size_t i = 0; i < key.size() * sizeof(int); ++i) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+
+  char name[32];
+  snprintf(name, sizeof(name), "cluter-%016llx.bin", hash);
+
+  std::string path = cacheDir;
+  if (path[path.size() - 1] != '/' && path[path.size() - 1] != '\\')
+    path += '/';
+
+  return path + name;
+
+}
+
+
+
+bool PaletteTable::loadTable(const std::string& path)
+{
+
+  if (!tableFile.open(path))
+    return false;
+
+  const size_t PLT_BYTES = vecPlt.size() * sizeof(int),
+               IDX_BYTES = vecPlt.size() <= 256 ? 1 :
+                           vecPlt.size() <= 65536 ? 2 :
+                                                    4;
+
+  TableHeader header;
+
+  // Anything that doesn't look exactly like the table I'd have built myself
+  // gets ignored, and rebuilt and saved over once I'm done with it.
+  bool valid = tableFile.size() ==
+                 sizeof(header) + PLT_BYTES + 16777216 * IDX_BYTES;
+
+  if (valid) {
+    memcpy(&header, tableFile.data(), sizeof(header));
+    valid = memcmp(header.magic, TABLE_MAGIC, sizeof(TABLE_MAGIC)) == 0 &&
+            header.version == TABLE_VERSION &&
+            header.pixelType == pixelType &&
+            header.metric == metric &&
+            header.pltSize == static_cast<int>(vecPlt.size()) &&
+            header.idxBytes == static_cast<int>(IDX_BYTES) &&
+            memcmp(tableFile.data() + sizeof(header), &vecPlt[0],
+                   PLT_BYTES) == 0;
+  }
+
+  if (!valid) {
+    tableFile.close();
+    return false;
+  }
+
+  const unsigned char* table = tableFile.data() + sizeof(header) + PLT_BYTES;
+
+  if (IDX_BYTES == 1)
+    tblIdx8 = table;
+  else if (IDX_BYTES == 2)
+    tblIdx16 = reinterpret_cast<const unsigned short*>(table);
+  else
+    tblIdx32 = reinterpret_cast<const int*>(table);
+
+  return true;
+
+}
+
+
+
+void PaletteTable::saveTable(const std::string& path)
+{
+
+  TableHeader header;
+
+  memcpy(header.magic, TABLE_MAGIC, sizeof(TABLE_MAGIC));
+  header.version = TABLE_VERSION;
+  header.pixelType = pixelType;
+  header.metric = metric;
+  header.pltSize = static_cast<int>(vecPlt.size());
+  header.idxBytes = tblIdx8 ? 1 : tblIdx16 ? 2 : 4;
+
+  const void* chunks[3] = {
+    &header,
+    &vecPlt[0],
+    tblIdx8 ? static_cast<const void*>(tblIdx8) :
+    tblIdx16 ? static_cast<const void*>(tblIdx16) :
+               static_cast<const void*>(tblIdx32)
+  };
+
+  size_t sizes[3] = {
+    sizeof(header),
+    vecPlt.size() * sizeof(int),
+    16777216 * static_cast<size_t>(header.idxBytes)
+  };
+
+  // Failing to save is no reason to stop the script; the table's already been
+  // built, and the next load will simply try again.
+  MappedFile::replace(path, chunks, sizes, 3);
+
+}
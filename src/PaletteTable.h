@@ -0,0 +1,149 @@
+#ifndef TURNSTILE_SRC_PALETTETABLE_H_INCLUDED
+#define TURNSTILE_SRC_PALETTETABLE_H_INCLUDED
+
+
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "BrickCache.h"
+#include "MappedFile.h"
+#include "PaletteGrid.h"
+#include "PaletteSearch.h"
+
+
+
+class PaletteTable
+{
+
+public:
+
+  PaletteTable(const std::vector<int>& _plt, int _pixelType, int _metric,
+               bool lazy, bool direct, int threads,
+               const std::string& cacheDir, const PaletteTable* base);
+
+  ~PaletteTable();
+
+  static std::shared_ptr<PaletteTable> acquire(
+    const std::vector<int>& plt, int pixelType, int metric, bool lazy,
+    bool direct, int threads, const std::string& cacheDir,
+    const PaletteTable* base);
+
+  int lookup(int packed)
+  {
+    if (cache)
+      return cache->lookup(packed);
+    else if (search)
+      return search->nearest(packed);
+    else if (tblIdx8)
+      return tblIdx8[packed];
+    else if (tblIdx16)
+      return tblIdx16[packed];
+    else
+      return tblIdx32[packed];
+  }
+
+  int color(int idx) const { return vecPlt[idx]; }
+
+  const int* colors() const { return &vecPlt[0]; }
+
+  bool hasColors(const std::vector<int>& plt) const { return plt == vecPlt; }
+
+  int size() const { return static_cast<int>(vecPlt.size()); }
+
+  const unsigned char* table8() const { return tblIdx8; }
+
+  const unsigned short* table16() const { return tblIdx16; }
+
+  const int* table32() const { return tblIdx32; }
+
+  BrickCache* lazyCache() const { return cache.get(); }
+
+  const PaletteSearch* directSearch() const { return search.get(); }
+
+  // Each of these looks up a whole run of colors at once, for one particular
+  // kind of table, so CLUTer's kernels don't have to ask which kind is in use
+  // for every pixel.
+  template<typename T>
+  struct Direct
+  {
+    const T* tbl;
+
+    explicit Direct(const T* _tbl) : tbl(_tbl) {}
+
+    void operator()(const int* packed, int* pltIdx, int count) const
+    {
+      for (int i = 0; i < count; ++i)
+        pltIdx[i] = tbl[packed[i]];
+    }
+  };
+
+  struct Lazy
+  {
+    BrickCache* cache;
+
+    explicit Lazy(BrickCache* _cache) : cache(_cache) {}
+
+    void operator()(const int* packed, int* pltIdx, int count) const
+    {
+      for (int i = 0; i < count; ++i)
+        pltIdx[i] = cache->lookup(packed[i]);
+    }
+  };
+
+  struct Search
+  {
+    const PaletteSearch* search;
+
+    explicit Search(const PaletteSearch* _search) : search(_search) {}
+
+    void operator()(const int* packed, int* pltIdx, int count) const
+    {
+      search->nearest(packed, pltIdx, count);
+    }
+  };
+
+private:
+
+  std::vector<int> vecPlt;
+
+  std::vector<unsigned char> vecIdx8;
+  std::vector<unsigned short> vecIdx16;
+  std::vector<int> vecIdx32;
+
+  const unsigned char* tblIdx8;
+  const unsigned short* tblIdx16;
+  const int* tblIdx32;
+
+  std::unique_ptr<BrickCache> cache;
+
+  std::unique_ptr<PaletteSearch> search;
+
+  MappedFile tableFile;
+
+  int pixelType, metric;
+
+  void fillBricks(const PaletteGrid* grid, int first, int last);
+
+  bool patchTable(const PaletteTable* base, const PaletteGrid* grid,
+                  int threads);
+
+  void patchSlabs(
+    const PaletteGrid* grid, const PaletteTable* base,
+    const std::vector<int>* remap, const std::vector<bool>* added,
+    int first, int last);
+
+  void storeBrick(int brick, const int* pltIdx);
+
+  std::string tablePath(const std::string& cacheDir);
+
+  bool loadTable(const std::string& path);
+
+  void saveTable(const std::string& path);
+
+};
+
+
+
+#endif // TURNSTILE_SRC_PALETTETABLE_H_INCLUDED
@@ -1,27 +1,54 @@
 #include "TurnsTile.h"
 
 #include <cmath>
+#include <cstdint>
 #include <cstring>
 
 #include <algorithm>
+#include <functional>
+#include <vector>
 
 #include "interface.h"
+#include "simd.h"
+#include "WorkerPool.h"
 
 
 
 TurnsTile::TurnsTile( PClip _child, PClip _tilesheet, VideoInfo _vi2,
                       int _tileW, int _tileH, int _res, int _mode,
                       const char* _levels, int _loTile, int _hiTile,
+                      int _threads, const char* _order, bool _stream,
+                      bool _indexOut, bool _fromMap, bool _reuse,
                       IScriptEnvironment* env) :
   GenericVideoFilter(_child), tilesheet(_tilesheet),
   tileW(_tileW), tileH(_tileH), mode(_mode),
-  srcCols(vi.width / tileW), srcRows(vi.height / tileH),
+  srcCols(_fromMap ? vi.width : vi.width / tileW),
+  srcRows(_fromMap ? vi.height : vi.height / tileH),
   shtCols(_vi2.width / tileW), shtRows(_vi2.height / tileH),
-  bytesPerSample(1), spp(vi.BytesFromPixels(1) / bytesPerSample),
-  PLANAR(vi.IsPlanar()), YUYV(vi.IsYUY2()), BGRA(vi.IsRGB32()), BGR(vi.IsRGB24())
+  bytesPerSample(_vi2.ComponentSize()),
+  spp(_vi2.BytesFromPixels(1) / bytesPerSample),
+  threads(_threads),
+  PLANAR(_vi2.IsPlanar()), YUYV(_vi2.IsYUY2()),
+  BGRA(_vi2.IsRGB32() || _vi2.IsRGB64()),
+  BGR(_vi2.IsRGB24() || _vi2.IsRGB48()),
+  planarRGB(_vi2.IsPlanarRGB()),
+  indexOut(_indexOut), fromMap(_fromMap),
+  indexWide(_fromMap ? vi.pixel_type == VideoInfo::CS_Y16 :
+                       shtCols * shtRows > 256),
+  reuse(_reuse && !_indexOut)
 {
 
-  if (vi.IsYUV() && !vi.IsY8()) {
+  // An index map has one sample for every tile, and says nothing else about
+  // the frames that come out, which take the tilesheet's colorspace; that's
+  // also why the layout above comes from the sheet, which otherwise always
+  // matches the clip anyway.
+  if (fromMap) {
+    vi.pixel_type = _vi2.pixel_type;
+    vi.width = srcCols * tileW;
+    vi.height = srcRows * tileH;
+  }
+
+  if (vi.IsYUV() && !vi.IsY()) {
     lumaW = 1 << vi.GetPlaneWidthSubsampling(PLANAR_U);
     lumaH = 1 << vi.GetPlaneHeightSubsampling(PLANAR_U);
   } else {
@@ -30,7 +57,7 @@ TurnsTile::TurnsTile( PClip _child, PClip _tilesheet, VideoInfo _vi2,
   }
 
   // A zero height tells fillTile to skip doing any work, which speeds up Y8.
-  if (vi.IsY8()) {
+  if (vi.IsY()) {
     tileW_U = 0;
     tileH_U = 0;
   } else {
@@ -38,21 +65,46 @@ TurnsTile::TurnsTile( PClip _child, PClip _tilesheet, VideoInfo _vi2,
     tileH_U = tileH / lumaH;
   }
 
+  byRow = strcmp(_order, "row") == 0;
+
+  // Streaming only ever happens a line at a time, so only in row order, only
+  // for solid tiles, and only for frames big enough to be pushed out of the
+  // cache before anyone reads them anyway; since the tiles always cover the
+  // whole frame, that's the luma, or packed pixels, plus both chroma planes.
+  // Avisynth gets the final say on whether the CPU can actually do it, since
+  // users can hide instruction sets from plugins with SetMaxCPU.
+  stream = false;
+
+#ifdef TURNSTILE_SSE2
+  long long frameBytes = bytesPerSample * (
+    static_cast<long long>(vi.width) * vi.height * spp +
+    (tileW_U ? 2LL * srcCols * tileW_U * srcRows * tileH_U : 0));
+
+  stream = _stream && byRow && !tilesheet &&
+           frameBytes >= STREAM_MIN_BYTES &&
+           (env->GetCPUFlags() & CPUF_SSE2) != 0;
+#endif
+
   tileCtrW_Y = mod(tileW / 2, lumaW, 0, tileW, -1);
   tileCtrW_U = tileW_U / 2;
   tileCtrH_Y = mod(tileH / 2, lumaH, 0, tileH, -1);
   tileCtrH_U = tileH_U / 2;
 
+  // Float samples are quantized to sixteen bits before they're looked up, so
+  // as far as picking tiles and filling them goes, they're 16-bit too.
+  const int BITS = bytesPerSample == 4 ? 16 : _vi2.BitsPerComponent(),
+            LEVEL_MAX = (1 << BITS) - 1;
+
   int idxInMin = 0;
   if (strcmp(_levels, "tv") == 0)
-    idxInMin = 16;
+    idxInMin = 16 << (BITS - 8);
 
-  int idxInMax = 255;
+  int idxInMax = LEVEL_MAX;
   if (strcmp(_levels, "tv") == 0) {
     if (mode > lumaW * lumaH)
-      idxInMax = 240;
+      idxInMax = 240 << (BITS - 8);
     else
-      idxInMax = 235;
+      idxInMax = 235 << (BITS - 8);
   }
 
   // An easy way to simulate the look of decreased bit depth; treat 'res'
@@ -75,12 +127,21 @@ TurnsTile::TurnsTile( PClip _child, PClip _tilesheet, VideoInfo _vi2,
   int depthMod = static_cast<int>(ceil( (_hiTile - _loTile) /
                                         (pow(2.0, _res) - 1.0) ));
 
-  if (tilesheet) {
+  if (fromMap) {
+
+    // Indices in a map were picked long ago, so there's nothing left to do
+    // but keep them within the tiles the sheet, and lotile and hitile, allow.
+    int count = indexWide ? 65536 : 256;
+
+    for (int in = 0; in < count; ++in)
+      lut.push_back(std::min(std::max(in, _loTile), _hiTile));
+
+  } else if (tilesheet) {
 
     double factor = static_cast<double>(_hiTile - _loTile) /
                     static_cast<double>(idxInMax - idxInMin);
 
-    for (int in = 0; in < 256; ++in) {
+    for (int in = 0; in <= LEVEL_MAX; ++in) {
 
       // The proper, generic form of this scaling formula would be:
       //
@@ -99,13 +160,29 @@ TurnsTile::TurnsTile( PClip _child, PClip _tilesheet, VideoInfo _vi2,
   } else {
 
     // No need to scale 'in' here, as above, since this only deals with
-    // component values (not tile indices), which with 8bpc color will always
-    // be less than 256.
-    for (int in = 0; in < 256; ++in)
+    // component values (not tile indices), which are never more than the
+    // bit depth allows.
+    for (int in = 0; in <= LEVEL_MAX; ++in)
       lut.push_back(mod(in, depthMod, _loTile, _hiTile, 0));
 
   }
 
+  // Ten to fourteen bit samples are stored in sixteen, and nothing stops a
+  // stray one having bits set above its depth, so the table covers every value
+  // a sample could hold, anything past the top level treated as the top level.
+  if (!fromMap)
+    lut.resize(bytesPerSample == 1 ? 256 : 65536, lut.back());
+
+  // The index output is one sample per tile, top to bottom like any other
+  // planar frame, naming the tile that would have been copied there. As with
+  // CLUTer, everything the kernels need to know about the input has been
+  // worked out by now, so it's safe to swap the colorspace out.
+  if (indexOut) {
+    vi.pixel_type = indexWide ? VideoInfo::CS_Y16 : VideoInfo::CS_Y8;
+    vi.width = srcCols;
+    vi.height = srcRows;
+  }
+
 }
 
 
@@ -122,7 +199,7 @@ PVideoFrame __stdcall TurnsTile::GetFrame(int n, IScriptEnvironment* env)
   PVideoFrame
     src = child->GetFrame(n, env),
     sht = 0,
-    dst = env->NewVideoFrame(vi);
+    dst = 0;
 
   const unsigned char
     * srcY = src->GetReadPtr(PLANAR_Y),
@@ -132,23 +209,37 @@ PVideoFrame __stdcall TurnsTile::GetFrame(int n, IScriptEnvironment* env)
     * shtU = 0,
     * shtV = 0;
 
-  unsigned char
-    * dstY = dst->GetWritePtr(PLANAR_Y),
-    * dstU = dst->GetWritePtr(PLANAR_U),
-    * dstV = dst->GetWritePtr(PLANAR_V);
-
   int
     SRC_PITCH_SAMPLES_Y = src->GetPitch(PLANAR_Y),
     SRC_PITCH_SAMPLES_U = src->GetPitch(PLANAR_U),
     SHT_PITCH_SAMPLES_Y = 0,
-    SHT_PITCH_SAMPLES_U = 0,
-    DST_PITCH_SAMPLES_Y = dst->GetPitch(PLANAR_Y),
-    DST_PITCH_SAMPLES_U = dst->GetPitch(PLANAR_U);
+    SHT_PITCH_SAMPLES_U = 0;
 
-  if (tilesheet) {
+  std::shared_ptr<const Atlas> sheetAtlas;
+
+  // The index output only needs to know how many tiles there are, which never
+  // changes, not what's in them.
+  if (tilesheet && !indexOut) {
 
     sht = tilesheet->GetFrame(n, env);
 
+    sheetAtlas = atlasFor(sht);
+
+  }
+
+  if (sheetAtlas) {
+
+    // Each line of a tile in the atlas follows right on from the last, so the
+    // pitch is just the width of a tile.
+    shtY = &sheetAtlas->y[0];
+    shtU = sheetAtlas->u.empty() ? 0 : &sheetAtlas->u[0];
+    shtV = sheetAtlas->v.empty() ? 0 : &sheetAtlas->v[0];
+
+    SHT_PITCH_SAMPLES_Y = tileW * spp * bytesPerSample;
+    SHT_PITCH_SAMPLES_U = tileW_U * bytesPerSample;
+
+  } else if (sht) {
+
     shtY = sht->GetReadPtr(PLANAR_Y);
     shtU = sht->GetReadPtr(PLANAR_U);
     shtV = sht->GetReadPtr(PLANAR_V);
@@ -158,20 +249,66 @@ PVideoFrame __stdcall TurnsTile::GetFrame(int n, IScriptEnvironment* env)
 
   }
 
+  bool fromAtlas = static_cast<bool>(sheetAtlas);
+
+  // Following on from the last frame rendered, only the tiles that have
+  // changed since then need writing, on top of a copy of that frame. If this
+  // filter holds the only reference left to it, Avisynth won't even bother
+  // copying.
+  std::unique_ptr<Rendered> prev, cur;
+
+  if (reuse)
+    takeRendered(n, sheetAtlas, &prev, &cur);
+
+  if (prev) {
+    dst = prev->frame;
+    prev->frame = 0;
+    env->MakeWritable(&dst);
+  } else {
+    dst = env->NewVideoFrame(vi);
+  }
+
+  unsigned char
+    * dstY = dst->GetWritePtr(PLANAR_Y),
+    * dstU = dst->GetWritePtr(PLANAR_U),
+    * dstV = dst->GetWritePtr(PLANAR_V);
+
+  int
+    DST_PITCH_SAMPLES_Y = dst->GetPitch(PLANAR_Y),
+    DST_PITCH_SAMPLES_U = dst->GetPitch(PLANAR_U);
+
+  // Every row of tiles reads from its own band of the source, and writes to its
+  // own band of the output, so a frame can be split into as many bands as
+  // there are threads to work on them, with nothing shared between them. The
+  // worker pool starts each thread off on one unbroken band, and any that run
+  // out early take over part of a slower one's.
+  using std::placeholders::_1;
+  using std::placeholders::_2;
+
   if (PLANAR)
-    processFramePlanar(
-      srcY, srcU, srcV,
-      shtY, shtU, shtV,
-      dstY, dstU, dstV,
-      SRC_PITCH_SAMPLES_Y, SRC_PITCH_SAMPLES_U,
-      SHT_PITCH_SAMPLES_Y, SHT_PITCH_SAMPLES_U,
-      DST_PITCH_SAMPLES_Y, DST_PITCH_SAMPLES_U,
-      env);
+    WorkerPool::run(srcRows, threads,
+                    std::bind(&TurnsTile::processFramePlanar, this,
+                              srcY, srcU, srcV,
+                              shtY, shtU, shtV,
+                              dstY, dstU, dstV,
+                              SRC_PITCH_SAMPLES_Y, SRC_PITCH_SAMPLES_U,
+                              SHT_PITCH_SAMPLES_Y, SHT_PITCH_SAMPLES_U,
+                              DST_PITCH_SAMPLES_Y, DST_PITCH_SAMPLES_U,
+                              fromAtlas, prev.get(), cur.get(), _1, _2));
   else
-    processFramePacked(
-      srcY, shtY, dstY,
-      SRC_PITCH_SAMPLES_Y, SHT_PITCH_SAMPLES_Y, DST_PITCH_SAMPLES_Y,
-      env);
+    WorkerPool::run(srcRows, threads,
+                    std::bind(&TurnsTile::processFramePacked, this,
+                              srcY, shtY, dstY,
+                              SRC_PITCH_SAMPLES_Y, SHT_PITCH_SAMPLES_Y,
+                              DST_PITCH_SAMPLES_Y,
+                              fromAtlas, prev.get(), cur.get(), _1, _2));
+
+  if (reuse) {
+    cur->n = n;
+    cur->frame = dst;
+    cur->atlas = sheetAtlas;
+    keepRendered(std::move(prev), std::move(cur));
+  }
 
   return dst;
 
@@ -179,344 +316,1461 @@ PVideoFrame __stdcall TurnsTile::GetFrame(int n, IScriptEnvironment* env)
 
 
 
-void TurnsTile::processFramePacked(
-  const unsigned char* srcp,
-  const unsigned char* shtp,
-  unsigned char* dstp,
-  const int SRC_PITCH_SAMPLES,
-  const int SHT_PITCH_SAMPLES,
-  const int DST_PITCH_SAMPLES,
-  IScriptEnvironment* env)
+void TurnsTile::takeRendered(
+  int n, const std::shared_ptr<const Atlas>& atlas,
+  std::unique_ptr<Rendered>* prev, std::unique_ptr<Rendered>* cur)
 {
 
-  for (int row = 0; row < srcRows; ++row) {
+  std::lock_guard<std::mutex> lock(renderedLock);
 
-    int srcRow = SRC_PITCH_SAMPLES * row * tileH,
-        dstRow = DST_PITCH_SAMPLES * row * tileH;
+  // Tiles copied from a sheet are only the same as last time if they came
+  // from the same atlas; a sheet that isn't in one can't be trusted to still
+  // have the same tiles in it. Anything else, from seeking to another thread
+  // getting there first, just means rendering the whole frame.
+  if (lastRendered && lastRendered->n == n - 1 &&
+      lastRendered->atlas == atlas && (atlas || !tilesheet))
+    prev->swap(lastRendered);
 
-    for (int col = 0; col < srcCols; ++col) {
+  // The keys from a frame that's no use anymore are recycled, since at 4K
+  // there can be millions of them.
+  if (spareRendered)
+    cur->swap(spareRendered);
+  else
+    cur->reset(new Rendered());
 
-      int curCol = col * tileW * spp;
+  Rendered* keys = cur->get();
+  const size_t count = static_cast<size_t>(srcCols) * srcRows;
+  const bool wide = !PLANAR && bytesPerSample == 2 && !tilesheet;
 
-      unsigned char* dstTile = dstp + dstRow + curCol;
+  keys->y.resize(wide ? 0 : count);
+  keys->u.resize(PLANAR && tileW_U ? count : 0);
+  keys->v.resize(keys->u.size());
+  keys->wide.resize(wide ? count : 0);
 
-      int tileCtr = srcRow + curCol +
-                    (tileCtrW_Y * spp) + (tileCtrH_Y * SRC_PITCH_SAMPLES);
+}
 
-      if (tilesheet) {
 
-        int tileIdx;
-        if (mode > 0) {
 
-          tileIdx = lut[*(srcp + tileCtr + (mode - 1))];
+void TurnsTile::keepRendered(
+  std::unique_ptr<Rendered> prev, std::unique_ptr<Rendered> cur)
+{
 
-        } else {
+  std::lock_guard<std::mutex> lock(renderedLock);
 
-          // The hardcoded three assumes the only packed formats that might come
-          // this way are RGB32, RGB24, and YUY2, which is true of Avisynth.
-          int sum = 0, count = 0;
-          for (int i = 0; i < 3; i += lumaW) {
-            sum += *(srcp + tileCtr + i);
-            ++count;
-          }
-          tileIdx = lut[sum / count];
+  // Frames can finish out of order when rendered on more than one thread, and
+  // an older one is no good to anybody.
+  if (!lastRendered || lastRendered->n < cur->n)
+    lastRendered.swap(cur);
 
-        }
+  std::unique_ptr<Rendered>& spare = cur ? cur : prev;
 
-        // If I didn't have to worry about the difference in layout between RGB
-        // and YUV, I would skip declaring tileIdxY and just jump right to
-        // cropTop, making it SHT_PITCH_SAMPLES * (tileIdx / shtCols) * tileH.
-        // Since RGB is "upside down" in memory, however, the desire for
-        // consistent tile numbering demands that I create this new variable and
-        // then do the subtraction; as a result, the top left tile is number 0
-        // regardless of input colorspace.
-        int tileIdxY = tileIdx / shtCols;
+  if (spare) {
+    spare->frame = 0;
+    spare->atlas.reset();
+    spareRendered.swap(spare);
+  }
 
-        if (BGRA || BGR)
-          tileIdxY = shtRows - 1 - tileIdxY;
+}
 
-        // Modulo here has the effect of "wrapping around" the horizontal tile
-        // count for the sheet you've provided.
-        int cropLeft = (tileIdx % shtCols) * tileW * spp,
-            cropTop = SHT_PITCH_SAMPLES * tileIdxY * tileH;
 
-        const unsigned char* shtTile = shtp + cropTop + cropLeft;
 
-        fillTile(
-          dstTile, DST_PITCH_SAMPLES,
-          shtTile, SHT_PITCH_SAMPLES,
-          tileW, tileH, 0, env);
+// Tiles are copied and filled by kernels picked once per frame, since with
+// tiles only a few bytes across, a call to memcpy or std::fill for every line
+// of every tile costs far more than the handful of bytes it actually writes.
+// Anything up to TINY_TILE_BYTES across gets a kernel with its width fixed at
+// compile time, which every compiler turns into a few plain stores per line.
+typedef void (*TileCopyKernel)(
+  unsigned char* dstp, const int DST_PITCH_SAMPLES,
+  const unsigned char* srcp, const int SRC_PITCH_SAMPLES,
+  const int widthBytes, const int height);
 
-      } else {
+typedef void (*TileFillKernel)(
+  unsigned char* dstp, const int DST_PITCH_SAMPLES,
+  const int widthBytes, const int height, const uint64_t fillVal);
 
-        if (BGRA || YUYV) {
+static const int TINY_TILE_BYTES = 16;
 
-          unsigned char
-            by = lut[*(srcp + tileCtr)],
-            gu = lut[*(srcp + tileCtr + 1)],
-            ry = lut[*(srcp + tileCtr + 2)],
-            av = lut[*(srcp + tileCtr + 3)];
 
-          unsigned int fillVal;
-          if (BGRA)
-            fillVal = (av << 24) | (ry << 16) | (gu << 8) | by;
-          else
-            fillVal = (av << 24) | (by << 16) | (gu << 8) | by;
 
-          fillTile(
-            dstTile, DST_PITCH_SAMPLES, static_cast<const unsigned char*>(0), 0,
-            tileW, tileH, fillVal, env);
+static void copyTile(
+  unsigned char* dstp, const int DST_PITCH_SAMPLES,
+  const unsigned char* srcp, const int SRC_PITCH_SAMPLES,
+  const int widthBytes, const int height)
+{
 
-        } else {
+  for (int h = 0; h < height; ++h)
+    memcpy(dstp + (DST_PITCH_SAMPLES * h), srcp + (SRC_PITCH_SAMPLES * h),
+           widthBytes);
 
-          // For the time being, I'm giving RGB24 its own slow, manual loop,
-          // instead of trying to get fillTile to handle a funny stepping
-          // sequence for a three byte pixel written four bytes at a time.
-          unsigned char
-            b = lut[*(srcp + tileCtr + 0)],
-            g = lut[*(srcp + tileCtr + 1)],
-            r = lut[*(srcp + tileCtr + 2)];
+}
 
-          for (int h = 0; h < tileH; ++h) {
 
-            int dstLine = DST_PITCH_SAMPLES * h;
 
-            for (int w = 0; w < tileW; ++w) {
+template<int WIDTH_BYTES>
+static void copyTinyTile(
+  unsigned char* dstp, const int DST_PITCH_SAMPLES,
+  const unsigned char* srcp, const int SRC_PITCH_SAMPLES,
+  const int /*widthBytes*/, const int height)
+{
 
-              int dstOfs = dstRow + curCol + dstLine + (w * spp);
+  for (int h = 0; h < height; ++h)
+    memcpy(dstp + (DST_PITCH_SAMPLES * h), srcp + (SRC_PITCH_SAMPLES * h),
+           WIDTH_BYTES);
 
-              *(dstp + dstOfs + 0) = b;
-              *(dstp + dstOfs + 1) = g;
-              *(dstp + dstOfs + 2) = r;
+}
 
-            }
 
-          }
 
-        }
+// Solid fills write the tile's value from a pattern of it repeated across
+// PATTERN_BYTES, the smallest span holding a whole number of pixels of every
+// size from one byte to eight, as well as of sixteen byte stores. That's what
+// finally lets RGB24 be filled in whole words instead of three bytes at a
+// time; fillVal only ever uses as many of its low bytes as a pixel has.
+static const int PATTERN_BYTES = 48;
 
-      }
 
-    }
+
+// Only the first WORDS words of the pattern are filled in, since tiny tiles
+// never need the rest.
+template<int PIXEL_BYTES, int WORDS>
+static inline void makePattern(uint64_t fillVal, unsigned int* pattern)
+{
+
+  // An RGB64 pixel is two whole words, and the only one that doesn't repeat
+  // every three.
+  if (PIXEL_BYTES == 8) {
+    for (int i = 0; i < WORDS; ++i)
+      pattern[i] = static_cast<unsigned int>(fillVal >> (32 * (i % 2)));
+    return;
+  }
+
+  unsigned int w0, w1, w2;
+
+  if (PIXEL_BYTES == 1) {
+
+    w0 = w1 = w2 = (fillVal & 255) * 0x01010101u;
+
+  } else if (PIXEL_BYTES == 2) {
+
+    w0 = w1 = w2 = (fillVal & 65535) * 0x00010001u;
+
+  } else if (PIXEL_BYTES == 3) {
+
+    unsigned int b = fillVal & 255,
+                 g = (fillVal >> 8) & 255,
+                 r = (fillVal >> 16) & 255;
+
+    w0 = (b << 24) | (r << 16) | (g << 8) | b;
+    w1 = (g << 24) | (b << 16) | (r << 8) | g;
+    w2 = (r << 24) | (g << 16) | (b << 8) | r;
+
+  } else if (PIXEL_BYTES == 6) {
+
+    unsigned int b = fillVal & 65535,
+                 g = (fillVal >> 16) & 65535,
+                 r = (fillVal >> 32) & 65535;
+
+    w0 = (g << 16) | b;
+    w1 = (b << 16) | r;
+    w2 = (r << 16) | g;
+
+  } else {
+
+    w0 = w1 = w2 = static_cast<unsigned int>(fillVal);
 
   }
 
+  for (int i = 0; i < WORDS; i += 3) {
+    pattern[i] = w0;
+    if (i + 1 < WORDS)
+      pattern[i + 1] = w1;
+    if (i + 2 < WORDS)
+      pattern[i + 2] = w2;
+  }
+
 }
 
 
 
-void TurnsTile::processFramePlanar(
-  const unsigned char* srcY,
-  const unsigned char* srcU,
-  const unsigned char* srcV,
-  const unsigned char* shtY,
-  const unsigned char* shtU,
-  const unsigned char* shtV,
-  unsigned char* dstY,
-  unsigned char* dstU,
-  unsigned char* dstV,
-  const int SRC_PITCH_SAMPLES_Y, const int SRC_PITCH_SAMPLES_U,
-  const int SHT_PITCH_SAMPLES_Y, const int SHT_PITCH_SAMPLES_U,
-  const int DST_PITCH_SAMPLES_Y, const int DST_PITCH_SAMPLES_U,
-  IScriptEnvironment* env)
+template<int PIXEL_BYTES>
+static void fillTile(
+  unsigned char* dstp, const int DST_PITCH_SAMPLES,
+  const int widthBytes, const int height, const uint64_t fillVal)
 {
 
-  for (int row = 0; row < srcRows; ++row) {
+  // A run of single bytes is what memset is for, and nothing here beats it.
+  if (PIXEL_BYTES == 1) {
+    for (int h = 0; h < height; ++h)
+      memset(dstp + (DST_PITCH_SAMPLES * h), fillVal & 255, widthBytes);
+    return;
+  }
 
-    int srcRowY = SRC_PITCH_SAMPLES_Y * row * tileH,
-        srcRowU = SRC_PITCH_SAMPLES_U * row * tileH_U;
+  unsigned int pattern[PATTERN_BYTES / 4];
+  makePattern<PIXEL_BYTES, PATTERN_BYTES / 4>(fillVal, pattern);
 
-    int dstRowY = DST_PITCH_SAMPLES_Y * row * tileH,
-        dstRowU = DST_PITCH_SAMPLES_U * row * tileH_U;
+#ifdef TURNSTILE_SSE2
+  const __m128i
+    P0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pattern)),
+    P1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pattern + 4)),
+    P2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pattern + 8));
+#endif
 
-    for (int col = 0; col < srcCols; ++col) {
+  for (int h = 0; h < height; ++h) {
 
-      int curColY = col * tileW,
-          curColU = col * tileW_U;
+    unsigned char* lineStart = dstp + (DST_PITCH_SAMPLES * h);
 
-      unsigned char
-          * dstTileY = dstY + dstRowY + curColY,
-          * dstTileU = dstU + dstRowU + curColU,
-          * dstTileV = dstV + dstRowU + curColU;
+    int w = 0;
 
-      int
-        tileCtrY = srcRowY + curColY +
-                   (tileCtrW_Y * spp) + (tileCtrH_Y * SRC_PITCH_SAMPLES_Y),
-        tileCtrU = srcRowU + curColU +
-                   (tileCtrW_U * spp) + (tileCtrH_U * SRC_PITCH_SAMPLES_U);
+    for (; w + PATTERN_BYTES <= widthBytes; w += PATTERN_BYTES) {
+#ifdef TURNSTILE_SSE2
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(lineStart + w), P0);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(lineStart + w + 16), P1);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(lineStart + w + 32), P2);
+#else
+      memcpy(lineStart + w, pattern, PATTERN_BYTES);
+#endif
+    }
 
-      if (tilesheet) {
+    memcpy(lineStart + w, pattern, widthBytes - w);
 
-        int tileIdx;
-        if (mode == lumaW * lumaH + 2) {
+  }
 
-          tileIdx = lut[*(srcV + tileCtrU)];
+}
 
-        } else if (mode == lumaW * lumaH + 1) {
 
-          tileIdx = lut[*(srcU + tileCtrU)];
 
-        } else {
+template<int PIXEL_BYTES, int WIDTH_BYTES>
+static void fillTinyTile(
+  unsigned char* dstp, const int DST_PITCH_SAMPLES,
+  const int /*widthBytes*/, const int height, const uint64_t fillVal)
+{
 
-          if (mode > 0) {
+  // Every line of a tiny tile is just the first WIDTH_BYTES of the pattern.
+  unsigned int pattern[(WIDTH_BYTES + 3) / 4];
+  makePattern<PIXEL_BYTES, (WIDTH_BYTES + 3) / 4>(fillVal, pattern);
 
-            // This works assuming the luma samples in a macropixel are treated
-            // as being numbered from zero, left to right, top to bottom.
-            int lumaModeOfs = ((mode % lumaH) * SRC_PITCH_SAMPLES_Y) +
-                              ((mode - 1) % lumaW);
-            tileIdx = lut[*(srcY + tileCtrY + lumaModeOfs)];
+  for (int h = 0; h < height; ++h)
+    memcpy(dstp + (DST_PITCH_SAMPLES * h), pattern, WIDTH_BYTES);
 
-          } else {
+}
 
-            int sum = 0, count = 0;
-            for (int i = 0; i < lumaH; ++i)
-              for (int j = 0; j < lumaW; ++j) {
-                sum += *(srcY + tileCtrY + (SRC_PITCH_SAMPLES_Y * i) + j);
-                ++count;
-              }
-            tileIdx = lut[sum / count];
 
-          }
 
-        }
+// When a row of tiles is written a line at a time, each line of it is made up
+// of one line from each of the row's tiles in the tilesheet, every one at its
+// own offset from the same line of the sheet.
+typedef void (*TileLineKernel)(
+  unsigned char* dstp, const unsigned char* srcp, const int* offsets,
+  const int count, const int widthBytes);
 
-        int cropLeftY = (tileIdx % shtCols) * tileW,
-            cropLeftU = (tileIdx % shtCols) * tileW_U,
-            cropTopY = (tileIdx / shtCols) * SHT_PITCH_SAMPLES_Y * tileH,
-            cropTopU = (tileIdx / shtCols) * SHT_PITCH_SAMPLES_U * tileH_U;
-
-        const unsigned char
-          * shtTileY = shtY + cropLeftY + cropTopY,
-          * shtTileU = shtU + cropLeftU + cropTopU,
-          * shtTileV = shtV + cropLeftU + cropTopU;
-
-        fillTile(
-          dstTileY, DST_PITCH_SAMPLES_Y,
-          shtTileY, SHT_PITCH_SAMPLES_Y,
-          tileW, tileH, 0, env);
-        fillTile(
-          dstTileU, DST_PITCH_SAMPLES_U,
-          shtTileU, SHT_PITCH_SAMPLES_U,
-          tileW_U, tileH_U, 0, env);
-        fillTile(
-          dstTileV, DST_PITCH_SAMPLES_U,
-          shtTileV, SHT_PITCH_SAMPLES_U,
-          tileW_U, tileH_U, 0, env);
 
-      } else {
 
-        fillTile(
-          dstTileY, DST_PITCH_SAMPLES_Y, static_cast<unsigned char*>(0), 0,
-          tileW, tileH,
-          static_cast<unsigned char>(lut[*(srcY + tileCtrY)]), env);
-        fillTile(
-          dstTileU, DST_PITCH_SAMPLES_U, static_cast<unsigned char*>(0), 0,
-          tileW_U, tileH_U,
-          static_cast<unsigned char>(lut[*(srcU + tileCtrU)]), env);
-        fillTile(
-          dstTileV, DST_PITCH_SAMPLES_U, static_cast<unsigned char*>(0), 0,
-          tileW_U, tileH_U,
-          static_cast<unsigned char>(lut[*(srcV + tileCtrU)]), env);
+static void copyTileLine(
+  unsigned char* dstp, const unsigned char* srcp, const int* offsets,
+  const int count, const int widthBytes)
+{
 
-      }
+  for (int i = 0; i < count; ++i)
+    memcpy(dstp + (widthBytes * i), srcp + offsets[i], widthBytes);
+
+}
 
-    }
 
-  }
+
+template<int WIDTH_BYTES>
+static void copyTinyTileLine(
+  unsigned char* dstp, const unsigned char* srcp, const int* offsets,
+  const int count, const int /*widthBytes*/)
+{
+
+  for (int i = 0; i < count; ++i)
+    memcpy(dstp + (WIDTH_BYTES * i), srcp + offsets[i], WIDTH_BYTES);
 
 }
 
 
 
-int __stdcall TurnsTile::SetCacheHints(int cachehints, int frame_range)
+// Each of these counts down from the widest tiny tile, so the whole set of
+// kernels is instantiated without having to list every one of them by hand.
+template<int WIDTH_BYTES>
+struct TinyTileKernels
 {
 
-  int hints = 0;
+  static TileCopyKernel copy(int widthBytes)
+  {
+    return widthBytes == WIDTH_BYTES ?
+      &copyTinyTile<WIDTH_BYTES> :
+      TinyTileKernels<WIDTH_BYTES - 1>::copy(widthBytes);
+  }
 
-  if (cachehints == CACHE_GETCHILD_ACCESS_COST) {
-    hints = CACHE_ACCESS_RAND;
+  static TileLineKernel copyLine(int widthBytes)
+  {
+    return widthBytes == WIDTH_BYTES ?
+      &copyTinyTileLine<WIDTH_BYTES> :
+      TinyTileKernels<WIDTH_BYTES - 1>::copyLine(widthBytes);
   }
-  else if (cachehints == CACHE_GETCHILD_COST) {
-    hints = CACHE_COST_LOW;
+
+  template<int PIXEL_BYTES>
+  static TileFillKernel fill(int widthBytes)
+  {
+    return widthBytes == WIDTH_BYTES ?
+      &fillTinyTile<PIXEL_BYTES, WIDTH_BYTES> :
+      TinyTileKernels<WIDTH_BYTES - 1>::template fill<PIXEL_BYTES>(widthBytes);
   }
-  else if (cachehints == CACHE_GETCHILD_THREAD_MODE) {
-    hints = CACHE_THREAD_SAFE;
+
+};
+
+
+
+template<>
+struct TinyTileKernels<0>
+{
+
+  static TileCopyKernel copy(int)
+  {
+    return &copyTile;
   }
-  else if (cachehints == CACHE_GET_MTMODE) {
-    hints = MT_NICE_FILTER;
+
+  static TileLineKernel copyLine(int)
+  {
+    return &copyTileLine;
   }
 
-  return hints;
+  template<int PIXEL_BYTES>
+  static TileFillKernel fill(int)
+  {
+    return &fillTile<PIXEL_BYTES>;
+  }
+
+};
+
+
+
+static TileCopyKernel copyKernel(int widthBytes)
+{
+
+  return TinyTileKernels<TINY_TILE_BYTES>::copy(widthBytes);
 
 }
 
 
 
-int TurnsTile::gcf(int a, int b)
+template<int PIXEL_BYTES>
+static TileFillKernel fillKernel(int widthBytes)
 {
 
-  if (b == 0)
-    return a;
-  else
-    return gcf(b, a % b);
+  return TinyTileKernels<TINY_TILE_BYTES>::template fill<PIXEL_BYTES>(
+    widthBytes);
 
 }
 
 
 
-int TurnsTile::mod(int num, int mod, int min, int max, int dir)
+static TileLineKernel copyLineKernel(int widthBytes)
 {
 
-  double base = static_cast<double>(num) / static_cast<double>(mod);
+  return TinyTileKernels<TINY_TILE_BYTES>::copyLine(widthBytes);
 
-  int rounded;
-  if (dir == -1)
-    rounded = static_cast<int>(floor(base)) * mod;
-  else if (dir == 1)
-    rounded = static_cast<int>(ceil(base)) * mod;
-  else
-    rounded = static_cast<int>(base + 0.5) * mod;
+}
 
-  if (rounded >= min && rounded <= max)
-    return rounded;
-  else if (rounded < min)
-    return min;
-  else
-    return max;
+
+
+// Past a certain size, the output frame is gone from the cache long before the
+// next filter reads it, so when asked to, each line of solid tiles is built in
+// a small buffer and then streamed out to the frame with non-temporal stores,
+// which skip the cache entirely instead of pushing out everything else in it
+// on the way. Tiles copied from a tilesheet don't get the same treatment; they
+// would have to be copied into the buffer first, and that costs about as much
+// as streaming them out saves.
+static void streamLine(
+  unsigned char* dstp, const unsigned char* srcp, const int widthBytes)
+{
+
+#ifdef TURNSTILE_SSE2
+  // The stores themselves need sixteen byte alignment, so anything before the
+  // first aligned address, or after the last, is written the usual way.
+  int w = static_cast<int>(
+    (16 - (reinterpret_cast<uintptr_t>(dstp) & 15)) & 15);
+
+  if (w > widthBytes)
+    w = widthBytes;
+
+  memcpy(dstp, srcp, w);
+
+  for (; w + 16 <= widthBytes; w += 16)
+    _mm_stream_si128(
+      reinterpret_cast<__m128i*>(dstp + w),
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(srcp + w)));
+
+  memcpy(dstp + w, srcp + w, widthBytes - w);
+#else
+  memcpy(dstp, srcp, widthBytes);
+#endif
 
 }
 
 
 
-template<typename Tsample, typename Tpixel>
-void TurnsTile::fillTile(
-  Tsample* dstp, const int DST_PITCH_SAMPLES,
-  const Tsample* srcp, const int SRC_PITCH_SAMPLES,
-  const int width, const int height, const Tpixel fillVal,
-  IScriptEnvironment* env) const
+// With the keys from the last frame to compare against, the tiles in a row
+// that have changed since are handed out a run at a time, starting from the
+// end of the last run; without them, the whole row is one run.
+template<typename KEY>
+static bool nextChangedRun(
+  const KEY* keys, const KEY* prevKeys, const int count,
+  int* first, int* end)
 {
 
-  int widthSamples = width * spp;
+  int i = *end;
+
+  if (!prevKeys) {
+    *first = i;
+    *end = count;
+    return i < count;
+  }
 
-  if (srcp) {
+  while (i < count && keys[i] == prevKeys[i])
+    ++i;
 
-    int widthBytes = widthSamples * bytesPerSample;
-    env->BitBlt(
-      dstp, DST_PITCH_SAMPLES, srcp, SRC_PITCH_SAMPLES, widthBytes, height);
+  if (i == count)
+    return false;
+
+  *first = i;
+
+  while (i < count && keys[i] != prevKeys[i])
+    ++i;
+
+  *end = i;
+
+  return true;
+
+}
+
+
+
+// A row of tiles can go out one of two ways. Tile by tile, every tile is
+// written top to bottom before moving on to the next, so each line of the row
+// gets revisited once for every tile across it, a few bytes at a time, and at
+// 4K that's enough lines in flight at once to push earlier ones out of the
+// cache before they're finished. Line by line, each line of the row is written
+// once, left to right, and then never touched again. Solid tiles have it even
+// easier, since every line of a row of them is the same: the first is built
+// in place, and copied out whole to the rest while it's still in the cache.
+static void copyTileRow(
+  TileCopyKernel COPY, TileLineKernel COPY_LINE, bool byRow,
+  unsigned char* dstp, const int DST_PITCH_SAMPLES,
+  const unsigned char* srcp, const int SRC_PITCH_SAMPLES,
+  const int* offsets, const unsigned int* prevKeys, unsigned int* keys,
+  const int count, const int widthBytes, const int height)
+{
+
+  // A tile's offset is all it takes to say what ends up in it, so it doubles
+  // as the key that tells whether the tile has changed since the last frame.
+  const unsigned int* rowKeys = reinterpret_cast<const unsigned int*>(offsets);
+
+  int first = 0, end = 0;
+
+  while (nextChangedRun(rowKeys, prevKeys, count, &first, &end)) {
+    if (byRow) {
+      for (int h = 0; h < height; ++h)
+        COPY_LINE(
+          dstp + (DST_PITCH_SAMPLES * h) + (widthBytes * first),
+          srcp + (SRC_PITCH_SAMPLES * h),
+          offsets + first, end - first, widthBytes);
+    } else {
+      for (int i = first; i < end; ++i)
+        COPY(
+          dstp + (widthBytes * i), DST_PITCH_SAMPLES,
+          srcp + offsets[i], SRC_PITCH_SAMPLES,
+          widthBytes, height);
+    }
+  }
+
+  if (keys)
+    memcpy(keys, rowKeys, count * sizeof(*keys));
+
+}
 
-  } else {
 
-    for (int h = 0; h < height; ++h) {
 
-      Tsample* lineStart = dstp + (DST_PITCH_SAMPLES * h);
-      Tsample* lineEnd = lineStart + widthSamples;
-      std::fill(
-        reinterpret_cast<Tpixel*>(lineStart),
-        reinterpret_cast<Tpixel*>(lineEnd),
-        fillVal);
+template<typename KEY>
+static void fillTileRow(
+  TileFillKernel FILL, bool byRow,
+  unsigned char* dstp, const int DST_PITCH_SAMPLES, unsigned char* line,
+  const KEY* fillVals, const KEY* prevKeys, KEY* keys,
+  const int count, const int widthBytes, const int height)
+{
 
+  int first = 0, end = 0;
+
+  while (nextChangedRun(fillVals, prevKeys, count, &first, &end)) {
+
+    unsigned char* runp = dstp + (widthBytes * first);
+    const int RUN_BYTES = widthBytes * (end - first);
+
+    if (byRow && line) {
+      for (int i = first; i < end; ++i)
+        FILL(line + (widthBytes * (i - first)), 0, widthBytes, 1, fillVals[i]);
+      for (int h = 0; h < height; ++h)
+        streamLine(runp + (DST_PITCH_SAMPLES * h), line, RUN_BYTES);
+    } else if (byRow) {
+      for (int i = first; i < end; ++i)
+        FILL(dstp + (widthBytes * i), 0, widthBytes, 1, fillVals[i]);
+      for (int h = 1; h < height; ++h)
+        memcpy(runp + (DST_PITCH_SAMPLES * h), runp, RUN_BYTES);
+    } else {
+      for (int i = first; i < end; ++i)
+        FILL(
+          dstp + (widthBytes * i), DST_PITCH_SAMPLES,
+          widthBytes, height, fillVals[i]);
     }
 
   }
 
+  if (keys)
+    memcpy(keys, fillVals, count * sizeof(*keys));
+
+}
+
+
+
+std::shared_ptr<const TurnsTile::Atlas> TurnsTile::atlasFor(
+  const PVideoFrame& sht)
+{
+
+  // Nearly every tilesheet is a single image that never changes, and reading
+  // tiles straight out of it means strided reads scattered all over a frame
+  // that may be far bigger than the cache. Instead, a sheet that turns up a
+  // second time gets cut up into an atlas, and every frame after that with
+  // the same sheet takes its tiles from there, each one a single run of
+  // memory. The first time, it's only remembered, so a sheet that's different
+  // for every frame is never sliced up for nothing. The last couple of sheets
+  // are kept, so the two fields of an interlaced sheet don't keep pushing each
+  // other out.
+  std::vector<std::shared_ptr<const Atlas> > known;
+
+  {
+    std::lock_guard<std::mutex> lock(atlasLock);
+    known.assign(recentAtlases.begin(), recentAtlases.end());
+  }
+
+  for (size_t i = 0; i < known.size(); ++i) {
+
+    if (!sameSheet(known[i]->sheet, sht, PLANAR && tileW_U))
+      continue;
+
+    if (!known[i]->y.empty())
+      return known[i];
+
+    std::shared_ptr<const Atlas> built = buildAtlas(known[i]->sheet);
+
+    std::lock_guard<std::mutex> lock(atlasLock);
+
+    std::replace(
+      recentAtlases.begin(), recentAtlases.end(), known[i], built);
+
+    return built;
+
+  }
+
+  std::shared_ptr<Atlas> seen(new Atlas);
+  seen->sheet = sht;
+
+  std::lock_guard<std::mutex> lock(atlasLock);
+
+  recentAtlases.push_front(seen);
+
+  if (recentAtlases.size() > RECENT_ATLASES)
+    recentAtlases.pop_back();
+
+  return std::shared_ptr<const Atlas>();
+
+}
+
+
+
+std::shared_ptr<const TurnsTile::Atlas> TurnsTile::buildAtlas(
+  const PVideoFrame& sht) const
+{
+
+  std::shared_ptr<Atlas> out(new Atlas);
+
+  out->sheet = sht;
+
+  // Packed RGB is stored upside down, but tile numbers count from the top
+  // left regardless of colorspace, so its rows of tiles are taken bottom up.
+  sliceSheet(
+    sht->GetReadPtr(PLANAR_Y), sht->GetPitch(PLANAR_Y),
+    tileW * spp * bytesPerSample, tileH, !PLANAR && !YUYV, &out->y);
+
+  if (PLANAR && tileW_U) {
+    sliceSheet(
+      sht->GetReadPtr(PLANAR_U), sht->GetPitch(PLANAR_U),
+      tileW_U * bytesPerSample, tileH_U, false, &out->u);
+    sliceSheet(
+      sht->GetReadPtr(PLANAR_V), sht->GetPitch(PLANAR_U),
+      tileW_U * bytesPerSample, tileH_U, false, &out->v);
+  }
+
+  return out;
+
+}
+
+
+
+void TurnsTile::sliceSheet(
+  const unsigned char* shtp, const int SHT_PITCH_SAMPLES,
+  const int TILE_BYTES, const int TILE_H, const bool FLIP,
+  std::vector<unsigned char>* out) const
+{
+
+  const int TILE_SIZE = TILE_BYTES * TILE_H;
+
+  out->resize(static_cast<size_t>(shtCols) * shtRows * TILE_SIZE);
+
+  unsigned char* outp = &(*out)[0];
+
+  for (int idx = 0; idx < shtCols * shtRows; ++idx, outp += TILE_SIZE) {
+
+    int tileIdxY = idx / shtCols;
+
+    if (FLIP)
+      tileIdxY = shtRows - 1 - tileIdxY;
+
+    copyTile(
+      outp, TILE_BYTES,
+      shtp + SHT_PITCH_SAMPLES * tileIdxY * TILE_H +
+        (idx % shtCols) * TILE_BYTES,
+      SHT_PITCH_SAMPLES,
+      TILE_BYTES, TILE_H);
+
+  }
+
+}
+
+
+
+bool TurnsTile::sameSheet(
+  const PVideoFrame& a, const PVideoFrame& b, bool hasChroma)
+{
+
+  // Holding on to the atlas's sheet frame means its buffer can't be handed
+  // out again, so if a frame's sheet comes back in the very same buffer, it's
+  // the very same sheet, and there's no need to look any closer.
+  if (a->GetReadPtr(PLANAR_Y) == b->GetReadPtr(PLANAR_Y))
+    return true;
+
+  const int PLANES[] = { PLANAR_Y, PLANAR_U, PLANAR_V };
+
+  for (int i = 0; i < (hasChroma ? 3 : 1); ++i) {
+
+    const unsigned char
+      * ap = a->GetReadPtr(PLANES[i]),
+      * bp = b->GetReadPtr(PLANES[i]);
+
+    const int ROW_SIZE = a->GetRowSize(PLANES[i]),
+              HEIGHT = a->GetHeight(PLANES[i]),
+              A_PITCH = a->GetPitch(PLANES[i]),
+              B_PITCH = b->GetPitch(PLANES[i]);
+
+    for (int h = 0; h < HEIGHT; ++h)
+      if (memcmp(ap + A_PITCH * h, bp + B_PITCH * h, ROW_SIZE) != 0)
+        return false;
+
+  }
+
+  return true;
+
+}
+
+
+
+// Indices are gathered a row at a time and written here, rather than as each
+// tile is picked, since a store through a char pointer could, as far as the
+// compiler knows, change any member the kernels read, and keep it from
+// holding them in registers across the row.
+void TurnsTile::writeIndexRow(unsigned char* dstp, const int* indices) const
+{
+
+  if (indexWide) {
+
+    uint16_t* dst = reinterpret_cast<uint16_t*>(dstp);
+    for (int col = 0; col < srcCols; ++col)
+      dst[col] = static_cast<uint16_t>(indices[col]);
+
+  } else {
+
+    for (int col = 0; col < srcCols; ++col)
+      dstp[col] = static_cast<unsigned char>(indices[col]);
+
+  }
+
+}
+
+
+
+// Every sample is looked up in the table by its level: just the sample itself
+// for integer formats, while float is quantized to sixteen bits, its chroma
+// shifted so that zero lands in the middle like any other format's. Anything
+// out of range, NaN included, is clamped to the nearest end.
+template<typename T>
+static inline int levelOf(const unsigned char* samplep, bool /*centered*/)
+{
+
+  return *reinterpret_cast<const T*>(samplep);
+
+}
+
+
+
+template<>
+inline int levelOf<float>(const unsigned char* samplep, bool centered)
+{
+
+  float level = *reinterpret_cast<const float*>(samplep) * 65535.0f +
+                (centered ? 32768.5f : 0.5f);
+
+  if (!(level >= 0.0f))
+    return 0;
+  else if (level >= 65535.0f)
+    return 65535;
+  else
+    return static_cast<int>(level);
+
+}
+
+
+
+// Solid tiles go the other way, from a level back to the bits of a sample.
+template<typename T>
+static inline unsigned int sampleBits(int level, bool /*centered*/)
+{
+
+  return level;
+
+}
+
+
+
+template<>
+inline unsigned int sampleBits<float>(int level, bool centered)
+{
+
+  float sample = (level - (centered ? 32768 : 0)) / 65535.0f;
+
+  uint32_t bits;
+  memcpy(&bits, &sample, sizeof(bits));
+
+  return bits;
+
+}
+
+
+
+void TurnsTile::processFramePacked(
+  const unsigned char* srcp,
+  const unsigned char* shtp,
+  unsigned char* dstp,
+  const int SRC_PITCH_SAMPLES,
+  const int SHT_PITCH_SAMPLES,
+  const int DST_PITCH_SAMPLES,
+  bool fromAtlas, const Rendered* prev, Rendered* cur,
+  int firstRow, int lastRow)
+{
+
+  // With tiles only a few pixels across, the time spent filling each one is
+  // nothing next to the time spent working out what to fill it with, so every
+  // packed format gets its own kernel, with its sample count and size fixed at
+  // compile time, rather than one loop asking after the colorspace at every
+  // tile. RGB48 and RGB64 are the only packed formats with 16-bit samples.
+  if (BGRA && bytesPerSample == 2)
+    tilePacked<uint16_t, 4, false>(
+      srcp, shtp, dstp,
+      SRC_PITCH_SAMPLES, SHT_PITCH_SAMPLES, DST_PITCH_SAMPLES,
+      fromAtlas, prev, cur, firstRow, lastRow);
+  else if (BGR && bytesPerSample == 2)
+    tilePacked<uint16_t, 3, false>(
+      srcp, shtp, dstp,
+      SRC_PITCH_SAMPLES, SHT_PITCH_SAMPLES, DST_PITCH_SAMPLES,
+      fromAtlas, prev, cur, firstRow, lastRow);
+  else if (BGRA)
+    tilePacked<unsigned char, 4, false>(
+      srcp, shtp, dstp,
+      SRC_PITCH_SAMPLES, SHT_PITCH_SAMPLES, DST_PITCH_SAMPLES,
+      fromAtlas, prev, cur, firstRow, lastRow);
+  else if (BGR)
+    tilePacked<unsigned char, 3, false>(
+      srcp, shtp, dstp,
+      SRC_PITCH_SAMPLES, SHT_PITCH_SAMPLES, DST_PITCH_SAMPLES,
+      fromAtlas, prev, cur, firstRow, lastRow);
+  else
+    tilePacked<unsigned char, 2, true>(
+      srcp, shtp, dstp,
+      SRC_PITCH_SAMPLES, SHT_PITCH_SAMPLES, DST_PITCH_SAMPLES,
+      fromAtlas, prev, cur, firstRow, lastRow);
+
+}
+
+
+
+template<typename T, int SPP, bool IS_YUYV>
+void TurnsTile::tilePacked(
+  const unsigned char* srcp,
+  const unsigned char* shtp,
+  unsigned char* dstp,
+  const int SRC_PITCH_SAMPLES,
+  const int SHT_PITCH_SAMPLES,
+  const int DST_PITCH_SAMPLES,
+  bool fromAtlas, const Rendered* prev, Rendered* cur,
+  int firstRow, int lastRow) const
+{
+
+  if (!tilesheet)
+    tilePackedRows<T, SPP, IS_YUYV, PICK_NONE>(
+      srcp, shtp, dstp,
+      SRC_PITCH_SAMPLES, SHT_PITCH_SAMPLES, DST_PITCH_SAMPLES,
+      fromAtlas, prev, cur, firstRow, lastRow);
+  else if (fromMap)
+    tilePackedRows<T, SPP, IS_YUYV, PICK_MAP>(
+      srcp, shtp, dstp,
+      SRC_PITCH_SAMPLES, SHT_PITCH_SAMPLES, DST_PITCH_SAMPLES,
+      fromAtlas, prev, cur, firstRow, lastRow);
+  else if (mode > 0)
+    tilePackedRows<T, SPP, IS_YUYV, PICK_SAMPLE>(
+      srcp, shtp, dstp,
+      SRC_PITCH_SAMPLES, SHT_PITCH_SAMPLES, DST_PITCH_SAMPLES,
+      fromAtlas, prev, cur, firstRow, lastRow);
+  else
+    tilePackedRows<T, SPP, IS_YUYV, PICK_AVERAGE>(
+      srcp, shtp, dstp,
+      SRC_PITCH_SAMPLES, SHT_PITCH_SAMPLES, DST_PITCH_SAMPLES,
+      fromAtlas, prev, cur, firstRow, lastRow);
+
+}
+
+
+
+template<typename T, int SPP, bool IS_YUYV, int PICK>
+void TurnsTile::tilePackedRows(
+  const unsigned char* srcp,
+  const unsigned char* shtp,
+  unsigned char* dstp,
+  const int SRC_PITCH_SAMPLES,
+  const int SHT_PITCH_SAMPLES,
+  const int DST_PITCH_SAMPLES,
+  bool fromAtlas, const Rendered* prev, Rendered* cur,
+  int firstRow, int lastRow) const
+{
+
+  // YUY2 is the only packed format with two luma samples to a macropixel.
+  const int LUMA_W = IS_YUYV ? 2 : 1;
+
+  const int SAMPLE_BYTES = sizeof(T),
+            SAMPLE_BITS = 8 * SAMPLE_BYTES,
+            PIXEL_BYTES = SPP * SAMPLE_BYTES;
+
+  const int TILE_BYTES = tileW * PIXEL_BYTES,
+            CTR_OFS = (tileCtrW_Y * PIXEL_BYTES) +
+                      (tileCtrH_Y * SRC_PITCH_SAMPLES),
+            SAMPLE_OFS = (mode - 1) * SAMPLE_BYTES;
+
+  const int* LUT = &lut[0];
+
+  const TileCopyKernel COPY = copyKernel(TILE_BYTES);
+  const TileLineKernel COPY_LINE = copyLineKernel(TILE_BYTES);
+  const TileFillKernel FILL =
+    fillKernel<(SPP == 3 ? 3 : 4) * sizeof(T)>(TILE_BYTES);
+
+  // Tiles in the atlas are all the same size, one after the other, and
+  // already in order, RGB's upside down rows included. The index output can
+  // be thought of the same way, only with tiles a single sample in size, so
+  // its offsets are just the tile indices themselves.
+  const bool IN_ORDER = fromAtlas || indexOut;
+  const int ORDER_STRIDE = indexOut ? 1 : TILE_BYTES * tileH;
+
+  // Everything that goes into a row of tiles is worked out before any of it
+  // is written, either where in the tilesheet each tile comes from, or the
+  // value it's filled with, so the row can go out in whichever order suits.
+  std::vector<int> offsets(srcCols);
+  std::vector<unsigned int> fillVals(SAMPLE_BYTES == 1 ? srcCols : 0);
+  std::vector<uint64_t> wideFillVals(SAMPLE_BYTES == 1 ? 0 : srcCols);
+  std::vector<unsigned char> line(stream ? TILE_BYTES * srcCols : 0);
+
+  // An index map has just one sample for each tile, so there are no tile
+  // centers to find in it, and stepping through it a whole tile at a time
+  // would run far past the end of the frame.
+  const int CTR_STEP = PICK == PICK_MAP ? 0 : TILE_BYTES;
+
+  for (int row = firstRow; row < lastRow; ++row) {
+
+    const unsigned char* tileCtr =
+      PICK == PICK_MAP ? srcp :
+                         srcp + SRC_PITCH_SAMPLES * row * tileH + CTR_OFS;
+
+    unsigned char* dstRow = dstp + DST_PITCH_SAMPLES * row * tileH;
+
+    // Index maps go top to bottom, so RGB's rows of tiles meet theirs in
+    // reverse.
+    const int MAP_ROW = IS_YUYV ? row : srcRows - 1 - row;
+
+    for (int col = 0; col < srcCols; ++col, tileCtr += CTR_STEP) {
+
+      if (PICK != PICK_NONE) {
+
+        int tileIdx;
+        if (PICK == PICK_MAP) {
+
+          tileIdx = LUT[readIndex(srcp + SRC_PITCH_SAMPLES * MAP_ROW, col)];
+
+        } else if (PICK == PICK_SAMPLE) {
+
+          tileIdx = LUT[levelOf<T>(tileCtr + SAMPLE_OFS, false)];
+
+        } else {
+
+          // The hardcoded three assumes the only packed formats that might come
+          // this way are RGB, in any of its sample sizes, and YUY2, which is
+          // true of Avisynth.
+          int sum = 0;
+          for (int i = 0; i < 3; i += LUMA_W)
+            sum += levelOf<T>(tileCtr + i * SAMPLE_BYTES, false);
+          tileIdx = LUT[sum / ((3 + LUMA_W - 1) / LUMA_W)];
+
+        }
+
+        if (IN_ORDER) {
+          offsets[col] = tileIdx * ORDER_STRIDE;
+          continue;
+        }
+
+        // If I didn't have to worry about the difference in layout between RGB
+        // and YUV, I would skip declaring tileIdxY and just jump right to
+        // cropTop, making it SHT_PITCH_SAMPLES * (tileIdx / shtCols) * tileH.
+        // Since RGB is "upside down" in memory, however, the desire for
+        // consistent tile numbering demands that I create this new variable and
+        // then do the subtraction; as a result, the top left tile is number 0
+        // regardless of input colorspace.
+        int tileIdxY = tileIdx / shtCols;
+
+        if (!IS_YUYV)
+          tileIdxY = shtRows - 1 - tileIdxY;
+
+        // Modulo here has the effect of "wrapping around" the horizontal tile
+        // count for the sheet you've provided.
+        int cropLeft = (tileIdx % shtCols) * TILE_BYTES,
+            cropTop = SHT_PITCH_SAMPLES * tileIdxY * tileH;
+
+        offsets[col] = cropTop + cropLeft;
+
+      } else {
+
+        // RGB24 has no alpha, and its tile center may well be the last pixel
+        // on the line, so there's no fourth sample to read.
+        uint64_t
+          by = LUT[levelOf<T>(tileCtr, false)],
+          gu = LUT[levelOf<T>(tileCtr + SAMPLE_BYTES, false)],
+          ry = LUT[levelOf<T>(tileCtr + SAMPLE_BYTES * 2, false)],
+          av = SPP == 3 ? 0 :
+                 LUT[levelOf<T>(tileCtr + SAMPLE_BYTES * 3, false)];
+
+        const uint64_t FILL_VAL = (av << (3 * SAMPLE_BITS)) |
+                                  ((IS_YUYV ? by : ry) << (2 * SAMPLE_BITS)) |
+                                  (gu << SAMPLE_BITS) | by;
+
+        if (SAMPLE_BYTES == 1)
+          fillVals[col] = static_cast<unsigned int>(FILL_VAL);
+        else
+          wideFillVals[col] = FILL_VAL;
+
+      }
+
+    }
+
+    const int KEYS_OFS = srcCols * row;
+
+    if (PICK != PICK_NONE && indexOut)
+      writeIndexRow(dstp + DST_PITCH_SAMPLES * MAP_ROW, &offsets[0]);
+    else if (PICK != PICK_NONE)
+      copyTileRow(
+        COPY, COPY_LINE, byRow,
+        dstRow, DST_PITCH_SAMPLES, shtp, SHT_PITCH_SAMPLES,
+        &offsets[0], prev ? &prev->y[KEYS_OFS] : 0,
+        cur ? &cur->y[KEYS_OFS] : 0, srcCols, TILE_BYTES, tileH);
+    else if (SAMPLE_BYTES == 1)
+      fillTileRow(
+        FILL, byRow,
+        dstRow, DST_PITCH_SAMPLES, stream ? &line[0] : 0,
+        &fillVals[0], prev ? &prev->y[KEYS_OFS] : 0,
+        cur ? &cur->y[KEYS_OFS] : 0, srcCols, TILE_BYTES, tileH);
+    else
+      fillTileRow(
+        FILL, byRow,
+        dstRow, DST_PITCH_SAMPLES, stream ? &line[0] : 0,
+        &wideFillVals[0], prev ? &prev->wide[KEYS_OFS] : 0,
+        cur ? &cur->wide[KEYS_OFS] : 0, srcCols, TILE_BYTES, tileH);
+
+  }
+
+  // Streamed stores aren't guaranteed to be visible to anyone else until
+  // they've been fenced, and whoever reads this band next may well be on
+  // another core.
+#ifdef TURNSTILE_SSE2
+  if (stream)
+    _mm_sfence();
+#endif
+
+}
+
+
+
+void TurnsTile::processFramePlanar(
+  const unsigned char* srcY,
+  const unsigned char* srcU,
+  const unsigned char* srcV,
+  const unsigned char* shtY,
+  const unsigned char* shtU,
+  const unsigned char* shtV,
+  unsigned char* dstY,
+  unsigned char* dstU,
+  unsigned char* dstV,
+  const int SRC_PITCH_SAMPLES_Y, const int SRC_PITCH_SAMPLES_U,
+  const int SHT_PITCH_SAMPLES_Y, const int SHT_PITCH_SAMPLES_U,
+  const int DST_PITCH_SAMPLES_Y, const int DST_PITCH_SAMPLES_U,
+  bool fromAtlas, const Rendered* prev, Rendered* cur,
+  int firstRow, int lastRow)
+{
+
+  // Planar formats come in every sample size Avisynth has, and each gets its
+  // own set of kernels.
+  if (bytesPerSample == 4)
+    tilePlanarLayout<float>(
+      srcY, srcU, srcV, shtY, shtU, shtV, dstY, dstU, dstV,
+      SRC_PITCH_SAMPLES_Y, SRC_PITCH_SAMPLES_U,
+      SHT_PITCH_SAMPLES_Y, SHT_PITCH_SAMPLES_U,
+      DST_PITCH_SAMPLES_Y, DST_PITCH_SAMPLES_U,
+      fromAtlas, prev, cur, firstRow, lastRow);
+  else if (bytesPerSample == 2)
+    tilePlanarLayout<uint16_t>(
+      srcY, srcU, srcV, shtY, shtU, shtV, dstY, dstU, dstV,
+      SRC_PITCH_SAMPLES_Y, SRC_PITCH_SAMPLES_U,
+      SHT_PITCH_SAMPLES_Y, SHT_PITCH_SAMPLES_U,
+      DST_PITCH_SAMPLES_Y, DST_PITCH_SAMPLES_U,
+      fromAtlas, prev, cur, firstRow, lastRow);
+  else
+    tilePlanarLayout<unsigned char>(
+      srcY, srcU, srcV, shtY, shtU, shtV, dstY, dstU, dstV,
+      SRC_PITCH_SAMPLES_Y, SRC_PITCH_SAMPLES_U,
+      SHT_PITCH_SAMPLES_Y, SHT_PITCH_SAMPLES_U,
+      DST_PITCH_SAMPLES_Y, DST_PITCH_SAMPLES_U,
+      fromAtlas, prev, cur, firstRow, lastRow);
+
+}
+
+
+
+template<typename T>
+void TurnsTile::tilePlanarLayout(
+  const unsigned char* srcY,
+  const unsigned char* srcU,
+  const unsigned char* srcV,
+  const unsigned char* shtY,
+  const unsigned char* shtU,
+  const unsigned char* shtV,
+  unsigned char* dstY,
+  unsigned char* dstU,
+  unsigned char* dstV,
+  const int SRC_PITCH_SAMPLES_Y, const int SRC_PITCH_SAMPLES_U,
+  const int SHT_PITCH_SAMPLES_Y, const int SHT_PITCH_SAMPLES_U,
+  const int DST_PITCH_SAMPLES_Y, const int DST_PITCH_SAMPLES_U,
+  bool fromAtlas, const Rendered* prev, Rendered* cur,
+  int firstRow, int lastRow) const
+{
+
+  // As with the packed formats, every planar format gets its own kernel, this
+  // time with its chroma subsampling fixed at compile time. Y8 has no chroma
+  // planes at all, and gets a kernel that never goes near U and V. Planar RGB
+  // is laid out just like YV24, green in place of Y, blue of U, and red of V.
+  if (!tileW_U)
+    tilePlanar<T, 1, 1, false>(
+      srcY, srcU, srcV, shtY, shtU, shtV, dstY, dstU, dstV,
+      SRC_PITCH_SAMPLES_Y, SRC_PITCH_SAMPLES_U,
+      SHT_PITCH_SAMPLES_Y, SHT_PITCH_SAMPLES_U,
+      DST_PITCH_SAMPLES_Y, DST_PITCH_SAMPLES_U,
+      fromAtlas, prev, cur, firstRow, lastRow);
+  else if (lumaW == 1 && lumaH == 1)
+    tilePlanar<T, 1, 1, true>(
+      srcY, srcU, srcV, shtY, shtU, shtV, dstY, dstU, dstV,
+      SRC_PITCH_SAMPLES_Y, SRC_PITCH_SAMPLES_U,
+      SHT_PITCH_SAMPLES_Y, SHT_PITCH_SAMPLES_U,
+      DST_PITCH_SAMPLES_Y, DST_PITCH_SAMPLES_U,
+      fromAtlas, prev, cur, firstRow, lastRow);
+  else if (lumaW == 2 && lumaH == 1)
+    tilePlanar<T, 2, 1, true>(
+      srcY, srcU, srcV, shtY, shtU, shtV, dstY, dstU, dstV,
+      SRC_PITCH_SAMPLES_Y, SRC_PITCH_SAMPLES_U,
+      SHT_PITCH_SAMPLES_Y, SHT_PITCH_SAMPLES_U,
+      DST_PITCH_SAMPLES_Y, DST_PITCH_SAMPLES_U,
+      fromAtlas, prev, cur, firstRow, lastRow);
+  else if (lumaW == 2 && lumaH == 2)
+    tilePlanar<T, 2, 2, true>(
+      srcY, srcU, srcV, shtY, shtU, shtV, dstY, dstU, dstV,
+      SRC_PITCH_SAMPLES_Y, SRC_PITCH_SAMPLES_U,
+      SHT_PITCH_SAMPLES_Y, SHT_PITCH_SAMPLES_U,
+      DST_PITCH_SAMPLES_Y, DST_PITCH_SAMPLES_U,
+      fromAtlas, prev, cur, firstRow, lastRow);
+  else
+    tilePlanar<T, 4, 1, true>(
+      srcY, srcU, srcV, shtY, shtU, shtV, dstY, dstU, dstV,
+      SRC_PITCH_SAMPLES_Y, SRC_PITCH_SAMPLES_U,
+      SHT_PITCH_SAMPLES_Y, SHT_PITCH_SAMPLES_U,
+      DST_PITCH_SAMPLES_Y, DST_PITCH_SAMPLES_U,
+      fromAtlas, prev, cur, firstRow, lastRow);
+
+}
+
+
+
+template<typename T, int LUMA_W, int LUMA_H, bool HAS_CHROMA>
+void TurnsTile::tilePlanar(
+  const unsigned char* srcY,
+  const unsigned char* srcU,
+  const unsigned char* srcV,
+  const unsigned char* shtY,
+  const unsigned char* shtU,
+  const unsigned char* shtV,
+  unsigned char* dstY,
+  unsigned char* dstU,
+  unsigned char* dstV,
+  const int SRC_PITCH_SAMPLES_Y, const int SRC_PITCH_SAMPLES_U,
+  const int SHT_PITCH_SAMPLES_Y, const int SHT_PITCH_SAMPLES_U,
+  const int DST_PITCH_SAMPLES_Y, const int DST_PITCH_SAMPLES_U,
+  bool fromAtlas, const Rendered* prev, Rendered* cur,
+  int firstRow, int lastRow) const
+{
+
+  // Planar RGB numbers its modes the same as packed RGB, blue, green, then
+  // red, so blue comes before the single 'luma' sample rather than after it.
+  const int MODE_U = planarRGB ? 1 : LUMA_W * LUMA_H + 1,
+            MODE_V = LUMA_W * LUMA_H + 2;
+
+  if (!tilesheet)
+    tilePlanarRows<T, LUMA_W, LUMA_H, HAS_CHROMA, PICK_NONE>(
+      srcY, srcU, srcV, shtY, shtU, shtV, dstY, dstU, dstV,
+      SRC_PITCH_SAMPLES_Y, SRC_PITCH_SAMPLES_U,
+      SHT_PITCH_SAMPLES_Y, SHT_PITCH_SAMPLES_U,
+      DST_PITCH_SAMPLES_Y, DST_PITCH_SAMPLES_U,
+      fromAtlas, prev, cur, firstRow, lastRow);
+  else if (fromMap)
+    tilePlanarRows<T, LUMA_W, LUMA_H, HAS_CHROMA, PICK_MAP>(
+      srcY, srcU, srcV, shtY, shtU, shtV, dstY, dstU, dstV,
+      SRC_PITCH_SAMPLES_Y, SRC_PITCH_SAMPLES_U,
+      SHT_PITCH_SAMPLES_Y, SHT_PITCH_SAMPLES_U,
+      DST_PITCH_SAMPLES_Y, DST_PITCH_SAMPLES_U,
+      fromAtlas, prev, cur, firstRow, lastRow);
+  else if (HAS_CHROMA && mode == MODE_V)
+    tilePlanarRows<T, LUMA_W, LUMA_H, HAS_CHROMA, PICK_V>(
+      srcY, srcU, srcV, shtY, shtU, shtV, dstY, dstU, dstV,
+      SRC_PITCH_SAMPLES_Y, SRC_PITCH_SAMPLES_U,
+      SHT_PITCH_SAMPLES_Y, SHT_PITCH_SAMPLES_U,
+      DST_PITCH_SAMPLES_Y, DST_PITCH_SAMPLES_U,
+      fromAtlas, prev, cur, firstRow, lastRow);
+  else if (HAS_CHROMA && mode == MODE_U)
+    tilePlanarRows<T, LUMA_W, LUMA_H, HAS_CHROMA, PICK_U>(
+      srcY, srcU, srcV, shtY, shtU, shtV, dstY, dstU, dstV,
+      SRC_PITCH_SAMPLES_Y, SRC_PITCH_SAMPLES_U,
+      SHT_PITCH_SAMPLES_Y, SHT_PITCH_SAMPLES_U,
+      DST_PITCH_SAMPLES_Y, DST_PITCH_SAMPLES_U,
+      fromAtlas, prev, cur, firstRow, lastRow);
+  else if (mode > 0)
+    tilePlanarRows<T, LUMA_W, LUMA_H, HAS_CHROMA, PICK_SAMPLE>(
+      srcY, srcU, srcV, shtY, shtU, shtV, dstY, dstU, dstV,
+      SRC_PITCH_SAMPLES_Y, SRC_PITCH_SAMPLES_U,
+      SHT_PITCH_SAMPLES_Y, SHT_PITCH_SAMPLES_U,
+      DST_PITCH_SAMPLES_Y, DST_PITCH_SAMPLES_U,
+      fromAtlas, prev, cur, firstRow, lastRow);
+  else
+    tilePlanarRows<T, LUMA_W, LUMA_H, HAS_CHROMA, PICK_AVERAGE>(
+      srcY, srcU, srcV, shtY, shtU, shtV, dstY, dstU, dstV,
+      SRC_PITCH_SAMPLES_Y, SRC_PITCH_SAMPLES_U,
+      SHT_PITCH_SAMPLES_Y, SHT_PITCH_SAMPLES_U,
+      DST_PITCH_SAMPLES_Y, DST_PITCH_SAMPLES_U,
+      fromAtlas, prev, cur, firstRow, lastRow);
+
+}
+
+
+
+template<typename T, int LUMA_W, int LUMA_H, bool HAS_CHROMA, int PICK>
+void TurnsTile::tilePlanarRows(
+  const unsigned char* srcY,
+  const unsigned char* srcU,
+  const unsigned char* srcV,
+  const unsigned char* shtY,
+  const unsigned char* shtU,
+  const unsigned char* shtV,
+  unsigned char* dstY,
+  unsigned char* dstU,
+  unsigned char* dstV,
+  const int SRC_PITCH_SAMPLES_Y, const int SRC_PITCH_SAMPLES_U,
+  const int SHT_PITCH_SAMPLES_Y, const int SHT_PITCH_SAMPLES_U,
+  const int DST_PITCH_SAMPLES_Y, const int DST_PITCH_SAMPLES_U,
+  bool fromAtlas, const Rendered* prev, Rendered* cur,
+  int firstRow, int lastRow) const
+{
+
+  const int SAMPLE_BYTES = sizeof(T),
+            TILE_W_U = tileW / LUMA_W,
+            TILE_H_U = tileH / LUMA_H,
+            TILE_BYTES_Y = tileW * SAMPLE_BYTES,
+            TILE_BYTES_U = TILE_W_U * SAMPLE_BYTES,
+            CTR_OFS_Y = (tileCtrW_Y * SAMPLE_BYTES) +
+                        (tileCtrH_Y * SRC_PITCH_SAMPLES_Y),
+            CTR_OFS_U = (tileCtrW_U * SAMPLE_BYTES) +
+                        (tileCtrH_U * SRC_PITCH_SAMPLES_U);
+
+  // This works assuming the luma samples in a macropixel are treated as being
+  // numbered from zero, left to right, top to bottom.
+  const int LUMA_MODE_OFS = ((mode % LUMA_H) * SRC_PITCH_SAMPLES_Y) +
+                            ((mode - 1) % LUMA_W) * SAMPLE_BYTES;
+
+  // Only YUV chroma is centered on zero; planar RGB's blue and red are just
+  // like its green.
+  const bool CENTERED = !planarRGB;
+
+  const int* LUT = &lut[0];
+
+  const TileCopyKernel COPY_Y = copyKernel(TILE_BYTES_Y),
+                       COPY_U = copyKernel(TILE_BYTES_U);
+  const TileLineKernel COPY_LINE_Y = copyLineKernel(TILE_BYTES_Y),
+                       COPY_LINE_U = copyLineKernel(TILE_BYTES_U);
+  const TileFillKernel FILL_Y = fillKernel<sizeof(T)>(TILE_BYTES_Y),
+                       FILL_U = fillKernel<sizeof(T)>(TILE_BYTES_U);
+
+  const bool IN_ORDER = fromAtlas || indexOut;
+  const int ORDER_STRIDE_Y = indexOut ? 1 : TILE_BYTES_Y * tileH,
+            ORDER_STRIDE_U = TILE_BYTES_U * TILE_H_U;
+
+  // U and V tiles always come from the same place in their planes, so they
+  // can share their offsets, and their lines are streamed out one after the
+  // other, so they can share a buffer, but not their values.
+  std::vector<int> offsetsY(srcCols), offsetsU(srcCols);
+  std::vector<unsigned int> fillY(srcCols), fillU(srcCols), fillV(srcCols);
+  std::vector<unsigned char> lineY(stream ? TILE_BYTES_Y * srcCols : 0),
+                             lineU(stream ? TILE_BYTES_U * srcCols : 0);
+
+  // Index maps have no tile centers to step through, as in tilePackedRows.
+  const bool MAP = PICK == PICK_MAP;
+  const int CTR_STEP_Y = MAP ? 0 : TILE_BYTES_Y,
+            CTR_STEP_U = MAP ? 0 : TILE_BYTES_U;
+
+  for (int row = firstRow; row < lastRow; ++row) {
+
+    const unsigned char
+      * tileCtrY = MAP ? srcY :
+                   srcY + SRC_PITCH_SAMPLES_Y * row * tileH + CTR_OFS_Y,
+      * tileCtrU = MAP ? srcU :
+                   srcU + SRC_PITCH_SAMPLES_U * row * TILE_H_U + CTR_OFS_U,
+      * tileCtrV = MAP ? srcV :
+                   srcV + SRC_PITCH_SAMPLES_U * row * TILE_H_U + CTR_OFS_U;
+
+    unsigned char
+      * dstRowY = dstY + DST_PITCH_SAMPLES_Y * row * tileH,
+      * dstRowU = dstU + DST_PITCH_SAMPLES_U * row * TILE_H_U,
+      * dstRowV = dstV + DST_PITCH_SAMPLES_U * row * TILE_H_U;
+
+    for (int col = 0; col < srcCols; ++col, tileCtrY += CTR_STEP_Y,
+         tileCtrU += CTR_STEP_U, tileCtrV += CTR_STEP_U) {
+
+      if (PICK != PICK_NONE) {
+
+        int tileIdx;
+        if (PICK == PICK_MAP) {
+
+          tileIdx = LUT[readIndex(srcY + SRC_PITCH_SAMPLES_Y * row, col)];
+
+        } else if (PICK == PICK_V) {
+
+          tileIdx = LUT[levelOf<T>(tileCtrV, CENTERED)];
+
+        } else if (PICK == PICK_U) {
+
+          tileIdx = LUT[levelOf<T>(tileCtrU, CENTERED)];
+
+        } else if (PICK == PICK_SAMPLE) {
+
+          tileIdx = LUT[levelOf<T>(tileCtrY + LUMA_MODE_OFS, false)];
+
+        } else if (LUMA_W * LUMA_H == 1 && HAS_CHROMA) {
+
+          // With only one luma sample to a macropixel there's nothing to
+          // average, and mode 0 is never asked for in YUV, but planar RGB
+          // averages its three planes, just as packed RGB does.
+          tileIdx = LUT[(levelOf<T>(tileCtrY, false) +
+                         levelOf<T>(tileCtrU, false) +
+                         levelOf<T>(tileCtrV, false)) / 3];
+
+        } else {
+
+          int sum = 0;
+          for (int i = 0; i < LUMA_H; ++i)
+            for (int j = 0; j < LUMA_W; ++j)
+              sum += levelOf<T>(
+                tileCtrY + (SRC_PITCH_SAMPLES_Y * i) + (SAMPLE_BYTES * j),
+                false);
+          tileIdx = LUT[sum / (LUMA_W * LUMA_H)];
+
+        }
+
+        if (IN_ORDER) {
+          offsetsY[col] = tileIdx * ORDER_STRIDE_Y;
+          offsetsU[col] = tileIdx * ORDER_STRIDE_U;
+          continue;
+        }
+
+        int cropLeftY = (tileIdx % shtCols) * TILE_BYTES_Y,
+            cropLeftU = (tileIdx % shtCols) * TILE_BYTES_U,
+            cropTopY = (tileIdx / shtCols) * SHT_PITCH_SAMPLES_Y * tileH,
+            cropTopU = (tileIdx / shtCols) * SHT_PITCH_SAMPLES_U * TILE_H_U;
+
+        offsetsY[col] = cropLeftY + cropTopY;
+        offsetsU[col] = cropLeftU + cropTopU;
+
+      } else {
+
+        fillY[col] = sampleBits<T>(LUT[levelOf<T>(tileCtrY, false)], false);
+
+        if (HAS_CHROMA) {
+          fillU[col] = sampleBits<T>(
+            LUT[levelOf<T>(tileCtrU, CENTERED)], CENTERED);
+          fillV[col] = sampleBits<T>(
+            LUT[levelOf<T>(tileCtrV, CENTERED)], CENTERED);
+        }
+
+      }
+
+    }
+
+    // U and V tiles share their offsets, and so their keys, when they're
+    // copied from a tilesheet, but solid ones each have their own.
+    const int KEYS_OFS = srcCols * row;
+
+    const unsigned int
+      * prevY = prev ? &prev->y[KEYS_OFS] : 0,
+      * prevU = prev && HAS_CHROMA ? &prev->u[KEYS_OFS] : 0,
+      * prevV = prev && HAS_CHROMA ? &prev->v[KEYS_OFS] : 0;
+
+    unsigned int
+      * keysY = cur ? &cur->y[KEYS_OFS] : 0,
+      * keysU = cur && HAS_CHROMA ? &cur->u[KEYS_OFS] : 0,
+      * keysV = cur && HAS_CHROMA ? &cur->v[KEYS_OFS] : 0;
+
+    if (PICK != PICK_NONE && indexOut) {
+
+      writeIndexRow(dstY + DST_PITCH_SAMPLES_Y * row, &offsetsY[0]);
+
+    } else if (PICK != PICK_NONE) {
+
+      copyTileRow(
+        COPY_Y, COPY_LINE_Y, byRow,
+        dstRowY, DST_PITCH_SAMPLES_Y, shtY, SHT_PITCH_SAMPLES_Y,
+        &offsetsY[0], prevY, keysY, srcCols, TILE_BYTES_Y, tileH);
+
+      if (HAS_CHROMA) {
+        copyTileRow(
+          COPY_U, COPY_LINE_U, byRow,
+          dstRowU, DST_PITCH_SAMPLES_U, shtU, SHT_PITCH_SAMPLES_U,
+          &offsetsU[0], prevU, keysU, srcCols, TILE_BYTES_U, TILE_H_U);
+        copyTileRow(
+          COPY_U, COPY_LINE_U, byRow,
+          dstRowV, DST_PITCH_SAMPLES_U, shtV, SHT_PITCH_SAMPLES_U,
+          &offsetsU[0], prevU, 0, srcCols, TILE_BYTES_U, TILE_H_U);
+      }
+
+    } else {
+
+      fillTileRow(
+        FILL_Y, byRow,
+        dstRowY, DST_PITCH_SAMPLES_Y, stream ? &lineY[0] : 0,
+        &fillY[0], prevY, keysY, srcCols, TILE_BYTES_Y, tileH);
+
+      if (HAS_CHROMA) {
+        fillTileRow(
+          FILL_U, byRow,
+          dstRowU, DST_PITCH_SAMPLES_U, stream ? &lineU[0] : 0,
+          &fillU[0], prevU, keysU, srcCols, TILE_BYTES_U, TILE_H_U);
+        fillTileRow(
+          FILL_U, byRow,
+          dstRowV, DST_PITCH_SAMPLES_U, stream ? &lineU[0] : 0,
+          &fillV[0], prevV, keysV, srcCols, TILE_BYTES_U, TILE_H_U);
+      }
+
+    }
+
+  }
+
+#ifdef TURNSTILE_SSE2
+  if (stream)
+    _mm_sfence();
+#endif
+
+}
+
+
+
+
+int __stdcall TurnsTile::SetCacheHints(int cachehints, int frame_range)
+{
+
+  int hints = 0;
+
+  if (cachehints == CACHE_GETCHILD_ACCESS_COST) {
+    hints = CACHE_ACCESS_RAND;
+  }
+  else if (cachehints == CACHE_GETCHILD_COST) {
+    hints = CACHE_COST_LOW;
+  }
+  else if (cachehints == CACHE_GETCHILD_THREAD_MODE) {
+    hints = CACHE_THREAD_SAFE;
+  }
+  else if (cachehints == CACHE_GET_MTMODE) {
+    hints = MT_NICE_FILTER;
+  }
+
+  return hints;
+
+}
+
+
+
+int TurnsTile::gcf(int a, int b)
+{
+
+  if (b == 0)
+    return a;
+  else
+    return gcf(b, a % b);
+
+}
+
+
+
+int TurnsTile::mod(int num, int mod, int min, int max, int dir)
+{
+
+  double base = static_cast<double>(num) / static_cast<double>(mod);
+
+  int rounded;
+  if (dir == -1)
+    rounded = static_cast<int>(floor(base)) * mod;
+  else if (dir == 1)
+    rounded = static_cast<int>(ceil(base)) * mod;
+  else
+    rounded = static_cast<int>(base + 0.5) * mod;
+
+  if (rounded >= min && rounded <= max)
+    return rounded;
+  else if (rounded < min)
+    return min;
+  else
+    return max;
+
 }
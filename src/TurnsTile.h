@@ -3,6 +3,10 @@
 
 
 
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <vector>
 
 #include "interface.h"
@@ -16,13 +20,94 @@ public:
 
   TurnsTile(  PClip _child, PClip _tilesheet, VideoInfo _vi2,
               int _tileW, int _tileH, int _res, int _mode,
-              const char* _levels, int _loTile, int _hiTile,
-              IScriptEnvironment* env);
+              const char* _levels, int _loTile, int _hiTile, int _threads,
+              const char* _order, bool _stream, bool _indexOut, bool _fromMap,
+              bool _reuse, IScriptEnvironment* env);
 
   ~TurnsTile();
 
   PVideoFrame __stdcall GetFrame(int n, IScriptEnvironment* env);
 
+  int __stdcall SetCacheHints(int cachehints, int frame_range);
+
+  static int gcf(int a, int b);
+
+  static int mod(int num, int mod, int min, int max, int dir);
+
+private:
+
+  PClip tilesheet;
+
+  int tileW, tileH, mode,
+      srcCols, srcRows,
+      shtCols, shtRows,
+      bytesPerSample, spp,
+      lumaW, lumaH, tileW_U, tileH_U,
+      tileCtrW_Y, tileCtrW_U, tileCtrH_Y, tileCtrH_U,
+      threads;
+
+  bool PLANAR, YUYV, BGRA, BGR, planarRGB,
+       byRow, stream, indexOut, fromMap, indexWide, reuse;
+
+  // Frames smaller than this are written with plain stores, even if streaming
+  // is enabled, since they stand a good chance of still being in the cache by
+  // the time the next filter reads them.
+  static const int STREAM_MIN_BYTES = 8 << 20;
+
+  std::vector<int> lut;
+
+  // Every tile of a tilesheet, cut out and stored one after another, each one
+  // with no gaps between its lines, along with the sheet frame it came from.
+  // A sheet that's only been seen once has no tiles yet.
+  struct Atlas
+  {
+    PVideoFrame sheet;
+    std::vector<unsigned char> y, u, v;
+  };
+
+  static const size_t RECENT_ATLASES = 2;
+
+  std::list<std::shared_ptr<const Atlas> > recentAtlases;
+
+  std::mutex atlasLock;
+
+  std::shared_ptr<const Atlas> atlasFor(const PVideoFrame& sht);
+
+  std::shared_ptr<const Atlas> buildAtlas(const PVideoFrame& sht) const;
+
+  void sliceSheet(
+    const unsigned char* shtp, const int SHT_PITCH_SAMPLES,
+    const int TILE_BYTES, const int TILE_H, const bool FLIP,
+    std::vector<unsigned char>* out) const;
+
+  static bool sameSheet(
+    const PVideoFrame& a, const PVideoFrame& b, bool hasChroma);
+
+  // The last frame rendered, along with a key for every tile in it, and the
+  // atlas, if any, its tiles came from. The keys are in tile order, one set
+  // for each plane, except that U and V share theirs when tiles are copied.
+  // Solid RGB48 and RGB64 tiles are the only ones whose values don't fit in
+  // a 32-bit key, and keep theirs in wide instead.
+  struct Rendered
+  {
+    int n;
+    PVideoFrame frame;
+    std::shared_ptr<const Atlas> atlas;
+    std::vector<unsigned int> y, u, v;
+    std::vector<uint64_t> wide;
+  };
+
+  std::unique_ptr<Rendered> lastRendered, spareRendered;
+
+  std::mutex renderedLock;
+
+  void takeRendered(
+    int n, const std::shared_ptr<const Atlas>& atlas,
+    std::unique_ptr<Rendered>* prev, std::unique_ptr<Rendered>* cur);
+
+  void keepRendered(
+    std::unique_ptr<Rendered> prev, std::unique_ptr<Rendered> cur);
+
   void processFramePacked(
     const unsigned char* srcp,
     const unsigned char* shtp,
@@ -30,7 +115,8 @@ public:
     const int SRC_PITCH_SAMPLES,
     const int SHT_PITCH_SAMPLES,
     const int DST_PITCH_SAMPLES,
-    IScriptEnvironment* env);
+    bool fromAtlas, const Rendered* prev, Rendered* cur,
+    int firstRow, int lastRow);
 
   void processFramePlanar(
     const unsigned char* srcY,
@@ -45,35 +131,98 @@ public:
     const int SRC_PITCH_SAMPLES_Y, const int SRC_PITCH_SAMPLES_U,
     const int SHT_PITCH_SAMPLES_Y, const int SHT_PITCH_SAMPLES_U,
     const int DST_PITCH_SAMPLES_Y, const int DST_PITCH_SAMPLES_U,
-    IScriptEnvironment* env);
-
-  int __stdcall SetCacheHints(int cachehints, int frame_range);
-
-  static int gcf(int a, int b);
-
-  static int mod(int num, int mod, int min, int max, int dir);
-
-private:
-
-  PClip tilesheet;
+    bool fromAtlas, const Rendered* prev, Rendered* cur,
+    int firstRow, int lastRow);
+
+  // Index maps hold one Y8 sample per tile, or Y16 once there are more tiles
+  // in the sheet than a byte can count.
+  int readIndex(const unsigned char* row, int col) const
+  {
+    if (indexWide)
+      return reinterpret_cast<const uint16_t*>(row)[col];
+    else
+      return row[col];
+  }
+
+  void writeIndexRow(unsigned char* dstp, const int* indices) const;
+
+  // How each tile picks its index into the tilesheet: not at all, when there
+  // is no tilesheet, from the average luma, a single sample, or U or V, or
+  // straight from an index map.
+  enum { PICK_NONE, PICK_AVERAGE, PICK_SAMPLE, PICK_U, PICK_V, PICK_MAP };
+
+  template<typename T, int SPP, bool IS_YUYV>
+  void tilePacked(
+    const unsigned char* srcp,
+    const unsigned char* shtp,
+    unsigned char* dstp,
+    const int SRC_PITCH_SAMPLES,
+    const int SHT_PITCH_SAMPLES,
+    const int DST_PITCH_SAMPLES,
+    bool fromAtlas, const Rendered* prev, Rendered* cur,
+    int firstRow, int lastRow) const;
 
-  int tileW, tileH, mode,
-      srcCols, srcRows,
-      shtCols, shtRows,
-      bytesPerSample, spp,
-      lumaW, lumaH, tileW_U, tileH_U,
-      tileCtrW_Y, tileCtrW_U, tileCtrH_Y, tileCtrH_U;
+  template<typename T, int SPP, bool IS_YUYV, int PICK>
+  void tilePackedRows(
+    const unsigned char* srcp,
+    const unsigned char* shtp,
+    unsigned char* dstp,
+    const int SRC_PITCH_SAMPLES,
+    const int SHT_PITCH_SAMPLES,
+    const int DST_PITCH_SAMPLES,
+    bool fromAtlas, const Rendered* prev, Rendered* cur,
+    int firstRow, int lastRow) const;
 
-  bool PLANAR, YUYV, BGRA, BGR;
+  template<typename T>
+  void tilePlanarLayout(
+    const unsigned char* srcY,
+    const unsigned char* srcU,
+    const unsigned char* srcV,
+    const unsigned char* shtY,
+    const unsigned char* shtU,
+    const unsigned char* shtV,
+    unsigned char* dstY,
+    unsigned char* dstU,
+    unsigned char* dstV,
+    const int SRC_PITCH_SAMPLES_Y, const int SRC_PITCH_SAMPLES_U,
+    const int SHT_PITCH_SAMPLES_Y, const int SHT_PITCH_SAMPLES_U,
+    const int DST_PITCH_SAMPLES_Y, const int DST_PITCH_SAMPLES_U,
+    bool fromAtlas, const Rendered* prev, Rendered* cur,
+    int firstRow, int lastRow) const;
 
-  std::vector<int> lut;
+  template<typename T, int LUMA_W, int LUMA_H, bool HAS_CHROMA>
+  void tilePlanar(
+    const unsigned char* srcY,
+    const unsigned char* srcU,
+    const unsigned char* srcV,
+    const unsigned char* shtY,
+    const unsigned char* shtU,
+    const unsigned char* shtV,
+    unsigned char* dstY,
+    unsigned char* dstU,
+    unsigned char* dstV,
+    const int SRC_PITCH_SAMPLES_Y, const int SRC_PITCH_SAMPLES_U,
+    const int SHT_PITCH_SAMPLES_Y, const int SHT_PITCH_SAMPLES_U,
+    const int DST_PITCH_SAMPLES_Y, const int DST_PITCH_SAMPLES_U,
+    bool fromAtlas, const Rendered* prev, Rendered* cur,
+    int firstRow, int lastRow) const;
 
-  template<typename Tsample, typename Tpixel>
-  void fillTile(
-    Tsample* dstp, const int DST_PITCH_SAMPLES,
-    const Tsample* srcp, const int SRC_PITCH_SAMPLES,
-    const int width, const int height, const Tpixel fillVal,
-    IScriptEnvironment* env) const;
+  template<typename T, int LUMA_W, int LUMA_H, bool HAS_CHROMA, int PICK>
+  void tilePlanarRows(
+    const unsigned char* srcY,
+    const unsigned char* srcU,
+    const unsigned char* srcV,
+    const unsigned char* shtY,
+    const unsigned char* shtU,
+    const unsigned char* shtV,
+    unsigned char* dstY,
+    unsigned char* dstU,
+    unsigned char* dstV,
+    const int SRC_PITCH_SAMPLES_Y, const int SRC_PITCH_SAMPLES_U,
+    const int SHT_PITCH_SAMPLES_Y, const int SHT_PITCH_SAMPLES_U,
+    const int DST_PITCH_SAMPLES_Y, const int DST_PITCH_SAMPLES_U,
+    bool fromAtlas, const Rendered* prev, Rendered* cur,
+    int firstRow, int lastRow) const;
 
 };
 
@@ -12,7 +12,8 @@
 
 
 TurnsTileTestSource::TurnsTileTestSource(
-  std::string filename, std::string pixel_type, IScriptEnvironment* env)
+  std::string filename, std::string pixel_type, int bits,
+  IScriptEnvironment* env)
 {
 
   std::vector<unsigned char> raw;
@@ -24,11 +25,18 @@ TurnsTileTestSource::TurnsTileTestSource(
   vi.fps_numerator = 24;
   vi.num_frames = 240;
 
+  bool planarRgb = pixel_type == "RGBP";
+  if (planarRgb && type != FILETYPE_PNG)
+    env->ThrowError("TurnsTileTestSource: Only PNGs can be loaded as RGBP!");
+
   if (type == FILETYPE_PNG)
     DecodePng(raw, pixel_type, env);
   else
     DecodeBmp(raw, env);
 
+  if (planarRgb || bits != 8)
+    Widen(planarRgb, bits, env);
+
 }
 
 
@@ -211,6 +219,92 @@ void TurnsTileTestSource::DecodePng(std::vector<unsigned char>& raw, std::string
 
 
 
+// Avisynth's own ConvertBits has rounded and scaled differently from one
+// version to the next, so high bit depth reference hashes are taken from
+// frames I widen here by fixed rules instead. YUV samples are shifted left,
+// as limited range video is, and RGB samples repeat their high bits so that
+// 255 stays at full scale. Float luma and RGB run from 0 to 1, and float
+// chroma is centered on 0, with 8 bit 128 landing there.
+void TurnsTileTestSource::Widen(
+  bool planarRgb, int bits, IScriptEnvironment* env)
+{
+
+  int sampleBits = 0;
+  switch (bits) {
+    case 8: sampleBits = VideoInfo::CS_Sample_Bits_8; break;
+    case 10: sampleBits = VideoInfo::CS_Sample_Bits_10; break;
+    case 12: sampleBits = VideoInfo::CS_Sample_Bits_12; break;
+    case 14: sampleBits = VideoInfo::CS_Sample_Bits_14; break;
+    case 16: sampleBits = VideoInfo::CS_Sample_Bits_16; break;
+    case 32: sampleBits = VideoInfo::CS_Sample_Bits_32; break;
+    default:
+      env->ThrowError("TurnsTileTestSource: Cannot load %d bit samples!", bits);
+  }
+
+  if (vi.IsYUY2() && bits != 8)
+    env->ThrowError("TurnsTileTestSource: YUY2 can only be 8 bit!");
+  if (vi.IsRGB() && !planarRgb && bits != 8 && bits != 16)
+    env->ThrowError(
+      "TurnsTileTestSource: Packed RGB can only be 8 or 16 bit!");
+
+  const VideoInfo SRC_VI = vi;
+  const PVideoFrame SRC = frm;
+
+  int base = planarRgb ? VideoInfo::CS_RGBP : vi.pixel_type;
+  vi.pixel_type = (base & ~VideoInfo::CS_Sample_Bits_Mask) | sampleBits;
+
+  frm = env->NewVideoFrame(vi);
+
+  // Packed RGB is stored bottom up, but planar RGB isn't, and its planes take
+  // green, blue and red, in that order, out of each BGRA pixel.
+  const bool RGB = vi.IsRGB();
+  const int PLANES_YUV[] = { PLANAR_Y, PLANAR_U, PLANAR_V },
+            PLANES_RGB[] = { PLANAR_G, PLANAR_B, PLANAR_R },
+            OFS_BGRA[] = { 1, 0, 2 },
+            PLANE_COUNT = vi.IsPlanar() && !vi.IsY() ? 3 : 1;
+
+  for (int p = 0; p < PLANE_COUNT; ++p) {
+
+    const int PLANE = RGB && vi.IsPlanar() ? PLANES_RGB[p] : PLANES_YUV[p];
+
+    unsigned char* dst = frm->GetWritePtr(PLANE);
+
+    const int DST_PITCH = frm->GetPitch(PLANE),
+              HEIGHT = frm->GetHeight(PLANE),
+              SAMPLES = frm->GetRowSize(PLANE) / vi.ComponentSize();
+
+    for (int i = 0; i < HEIGHT; ++i) {
+      for (int j = 0; j < SAMPLES; ++j) {
+
+        int v;
+        if (planarRgb)
+          v = SRC->GetReadPtr()[
+            SRC->GetPitch() * (SRC_VI.height - 1 - i) + j * 4 + OFS_BGRA[p]];
+        else
+          v = SRC->GetReadPtr(PLANE)[SRC->GetPitch(PLANE) * i + j];
+
+        bool chroma = !RGB && p > 0;
+        if (bits == 32) {
+          float f = chroma ? (v - 128) / 255.0f : v / 255.0f;
+          reinterpret_cast<float*>(dst + DST_PITCH * i)[j] = f;
+        } else if (bits == 8) {
+          dst[DST_PITCH * i + j] = static_cast<unsigned char>(v);
+        } else {
+          int w = RGB ? (v << (bits - 8)) | (v >> (16 - bits)) :
+                        v << (bits - 8);
+          reinterpret_cast<uint16_t*>(dst + DST_PITCH * i)[j] =
+            static_cast<uint16_t>(w);
+        }
+
+      }
+    }
+
+  }
+
+}
+
+
+
 int TurnsTileTestSource::OpenFile(std::string& filename, std::vector<unsigned char>& buf, IScriptEnvironment* env)
 {
 
@@ -27,7 +27,8 @@ class TurnsTileTestSource : public IClip
 public:
 
   TurnsTileTestSource(
-    std::string filename, std::string pixel_type, IScriptEnvironment* env);
+    std::string filename, std::string pixel_type, int bits,
+    IScriptEnvironment* env);
   ~TurnsTileTestSource() {}
 
   void __stdcall GetAudio(
@@ -53,6 +54,7 @@ private:
     const int PITCH_U, const int HEIGHT_U, const int ROW_SIZE_U);
   void DecodePng(std::vector<unsigned char>& raw, std::string pixel_type, IScriptEnvironment* env);
   int OpenFile(std::string& filename, std::vector<unsigned char>& buf, IScriptEnvironment* env);
+  void Widen(bool planarRgb, int bits, IScriptEnvironment* env);
   
 
 };
@@ -0,0 +1,367 @@
+#include "WorkerPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+
+// Each slot's range of items is packed into a single 64 bit value, first in
+// the low half and last in the high, so both ends can be changed at once.
+static inline unsigned long long packRange(int first, int last)
+{
+
+  unsigned long long hi = static_cast<unsigned int>(last);
+
+  return (hi << 32) | static_cast<unsigned int>(first);
+
+}
+
+
+
+static inline int rangeFirst(unsigned long long range)
+{
+
+  return static_cast<int>(range & 0xFFFFFFFFull);
+
+}
+
+
+
+static inline int rangeLast(unsigned long long range)
+{
+
+  return static_cast<int>(range >> 32);
+
+}
+
+
+
+WorkerPool::WorkerPool() :
+  users(0),
+  limit(std::max(static_cast<int>(std::thread::hardware_concurrency()), 1)),
+  stopping(false)
+{
+}
+
+
+
+WorkerPool::~WorkerPool()
+{
+
+  stop();
+
+}
+
+
+
+WorkerPool& WorkerPool::shared()
+{
+
+  // The pool is never destroyed, on purpose. Joining threads from a static
+  // destructor while the plugin is being unloaded is a reliable way to hang
+  // Windows; instead, the last script environment to close stops the threads
+  // on its way out, and they start up again if anything needs them after that.
+  static WorkerPool* pool = new WorkerPool;
+
+  return *pool;
+
+}
+
+
+
+void WorkerPool::attach(int threads)
+{
+
+  WorkerPool& p = shared();
+
+  // Every script environment in the process attaches to the same pool, and a
+  // cap one of them asked for shouldn't go away just because another didn't
+  // ask for one, so the limit only ever comes down, never back up. Zero asks
+  // for nothing at all. Threads that are already running were started for the
+  // old limit, so they're stopped, and the next job starts as many as the new
+  // one allows.
+  bool restart = false;
+
+  {
+    std::lock_guard<std::mutex> guard(p.lock);
+
+    ++p.users;
+
+    if (threads > 0 && threads < p.limit) {
+      p.limit = threads;
+      restart = !p.pool.empty();
+    }
+  }
+
+  if (restart)
+    p.stop();
+
+}
+
+
+
+void WorkerPool::release()
+{
+
+  WorkerPool& p = shared();
+
+  {
+    std::lock_guard<std::mutex> guard(p.lock);
+
+    if (p.users > 0 && --p.users > 0)
+      return;
+  }
+
+  p.stop();
+
+}
+
+
+
+int WorkerPool::maxThreads()
+{
+
+  WorkerPool& p = shared();
+
+  std::lock_guard<std::mutex> guard(p.lock);
+
+  return p.limit;
+
+}
+
+
+
+void WorkerPool::start()
+{
+
+  // The thread calling run always works on its own job, so the pool itself
+  // only needs one thread fewer than the limit. Threads are only started the
+  // first time a job actually wants more than one.
+  if (stopping || !pool.empty())
+    return;
+
+  for (int i = 1; i < limit; ++i)
+    pool.push_back(std::thread(&WorkerPool::workerLoop, this));
+
+}
+
+
+
+void WorkerPool::stop()
+{
+
+  std::vector<std::thread> finished;
+
+  {
+    std::lock_guard<std::mutex> guard(lock);
+
+    stopping = true;
+    finished.swap(pool);
+  }
+
+  wake.notify_all();
+
+  for (std::vector<std::thread>::iterator i = finished.begin();
+       i != finished.end(); ++i)
+    i->join();
+
+  std::lock_guard<std::mutex> guard(lock);
+
+  stopping = false;
+
+}
+
+
+
+void WorkerPool::run(
+  int count, int workers, const std::function<void(int, int)>& task)
+{
+
+  WorkerPool& p = shared();
+
+  std::unique_lock<std::mutex> guard(p.lock);
+
+  workers = std::min(std::min(workers, count), p.limit);
+
+  if (workers <= 1) {
+    guard.unlock();
+    if (count > 0)
+      task(0, count);
+    return;
+  }
+
+  p.start();
+
+  // Every slot starts out with an even share of the items, and whoever takes
+  // a slot works through it from the front. Once a slot runs dry, its worker
+  // steals the back half of whichever slot has the most left, so the work
+  // evens out on its own, even when some slots never get a worker at all
+  // because the pool is busy with other jobs.
+  Job job;
+  job.task = &task;
+  job.slots = workers;
+  job.joined = 1;
+  job.active = 1;
+  job.ranges.reset(new std::atomic<unsigned long long>[workers]);
+
+  for (int i = 0; i < workers; ++i)
+    job.ranges[i].store(
+      packRange(static_cast<int>(static_cast<long long>(count) * i / workers),
+                static_cast<int>(
+                  static_cast<long long>(count) * (i + 1) / workers)));
+
+  p.open.push_back(&job);
+
+  guard.unlock();
+
+  for (int i = 1; i < workers; ++i)
+    p.wake.notify_one();
+
+  work(&job, 0);
+
+  // No one new can join once the job's out of the open list, and everyone
+  // who already did only leaves when there's nothing left to take, so when
+  // the last of them is gone, every item has been finished.
+  guard.lock();
+
+  p.open.remove(&job);
+
+  --job.active;
+
+  while (job.active > 0)
+    p.idle.wait(guard);
+
+}
+
+
+
+void WorkerPool::workerLoop()
+{
+
+  std::unique_lock<std::mutex> guard(lock);
+
+  for (;;) {
+
+    while (!stopping && open.empty())
+      wake.wait(guard);
+
+    if (stopping)
+      return;
+
+    Job* job = open.front();
+
+    int slot = job->joined++;
+    ++job->active;
+
+    if (job->joined == job->slots)
+      open.pop_front();
+
+    guard.unlock();
+
+    work(job, slot);
+
+    guard.lock();
+
+    if (--job->active == 0)
+      idle.notify_all();
+
+  }
+
+}
+
+
+
+void WorkerPool::work(Job* job, int slot)
+{
+
+  int first, last;
+
+  for (;;) {
+
+    if (take(&job->ranges[slot], &first, &last))
+      (*job->task)(first, last);
+    else if (!steal(job, slot))
+      return;
+
+  }
+
+}
+
+
+
+bool WorkerPool::take(
+  std::atomic<unsigned long long>* range, int* first, int* last)
+{
+
+  // Items come off the front of a slot a few at a time, a quarter of what's
+  // left, so cheap items don't each pay for a trip through here, but there's
+  // always something left behind for anyone who runs out early to steal.
+  unsigned long long cur = range->load();
+
+  for (;;) {
+
+    int lo = rangeFirst(cur),
+        hi = rangeLast(cur);
+
+    if (lo >= hi)
+      return false;
+
+    int mid = lo + std::max((hi - lo) / 4, 1);
+
+    if (range->compare_exchange_weak(cur, packRange(mid, hi))) {
+      *first = lo;
+      *last = mid;
+      return true;
+    }
+
+  }
+
+}
+
+
+
+bool WorkerPool::steal(Job* job, int slot)
+{
+
+  // A slot is only ever refilled by its own worker, and only when it's empty,
+  // so anyone stealing from it at the same time just sees nothing to take.
+  for (;;) {
+
+    int victim = -1, most = 0;
+    unsigned long long cur = 0;
+
+    for (int i = 0; i < job->slots; ++i) {
+
+      unsigned long long range = job->ranges[i].load();
+      int left = rangeLast(range) - rangeFirst(range);
+
+      if (i != slot && left > most) {
+        victim = i;
+        most = left;
+        cur = range;
+      }
+
+    }
+
+    if (victim < 0)
+      return false;
+
+    int lo = rangeFirst(cur),
+        hi = rangeLast(cur),
+        mid = lo + (hi - lo) / 2;
+
+    if (job->ranges[victim].compare_exchange_strong(cur, packRange(lo, mid))) {
+      job->ranges[slot].store(packRange(mid, hi));
+      return true;
+    }
+
+  }
+
+}
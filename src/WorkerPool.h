@@ -0,0 +1,75 @@
+#ifndef TURNSTILE_SRC_WORKERPOOL_H_INCLUDED
+#define TURNSTILE_SRC_WORKERPOOL_H_INCLUDED
+
+
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+
+class WorkerPool
+{
+
+public:
+
+  static void attach(int threads);
+
+  static void release();
+
+  static int maxThreads();
+
+  static void run(
+    int count, int workers, const std::function<void(int, int)>& task);
+
+private:
+
+  struct Job
+  {
+    const std::function<void(int, int)>* task;
+    std::unique_ptr<std::atomic<unsigned long long>[]> ranges;
+    int slots, joined, active;
+  };
+
+  std::mutex lock;
+
+  std::condition_variable wake, idle;
+
+  std::list<Job*> open;
+
+  std::vector<std::thread> pool;
+
+  int users, limit;
+
+  bool stopping;
+
+  WorkerPool();
+
+  ~WorkerPool();
+
+  static WorkerPool& shared();
+
+  void start();
+
+  void stop();
+
+  void workerLoop();
+
+  static void work(Job* job, int slot);
+
+  static bool take(
+    std::atomic<unsigned long long>* range, int* first, int* last);
+
+  static bool steal(Job* job, int slot);
+
+};
+
+
+
+#endif // TURNSTILE_SRC_WORKERPOOL_H_INCLUDED
@@ -5,7 +5,30 @@
 #include <cmath>
 #include <cstring>
 
+#include "ColorMetric.h"
 #include "interface.h"
+#include "MappedFile.h"
+#include "PaletteQuantizer.h"
+#include "WorkerPool.h"
+
+
+
+// A TurnsTile_PoolThreads that isn't a non-negative integer is no reason to
+// keep the whole plugin from loading, CLUTer included. AvisynthPluginInit3
+// hands this to both filters as their user data instead, and whichever one the
+// script calls first reports the mistake.
+static char badPoolThreads;
+
+
+
+static void CheckPoolThreads(void* user_data, IScriptEnvironment* env)
+{
+
+  if (user_data == &badPoolThreads)
+    env->ThrowError(
+      "TurnsTile: TurnsTile_PoolThreads must be a non-negative integer!");
+
+}
 
 
 
@@ -13,6 +36,8 @@ AVSValue __cdecl Create_TurnsTile(
   AVSValue args, void* user_data, IScriptEnvironment* env)
 {
 
+  CheckPoolThreads(user_data, env);
+
   PClip clip = args[0][0].AsClip(),
         tilesheet = 0;
   if (args[0].ArraySize() > 1)
@@ -23,6 +48,28 @@ AVSValue __cdecl Create_TurnsTile(
     vi2 = tilesheet->GetVideoInfo();
 
 
+  // Reading arguments out of order makes me feel icky, but an index map
+  // changes what everything below is checked against, so I need this first.
+  bool fromMap = args[13].AsBool(false);
+
+  int mapH = vi.height;
+
+  // The map only says which tile goes where; it's the tilesheet that decides
+  // the colorspace and how big the tiles can be, so for all the checks that
+  // follow, the sheet stands in for the clip.
+  if (fromMap) {
+
+    if (!tilesheet)
+      env->ThrowError("TurnsTile: map input needs a tilesheet!");
+
+    if (!vi.IsY8() && vi.pixel_type != VideoInfo::CS_Y16)
+      env->ThrowError("TurnsTile: map input must be Y8 or Y16!");
+
+    vi = vi2;
+
+  }
+
+
   int dTileW = 16,
       dTileH = 16;
 
@@ -37,7 +84,7 @@ AVSValue __cdecl Create_TurnsTile(
 
   int lumaW, lumaH;
 
-  if (vi.IsYUV() && !vi.IsY8()) {
+  if (vi.IsYUV() && !vi.IsY()) {
     lumaW = 1 << vi.GetPlaneWidthSubsampling(PLANAR_U);
     lumaH = 1 << vi.GetPlaneHeightSubsampling(PLANAR_U);
   } else {
@@ -45,8 +92,12 @@ AVSValue __cdecl Create_TurnsTile(
     lumaH = 1;
   }
 
+  // Float samples are picked and filled in sixteen bit steps, so that's the
+  // depth 'res', 'lotile', and 'hitile' work in.
+  int bits = vi.ComponentSize() == 4 ? 16 : vi.BitsPerComponent();
+
 
-  // Reading arguments out of order makes me feel icky, but I need this early.
+  // Same goes for this one, though it can at least wait a little longer.
   bool interlaced = args[8].AsBool(false);
 
 
@@ -62,20 +113,38 @@ AVSValue __cdecl Create_TurnsTile(
       env->ThrowError("TurnsTile: clip and tilesheet must share a colorspace!");
 
   const char* const interlacedStr = interlaced ? "interlaced " : "";
-  const char* const cspStr =  vi.IsRGB32() ?  "RGB32" :
-                              vi.IsRGB24() ?  "RGB24" :
-                              vi.IsYUY2() ?   "YUY2" :
-                              vi.IsYV12() ?   "YV12" :
-                              vi.IsYV24() ?   "YV24" :
-                              vi.IsYV16() ?   "YV16" :
-                              vi.IsYV411() ?  "YV411" :
-                              vi.IsY8() ?     "Y8" :
-                              interlaced ?    "" :
-                                              "this";
+  const char* const cspStr =  vi.IsRGB32() ?        "RGB32" :
+                              vi.IsRGB24() ?        "RGB24" :
+                              vi.IsRGB64() ?        "RGB64" :
+                              vi.IsRGB48() ?        "RGB48" :
+                              vi.IsYUY2() ?         "YUY2" :
+                              vi.IsYV12() ?         "YV12" :
+                              vi.IsYV24() ?         "YV24" :
+                              vi.IsYV16() ?         "YV16" :
+                              vi.IsYV411() ?        "YV411" :
+                              vi.IsY8() ?           "Y8" :
+                              vi.IsPlanarRGBA() ?   "planar RGBA" :
+                              vi.IsPlanarRGB() ?    "planar RGB" :
+                              vi.IsYUVA() ?         "YUVA" :
+                              vi.Is420() ?          "YUV420" :
+                              vi.Is422() ?          "YUV422" :
+                              vi.Is444() ?          "YUV444" :
+                              vi.IsY() ?            "Y" :
+                              interlaced ?          "" :
+                                                    "this";
+
+  // Every plane TurnsTile knows about is copied or filled from its own tile
+  // center, but an alpha plane would just be left behind, uninitialized.
+  if (vi.IsPlanarRGBA() || vi.IsYUVA())
+    env->ThrowError("TurnsTile: %s input is not supported!", cspStr);
 
   if (interlaced) {
 
-    if (clipH % minTileH > 0)
+    if (fromMap && mapH % 2 > 0)
+      env->ThrowError(
+        "TurnsTile: map height must be mod 2 when interlaced=true!");
+
+    if (!fromMap && clipH % minTileH > 0)
       env->ThrowError(
         "TurnsTile: %s clip height must be mod %d when interlaced=true!",
         cspStr, minTileH);
@@ -117,7 +186,7 @@ AVSValue __cdecl Create_TurnsTile(
       minTileH, interlacedStr, cspStr);
 
 
-  int res = args[3].AsInt(8);
+  int res = args[3].AsInt(bits);
 
 
   int mode = args[4].AsInt(0);
@@ -135,11 +204,26 @@ AVSValue __cdecl Create_TurnsTile(
   if (tilesheet)
     tileIdxMax = ((sheetW / tileW) * (sheetH / tileH)) - 1;
   else
-    tileIdxMax = 255;
+    tileIdxMax = (1 << bits) - 1;
 
   int hiTile = args[7].AsInt(tileIdxMax);
 
 
+  // Unlike CLUTer, one thread is the default here. Avisynth+ already works on
+  // several frames at once when asked to, and splitting each of those frames up
+  // as well would only have threads fighting over the same cores.
+  int threads = args[9].AsInt(1);
+
+  const char* order =
+    env->Invoke("LCase", args[10].AsString("row")).AsString();
+
+  bool stream = args[11].AsBool(true);
+
+  bool indexOut = args[12].AsBool(false);
+
+  bool reuse = args[14].AsBool(false);
+
+
   int maxTileW = TurnsTile::gcf(clipW, sheetW),
       maxTileH = TurnsTile::gcf(clipH, sheetH);
 
@@ -178,20 +262,22 @@ AVSValue __cdecl Create_TurnsTile(
 
 
   int countChroma = 2;
-  if (vi.IsY8())
+  if (vi.IsY())
     countChroma = 0;
 
   int modeMax;
   if (vi.IsYUV())
     modeMax = (lumaW * lumaH) + countChroma;
+  else if (vi.IsPlanarRGB())
+    modeMax = 3;
   else
-    modeMax = vi.BytesFromPixels(1);
+    modeMax = vi.BytesFromPixels(1) / vi.ComponentSize();
 
   if (mode < 0 || mode > modeMax)
     env->ThrowError(
       "TurnsTile: %s only allows modes 0-%d!",
       cspStr, modeMax);
-  if ((vi.IsYV24() || vi.IsY8()) && mode == 0)
+  if (vi.IsYUV() && lumaW * lumaH == 1 && mode == 0)
     mode = 1;
 
 
@@ -215,6 +301,24 @@ AVSValue __cdecl Create_TurnsTile(
       "TurnsTile: lotile must not be greater than hitile!");
 
 
+  if (threads < 0)
+    env->ThrowError("TurnsTile: threads must not be negative!");
+
+  if (threads == 0)
+    threads = WorkerPool::maxThreads();
+
+
+  if (strcmp(order, "row") != 0 && strcmp(order, "tile") != 0)
+    env->ThrowError("TurnsTile: order must be either \"row\" or \"tile\"!");
+
+
+  if (indexOut && !tilesheet)
+    env->ThrowError("TurnsTile: index output needs a tilesheet!");
+
+  if (indexOut && fromMap)
+    env->ThrowError("TurnsTile: index must be false when map=true!");
+
+
   if (interlaced) {
 
     tileH /= 2;
@@ -237,6 +341,12 @@ AVSValue __cdecl Create_TurnsTile(
                                     levels,
                                     loTile,
                                     hiTile,
+                                    threads,
+                                    order,
+                                    stream,
+                                    indexOut,
+                                    fromMap,
+                                    reuse,
                                     env);
 
   if (interlaced && finalClip->GetVideoInfo().IsFieldBased())
@@ -252,6 +362,8 @@ AVSValue __cdecl Create_CLUTer(
   AVSValue args, void* user_data, IScriptEnvironment* env)
 {
 
+  CheckPoolThreads(user_data, env);
+
   PClip clip = args[0].AsClip(),
         palette = args[1].AsClip();
   VideoInfo vi = clip->GetVideoInfo();
@@ -263,10 +375,110 @@ AVSValue __cdecl Create_CLUTer(
   bool interlaced = args[3].AsBool(false);
 
 
+  // Zero means one thread per logical processor, which is the sensible choice
+  // for building the palette table when a script is first loaded. Frames are
+  // another matter; for the same reason as TurnsTile, they stay on one thread
+  // each unless the script asks for more.
+  int threads = args[4].AsInt(0),
+      frameThreads = args[4].AsInt(1);
+
+
+  bool lazy = args[5].AsBool(false);
+
+
+  bool index = args[6].AsBool(false);
+
+
+  const char* cacheDir = args[7].AsString("");
+
+
+  const char* lookup =
+    env->Invoke("LCase", args[8].AsString("auto")).AsString();
+
+
+  int metric = ColorMetric::parse(
+    env->Invoke("LCase", args[9].AsString("sad")).AsString());
+
+
+  const char* ditherStr =
+    env->Invoke("LCase", args[10].AsString("none")).AsString();
+
+  int dither = strcmp(ditherStr, "none") == 0 ?     CLUTer::DITHER_NONE :
+               strcmp(ditherStr, "bayer") == 0 ?    CLUTer::DITHER_BAYER :
+               strcmp(ditherStr, "floyd") == 0 ?    CLUTer::DITHER_FLOYD :
+               strcmp(ditherStr, "atkinson") == 0 ? CLUTer::DITHER_ATKINSON :
+                                                    -1;
+
+
+  bool animated = args[11].AsBool(false);
+
+
+  int colors = args[12].AsInt(0);
+
+
+  int quantize = PaletteQuantizer::parse(
+    env->Invoke("LCase", args[13].AsString("mediancut")).AsString());
+
+
+  int samples = args[14].AsInt(1);
+
+
   if (!vi.IsSameColorspace(args[1].AsClip()->GetVideoInfo()))
     env->ThrowError("CLUTer: clip and palette must share a colorspace!");
 
 
+  if (threads < 0)
+    env->ThrowError("CLUTer: threads must not be negative!");
+
+  if (threads == 0)
+    threads = WorkerPool::maxThreads();
+
+  if (frameThreads == 0)
+    frameThreads = WorkerPool::maxThreads();
+
+
+  if (*cacheDir && !MappedFile::isDirectory(cacheDir))
+    env->ThrowError("CLUTer: cachedir must be an existing directory!");
+
+
+  if (strcmp(lookup, "auto") != 0 && strcmp(lookup, "table") != 0 &&
+      strcmp(lookup, "direct") != 0)
+    env->ThrowError(
+      "CLUTer: lookup must be \"auto\", \"table\", or \"direct\"!");
+
+
+  if (metric < 0)
+    env->ThrowError(
+      "CLUTer: metric must be \"sad\", \"wrgb\", \"euclidean\", \"lab\", "
+      "or \"oklab\"!");
+
+  if (strcmp(lookup, "direct") == 0 && metric != ColorMetric::SAD)
+    env->ThrowError(
+      "CLUTer: direct lookup only supports metric=\"sad\"!");
+
+
+  if (dither < 0)
+    env->ThrowError(
+      "CLUTer: dither must be \"none\", \"bayer\", \"floyd\", or "
+      "\"atkinson\"!");
+
+
+  if (colors < 0 || colors > 256)
+    env->ThrowError("CLUTer: colors must be between 0 and 256!");
+
+
+  if (quantize < 0)
+    env->ThrowError(
+      "CLUTer: quantize must be \"mediancut\" or \"kmeans\"!");
+
+
+  if (samples < 1)
+    env->ThrowError("CLUTer: samples must be at least 1!");
+
+  if (samples > 1 && animated)
+    env->ThrowError("CLUTer: samples must be 1 when animated=true!");
+
+
   if (interlaced) {
 
     const char* const cspStr =  vi.IsRGB32() ?  "RGB32" :
@@ -300,6 +512,18 @@ AVSValue __cdecl Create_CLUTer(
                                  palette,
                                  paletteFrame,
                                  interlaced,
+                                 threads,
+                                 frameThreads,
+                                 lazy,
+                                 index,
+                                 cacheDir,
+                                 lookup,
+                                 metric,
+                                 dither,
+                                 animated,
+                                 colors,
+                                 quantize,
+                                 samples,
                                  env);
 
   if (interlaced && finalClip->GetVideoInfo().IsFieldBased())
@@ -317,8 +541,20 @@ AVSValue __cdecl Create_TurnsTileTestSource(
 
   std::string filename = args[0].AsString(""),
               pixel_type = args[1].AsString("RGB32");
+  int bits = args[2].AsInt(8);
+
+  return new TurnsTileTestSource(filename, pixel_type, bits, env);
+
+}
+
 
-  return new TurnsTileTestSource(filename, pixel_type, env);
+
+// Every script environment that loads the plugin shares the one pool, and the
+// last of them to shut down takes the pool's threads down with it.
+static void __cdecl ReleaseWorkerPool(void* user_data, IScriptEnvironment* env)
+{
+
+  WorkerPool::release();
 
 }
 
@@ -331,14 +567,32 @@ extern "C" __declspec(dllexport) const char* __stdcall AvisynthPluginInit3(
 
   AVS_linkage = vectors;
 
-  env->AddFunction("CLUTer", "cc[paletteframe]i[interlaced]b",
-                             Create_CLUTer, 0);
+  // Both filters run their row bands on the same pool, which never holds more
+  // threads than it's allowed, however many filters there are in the script or
+  // whatever their threads arguments ask for. That's one per logical processor
+  // unless a script says otherwise before loading the plugin, which it should
+  // when Avisynth+ is already keeping every processor busy with Prefetch. The
+  // pool is shared by every script in the process, too, so a script that leaves
+  // the global unset never lifts a cap some other script has already set.
+  AVSValue poolThreads = env->GetVarDef("TurnsTile_PoolThreads", 0);
+
+  bool validPoolThreads = poolThreads.IsInt() && poolThreads.AsInt() >= 0;
+  void* user_data = validPoolThreads ? 0 : &badPoolThreads;
+
+  WorkerPool::attach(validPoolThreads ? poolThreads.AsInt() : 0);
+  env->AtExit(ReleaseWorkerPool, 0);
+
+  env->AddFunction("CLUTer", "cc[paletteframe]i[interlaced]b[threads]i[lazy]b"
+                             "[index]b[cachedir]s[lookup]s[metric]s[dither]s"
+                             "[animated]b[colors]i[quantize]s[samples]i",
+                             Create_CLUTer, user_data);
 
   env->AddFunction("TurnsTile", "c+[tileW]i[tileH]i[res]i[mode]i[levels]s"
-                                "[lotile]i[hitile]i[interlaced]b",
-                                Create_TurnsTile, 0);
+                                "[lotile]i[hitile]i[interlaced]b[threads]i"
+                                "[order]s[stream]b[index]b[map]b[reuse]b",
+                                Create_TurnsTile, user_data);
 
-  env->AddFunction("TurnsTileTestSource", "s[pixel_type]s",
+  env->AddFunction("TurnsTileTestSource", "s[pixel_type]s[bits]i",
                                           Create_TurnsTileTestSource, 0);
 
   return "`TurnsTile' - Mosaic and palette effects";
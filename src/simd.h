@@ -0,0 +1,17 @@
+#ifndef TURNSTILE_SRC_SIMD_H_INCLUDED
+#define TURNSTILE_SRC_SIMD_H_INCLUDED
+
+
+
+// SSE2 is guaranteed on x64, and both GCC/Clang and MSVC will say so when it's
+// been enabled for 32 bit x86 builds. Anywhere else, the plain C++ versions of
+// the affected routines are all that get compiled.
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TURNSTILE_SSE2
+#include <emmintrin.h>
+#endif
+
+
+
+#endif // TURNSTILE_SRC_SIMD_H_INCLUDED
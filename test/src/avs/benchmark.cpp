@@ -0,0 +1,268 @@
+#include <string>
+
+#include "../../include/catch/catch.hpp"
+
+#include "util_avs.h"
+
+
+
+extern IScriptEnvironment* env;
+
+
+
+// Like the benchmarks in test/src/benchmark.cpp, these are hidden, and only run
+// when asked for by tag. Each one reports how long a single frame takes, so the
+// frame rate is simply one second divided by Catch's mean:
+//
+//   turnstile-test [benchmark][cluter]
+//   turnstile-test [benchmark][turnstile]
+
+
+
+static void BenchmarkTestAvs(std::string name)
+{
+
+  PClip clip = LoadTestAvs(name);
+
+  // Every iteration asks for a frame no one has asked for before, so it's
+  // the filter doing the work each time, not Avisynth's frame cache.
+  int n = 0;
+
+  BENCHMARK(name.c_str()) {
+    return clip->GetFrame(n++, env);
+  };
+
+}
+
+
+
+// Every size here divides both 1920 and 1080 evenly. Sizes that aren't a
+// multiple of minSize, the smallest tile the colorspace allows, are skipped.
+static void BenchmarkTileSizes(std::string name, int minSize)
+{
+
+  PClip clip = LoadTestAvs(name);
+
+  const int SIZES[] = { 1, 2, 4, 8, 12, 24, 40, 60 };
+
+  for (size_t i = 0; i < sizeof(SIZES) / sizeof(SIZES[0]); ++i) {
+
+    if (SIZES[i] % minSize)
+      continue;
+
+    AVSValue args[3] = { clip, SIZES[i], SIZES[i] };
+    PClip tiled = env->Invoke("TurnsTile", AVSValue(args, 3)).AsClip();
+
+    std::string size = std::to_string(SIZES[i]);
+    int n = 0;
+
+    BENCHMARK(name + ", " + size + "x" + size) {
+      return tiled->GetFrame(n++, env);
+    };
+
+  }
+
+}
+
+
+
+// Each clip is tiled by itself, both with and without itself as a tilesheet,
+// once for each order TurnsTile can write a row of tiles in.
+static void BenchmarkTileOrders(std::string name)
+{
+
+  PClip clip = LoadTestAvs(name);
+
+  const char* ORDERS[] = { "tile", "row" };
+  const char* ARG_NAMES[] = { 0, 0, 0, 0, "order" };
+
+  for (int sheet = 0; sheet < 2; ++sheet) {
+
+    for (size_t i = 0; i < sizeof(ORDERS) / sizeof(ORDERS[0]); ++i) {
+
+      AVSValue tiled;
+      if (sheet) {
+        AVSValue args[5] = { clip, clip, 8, 8, ORDERS[i] };
+        tiled = env->Invoke("TurnsTile", AVSValue(args, 5), ARG_NAMES);
+      } else {
+        AVSValue args[4] = { clip, 8, 8, ORDERS[i] };
+        tiled = env->Invoke("TurnsTile", AVSValue(args, 4), ARG_NAMES + 1);
+      }
+
+      PClip tiledClip = tiled.AsClip();
+      int n = 0;
+
+      BENCHMARK(name + (sheet ? ", tilesheet" : "") + ", " + ORDERS[i] +
+                " order") {
+        return tiledClip->GetFrame(n++, env);
+      };
+
+    }
+
+  }
+
+}
+
+
+
+// Streaming stores are meant to leave the cache alone for whatever comes after
+// TurnsTile, so the time that matters is that of the whole chain, not only of
+// TurnsTile itself. Invert reads every byte TurnsTile writes.
+static void BenchmarkStreaming(std::string name)
+{
+
+  PClip clip = LoadTestAvs(name);
+
+  const char* ARG_NAMES[] = { 0, 0, 0, "stream" };
+
+  for (int downstream = 0; downstream < 2; ++downstream) {
+
+    for (int stream = 0; stream < 2; ++stream) {
+
+      AVSValue args[4] = { clip, 8, 8, stream != 0 };
+      AVSValue tiled = env->Invoke("TurnsTile", AVSValue(args, 4), ARG_NAMES);
+
+      if (downstream)
+        tiled = env->Invoke("Invert", tiled);
+
+      PClip tiledClip = tiled.AsClip();
+      int n = 0;
+
+      BENCHMARK(name + (downstream ? ", then Invert" : "") +
+                (stream ? ", streaming" : ", plain") + " stores") {
+        return tiledClip->GetFrame(n++, env);
+      };
+
+    }
+
+  }
+
+}
+
+
+
+TEST_CASE(
+  "CLUTer - Frame rate at 1080p",
+  "[.][benchmark][cluter][1080p]")
+{
+
+  BenchmarkTestAvs("benchmark-cluter-rgb32_1080p");
+  BenchmarkTestAvs("benchmark-cluter-rgb24_1080p");
+  BenchmarkTestAvs("benchmark-cluter-yuy2_1080p");
+  BenchmarkTestAvs("benchmark-cluter-yv12_1080p");
+
+}
+
+
+
+TEST_CASE(
+  "CLUTer - Frame rate at 2160p",
+  "[.][benchmark][cluter][2160p]")
+{
+
+  BenchmarkTestAvs("benchmark-cluter-rgb32_2160p");
+  BenchmarkTestAvs("benchmark-cluter-rgb24_2160p");
+  BenchmarkTestAvs("benchmark-cluter-yuy2_2160p");
+  BenchmarkTestAvs("benchmark-cluter-yv12_2160p");
+
+}
+
+
+
+TEST_CASE(
+  "TurnsTile - Frame rate with 2x2 tiles",
+  "[.][benchmark][turnstile][2x2]")
+{
+
+  BenchmarkTestAvs("benchmark-turnstile-rgb32_2x2");
+  BenchmarkTestAvs("benchmark-turnstile-rgb24_2x2");
+  BenchmarkTestAvs("benchmark-turnstile-yuy2_2x2");
+  BenchmarkTestAvs("benchmark-turnstile-yv12_2x2");
+
+}
+
+
+
+TEST_CASE(
+  "TurnsTile - Frame rate with 4x4 tiles",
+  "[.][benchmark][turnstile][4x4]")
+{
+
+  BenchmarkTestAvs("benchmark-turnstile-rgb32_4x4");
+  BenchmarkTestAvs("benchmark-turnstile-rgb24_4x4");
+  BenchmarkTestAvs("benchmark-turnstile-yuy2_4x4");
+  BenchmarkTestAvs("benchmark-turnstile-yv12_4x4");
+
+}
+
+
+
+TEST_CASE(
+  "TurnsTile - Frame rate at 2160p with a bundled tilesheet",
+  "[.][benchmark][turnstile][atlas]")
+{
+
+  BenchmarkTestAvs("benchmark-turnstile-atlas-rgb32_2160p");
+  BenchmarkTestAvs("benchmark-turnstile-atlas-yv12_2160p");
+
+}
+
+
+
+TEST_CASE(
+  "TurnsTile - Frame rate at 2160p from a precomputed index map",
+  "[.][benchmark][turnstile][map]")
+{
+
+  BenchmarkTestAvs("benchmark-turnstile-map-rgb32_2160p");
+  BenchmarkTestAvs("benchmark-turnstile-map-yv12_2160p");
+
+}
+
+
+
+TEST_CASE(
+  "TurnsTile - Frame rate at 2160p reusing unchanged tiles",
+  "[.][benchmark][turnstile][reuse]")
+{
+
+  BenchmarkTestAvs("benchmark-turnstile-reuse-rgb32_2160p");
+  BenchmarkTestAvs("benchmark-turnstile-reuse-yv12_2160p");
+
+}
+
+
+
+TEST_CASE(
+  "TurnsTile - Frame rate across tile sizes",
+  "[.][benchmark][turnstile][sweep]")
+{
+
+  BenchmarkTileSizes("benchmark-turnstile-sweep-rgb32_1080p", 1);
+  BenchmarkTileSizes("benchmark-turnstile-sweep-yv12_1080p", 2);
+
+}
+
+
+
+TEST_CASE(
+  "TurnsTile - Frame rate at 2160p, by tile and by row",
+  "[.][benchmark][turnstile][order]")
+{
+
+  BenchmarkTileOrders("benchmark-turnstile-order-rgb32_2160p");
+  BenchmarkTileOrders("benchmark-turnstile-order-yv12_2160p");
+
+}
+
+
+
+TEST_CASE(
+  "TurnsTile - Frame rate at 2160p, with and without streaming stores",
+  "[.][benchmark][turnstile][stream]")
+{
+
+  BenchmarkStreaming("benchmark-turnstile-stream-rgb32_2160p");
+  BenchmarkStreaming("benchmark-turnstile-stream-yv12_2160p");
+
+}
@@ -17,6 +17,17 @@ TEST_CASE(
 
 
 
+TEST_CASE(
+  "TurnsTile - Input with an alpha plane throws expected error",
+  "[errors][turnstile][colorspace][alpha]")
+{
+
+  RunTestAvs("errors-turnstile-alpha");
+
+}
+
+
+
 TEST_CASE(
   "TurnsTile - Interlaced clip height not mod minimum throws expected error",
   "[errors][turnstile][interlaced][height][mod]")
@@ -234,6 +245,83 @@ TEST_CASE(
 
 
 
+TEST_CASE(
+  "TurnsTile - Negative thread count throws expected error",
+  "[errors][turnstile][threads][range]")
+{
+
+  RunTestAvs("errors-turnstile-threads-range");
+
+}
+
+
+
+TEST_CASE(
+  "TurnsTile - Invalid order throws expected error",
+  "[errors][turnstile][order][value]")
+{
+
+  RunTestAvs("errors-turnstile-order-value");
+
+}
+
+
+
+TEST_CASE(
+  "TurnsTile - Index output without a tilesheet throws expected error",
+  "[errors][turnstile][index][tilesheet]")
+{
+
+  RunTestAvs("errors-turnstile-index-tilesheet");
+
+}
+
+
+
+TEST_CASE(
+  "TurnsTile - Index output with map input throws expected error",
+  "[errors][turnstile][index][map]")
+{
+
+  RunTestAvs("errors-turnstile-index-map");
+
+}
+
+
+
+TEST_CASE(
+  "TurnsTile - Map input without a tilesheet throws expected error",
+  "[errors][turnstile][map][tilesheet]")
+{
+
+  RunTestAvs("errors-turnstile-map-tilesheet");
+
+}
+
+
+
+TEST_CASE(
+  "TurnsTile - Map input that's not Y8 or Y16 throws expected error",
+  "[errors][turnstile][map][colorspace]")
+{
+
+  RunTestAvs("errors-turnstile-map-colorspace");
+
+}
+
+
+
+TEST_CASE(
+  "TurnsTile - Interlaced map height not mod 2 throws expected error",
+  "[errors][turnstile][map][interlaced][height]")
+{
+
+  RunTestAvs("errors-turnstile-map-interlaced-height");
+
+}
+
+
+
 TEST_CASE(
   "CLUTer - Colorspace mismatch in CLUTer throws expected error",
   "[errors][cluter][colorspace][mismatch]")
@@ -259,3 +347,125 @@ TEST_CASE(
     RunTestAvs("errors-cluter-interlaced-height-mod-" + csps[i]);
 
 }
+
+
+
+TEST_CASE(
+  "CLUTer - Negative thread count throws expected error",
+  "[errors][cluter][threads][range]")
+{
+
+  RunTestAvs("errors-cluter-threads-range");
+
+}
+
+
+
+TEST_CASE(
+  "CLUTer - Index output with too many palette colors throws expected error",
+  "[errors][cluter][index][colors]")
+{
+
+  RunTestAvs("errors-cluter-index-colors");
+
+}
+
+
+
+TEST_CASE(
+  "CLUTer - Missing cache directory throws expected error",
+  "[errors][cluter][cachedir]")
+{
+
+  RunTestAvs("errors-cluter-cachedir");
+
+}
+
+
+
+TEST_CASE(
+  "CLUTer - Lookup value out of range throws expected error",
+  "[errors][cluter][lookup][value]")
+{
+
+  RunTestAvs("errors-cluter-lookup-value");
+
+}
+
+
+
+TEST_CASE(
+  "CLUTer - Direct lookup with too many palette colors throws expected error",
+  "[errors][cluter][lookup][colors]")
+{
+
+  RunTestAvs("errors-cluter-lookup-colors");
+
+}
+
+
+
+TEST_CASE(
+  "CLUTer - Metric value out of range throws expected error",
+  "[errors][cluter][metric][value]")
+{
+
+  RunTestAvs("errors-cluter-metric-value");
+
+}
+
+
+
+TEST_CASE(
+  "CLUTer - Direct lookup with a metric other than sad throws expected error",
+  "[errors][cluter][metric][lookup]")
+{
+
+  RunTestAvs("errors-cluter-metric-lookup");
+
+}
+
+
+
+TEST_CASE(
+  "CLUTer - Dither value out of range throws expected error",
+  "[errors][cluter][dither][value]")
+{
+
+  RunTestAvs("errors-cluter-dither-value");
+
+}
+
+
+
+TEST_CASE(
+  "CLUTer - Colors value out of range throws expected error",
+  "[errors][cluter][colors][range]")
+{
+
+  RunTestAvs("errors-cluter-colors-range");
+
+}
+
+
+
+TEST_CASE(
+  "CLUTer - Quantize value out of range throws expected error",
+  "[errors][cluter][quantize][value]")
+{
+
+  RunTestAvs("errors-cluter-quantize-value");
+
+}
+
+
+
+TEST_CASE(
+  "CLUTer - Samples value out of range throws expected error",
+  "[errors][cluter][samples][range]")
+{
+
+  RunTestAvs("errors-cluter-samples-range");
+  RunTestAvs("errors-cluter-samples-animated");
+
+}
@@ -125,6 +125,127 @@ TEST_CASE(
 
 
 
+TEST_CASE(
+  "TurnsTile - Threads parameter produces expected results",
+  "[output][turnstile][threads]")
+{
+
+  RunTestAvs("output-turnstile-threads_rgb32");
+  RunTestAvs("output-turnstile-threads_yv12");
+
+}
+
+
+
+TEST_CASE(
+  "TurnsTile - Order parameter produces expected results",
+  "[output][turnstile][order]")
+{
+
+  RunTestAvs("output-turnstile-order_rgb32_row");
+  RunTestAvs("output-turnstile-order_rgb32_tile");
+  RunTestAvs("output-turnstile-order_yv12_row");
+  RunTestAvs("output-turnstile-order_yv12_tile");
+
+}
+
+
+
+TEST_CASE(
+  "TurnsTile - Stream parameter produces expected results",
+  "[output][turnstile][stream]")
+{
+
+  RunTestAvs("output-turnstile-stream_rgb32_true");
+  RunTestAvs("output-turnstile-stream_rgb32_false");
+  RunTestAvs("output-turnstile-stream_yv12_true");
+  RunTestAvs("output-turnstile-stream_yv12_false");
+
+}
+
+
+
+TEST_CASE(
+  "TurnsTile - Tilesheet atlas produces expected results",
+  "[output][turnstile][atlas]")
+{
+
+  RunTestAvs("output-turnstile-atlas_rgb32");
+  RunTestAvs("output-turnstile-atlas_rgb24");
+  RunTestAvs("output-turnstile-atlas_yuy2");
+  RunTestAvs("output-turnstile-atlas_yv12");
+
+}
+
+
+
+TEST_CASE(
+  "TurnsTile - Index output fed back in as a map produces expected results",
+  "[output][turnstile][index][map]")
+{
+
+  RunTestAvs("output-turnstile-index-map_rgb32");
+  RunTestAvs("output-turnstile-index-map_yv12");
+  RunTestAvs("output-turnstile-index-map_interlaced");
+
+}
+
+
+
+TEST_CASE(
+  "TurnsTile - Reuse option produces expected results",
+  "[output][turnstile][reuse]")
+{
+
+  RunTestAvs("output-turnstile-reuse_rgb32");
+  RunTestAvs("output-turnstile-reuse_yv12");
+
+}
+
+
+
+TEST_CASE(
+  "TurnsTile - High bit depth input produces expected results",
+  "[output][turnstile][bitdepth]")
+{
+
+  RunTestAvs("output-turnstile-bitdepth_rgb64");
+  RunTestAvs("output-turnstile-bitdepth_yuv420p16");
+  RunTestAvs("output-turnstile-bitdepth_yuv420ps");
+
+  RunTestAvs("output-turnstile-res_clip_yuv420p16_1");
+  RunTestAvs("output-turnstile-res_clip_yuv420p16_8");
+  RunTestAvs("output-turnstile-res_clip_yuv420p16_16");
+  RunTestAvs("output-turnstile-res_clip_yuv420p12_8");
+  RunTestAvs("output-turnstile-res_clip_yuv420p10_1");
+  RunTestAvs("output-turnstile-res_clip_yuv420p10_8");
+  RunTestAvs("output-turnstile-res_clip_yuv420p10_10");
+  RunTestAvs("output-turnstile-res_clip_yuv420ps_1");
+  RunTestAvs("output-turnstile-res_clip_yuv420ps_8");
+  RunTestAvs("output-turnstile-res_clip_yuv420ps_16");
+  RunTestAvs("output-turnstile-res_clip_rgb64_1");
+  RunTestAvs("output-turnstile-res_clip_rgb64_8");
+  RunTestAvs("output-turnstile-res_clip_rgb64_16");
+
+  RunTestAvs("output-turnstile-mode_rgbp16_0");
+  RunTestAvs("output-turnstile-mode_rgbp16_1");
+  RunTestAvs("output-turnstile-mode_rgbp16_2");
+  RunTestAvs("output-turnstile-mode_rgbp16_3");
+  RunTestAvs("output-turnstile-mode_rgb64_3");
+  RunTestAvs("output-turnstile-mode_yuv420p16_5");
+  RunTestAvs("output-turnstile-mode_yuv420p10_0");
+  RunTestAvs("output-turnstile-mode_yuv420ps_0");
+  RunTestAvs("output-turnstile-mode_yuv420ps_5");
+  RunTestAvs("output-turnstile-mode_yuv420ps_6");
+
+  RunTestAvs("output-turnstile-reuse_rgb64");
+  RunTestAvs("output-turnstile-reuse_yuv420p16");
+  RunTestAvs("output-turnstile-reuse_yuv420ps");
+
+}
+
+
+
 TEST_CASE(
   "CLUTer - Paletteframe parameter produces expected results",
   "[output][cluter][paletteframe]")
@@ -145,3 +266,145 @@ TEST_CASE(
   RunTestAvs("output-cluter-interlaced");
 
 }
+
+
+
+TEST_CASE(
+  "CLUTer - Threads parameter produces expected results",
+  "[output][cluter][threads]")
+{
+
+  RunTestAvs("output-cluter-threads");
+
+}
+
+
+
+TEST_CASE(
+  "CLUTer - Lazy parameter produces expected results",
+  "[output][cluter][lazy]")
+{
+
+  std::string csps[2] = { "rgb24", "yv12" };
+
+  for (int i = 0; i < 2; ++i)
+    RunTestAvs("output-cluter-lazy_" + csps[i]);
+
+}
+
+
+
+TEST_CASE(
+  "CLUTer - Index parameter produces expected results",
+  "[output][cluter][index]")
+{
+
+  RunTestAvs("output-cluter-index");
+
+}
+
+
+
+TEST_CASE(
+  "CLUTer - Cachedir parameter produces expected results",
+  "[output][cluter][cachedir]")
+{
+
+  RunTestAvs("output-cluter-cachedir");
+
+}
+
+
+
+TEST_CASE(
+  "CLUTer - Instances sharing a palette produce expected results",
+  "[output][cluter][shared]")
+{
+
+  RunTestAvs("output-cluter-shared");
+
+}
+
+
+
+TEST_CASE(
+  "CLUTer - Lookup parameter produces expected results",
+  "[output][cluter][lookup]")
+{
+
+  RunTestAvs("output-cluter-lookup_table");
+  RunTestAvs("output-cluter-lookup_direct");
+
+}
+
+
+
+TEST_CASE(
+  "CLUTer - Metric parameter produces expected results",
+  "[output][cluter][metric]")
+{
+
+  RunTestAvs("output-cluter-metric_wrgb");
+  RunTestAvs("output-cluter-metric_lab");
+  RunTestAvs("output-cluter-metric_oklab");
+  RunTestAvs("output-cluter-metric_lazy");
+
+}
+
+
+
+TEST_CASE(
+  "CLUTer - Dither parameter produces expected results",
+  "[output][cluter][dither]")
+{
+
+  RunTestAvs("output-cluter-dither_bayer");
+  RunTestAvs("output-cluter-dither_floyd");
+  RunTestAvs("output-cluter-dither_atkinson");
+
+}
+
+
+
+TEST_CASE(
+  "CLUTer - Animated parameter produces expected results",
+  "[output][cluter][animated]")
+{
+
+  RunTestAvs("output-cluter-animated_frame");
+  RunTestAvs("output-cluter-animated_table");
+  RunTestAvs("output-cluter-animated_colors");
+
+}
+
+
+
+TEST_CASE(
+  "CLUTer - Animated tables patched from the last frame match fresh ones",
+  "[output][cluter][animated][patch]")
+{
+
+  std::string changes[3] = { "changed", "added", "removed" };
+
+  for (int i = 0; i < 3; ++i) {
+
+    RunTestAvs("output-cluter-animated_patch_" + changes[i]);
+    RunTestAvs("output-cluter-paletteframe_patch_" + changes[i]);
+
+  }
+
+}
+
+
+
+TEST_CASE(
+  "CLUTer - Colors parameter produces expected results",
+  "[output][cluter][colors]")
+{
+
+  RunTestAvs("output-cluter-colors_exact");
+  RunTestAvs("output-cluter-colors_mediancut");
+  RunTestAvs("output-cluter-colors_kmeans");
+  RunTestAvs("output-cluter-colors_paletteframe");
+
+}
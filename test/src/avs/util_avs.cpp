@@ -3,6 +3,8 @@
 #include <string>
 #include <vector>
 
+#include "../../include/catch/catch.hpp"
+
 #include "../../../src/interface.h"
 #include "../util_common.h"
 
@@ -16,7 +18,7 @@ extern std::string scriptDir, refDir;
 
 
 
-void RunTestAvs(std::string name)
+static AVSValue ImportTestAvs(std::string name)
 {
 
   // Using the Avisynth language's try...catch keywords, instead of using C++
@@ -50,7 +52,18 @@ void RunTestAvs(std::string name)
 
   std::string script = scriptDir + name + ".avs";
 
-  AVSValue result = env->Invoke("TurnsTileRunTest", AVSValue(script.c_str()));
+  return env->Invoke("TurnsTileRunTest", AVSValue(script.c_str()));
+
+}
+
+
+
+void RunTestAvs(std::string name)
+{
+
+  std::string script = scriptDir + name + ".avs";
+
+  AVSValue result = ImportTestAvs(name);
 
   std::string dataCur;
 
@@ -97,3 +110,19 @@ void RunTestAvs(std::string name)
   CompareData(dataCur, refDir + name + ".txt");
 
 }
+
+
+
+PClip LoadTestAvs(std::string name)
+{
+
+  AVSValue result = ImportTestAvs(name);
+
+  if (!result.IsClip()) {
+    FAIL("Error evaluating script " + scriptDir + name + ".avs: " +
+         (result.IsString() ? result.AsString() : "no clip returned"));
+  }
+
+  return result.AsClip();
+
+}
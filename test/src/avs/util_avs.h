@@ -11,6 +11,8 @@
 
 void RunTestAvs(std::string name);
 
+PClip LoadTestAvs(std::string name);
+
 
 
 #endif // TURNSTILE_TEST_SRC_AVS_UTIL_AVS_H_INCLUDED
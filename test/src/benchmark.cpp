@@ -0,0 +1,377 @@
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "../include/catch/catch.hpp"
+
+#include "../../src/ColorMetric.h"
+#include "../../src/PaletteGrid.h"
+#include "../../src/PaletteQuantizer.h"
+#include "../../src/PaletteSearch.h"
+
+#include "util_palette.h"
+
+
+
+// Benchmarks are tagged hidden, so they only run when asked for by name or tag:
+//
+//   turnstile-test [benchmark]
+
+
+
+// The brute force search is far too slow to run over the whole color cube, so
+// every search method only fills the first BENCH_BRICKS bricks (an 8x256x256
+// slab of colors) to keep the comparison fair.
+static const int BENCH_BRICKS = PaletteGrid::BRICK_COUNT / 32;
+
+
+
+TEST_CASE(
+  "PaletteGrid - Nearest color search",
+  "[.][benchmark][palettegrid]")
+{
+
+  int sizes[3] = { 16, 64, 256 };
+
+  for (int i = 0; i < 3; ++i) {
+
+    std::vector<int> plt = MakePalette(sizes[i]),
+                     bricks = FirstBricks(BENCH_BRICKS);
+
+    SECTION(std::to_string(sizes[i]) + " colors") {
+
+      BENCHMARK("Brute force") {
+        return SearchBruteForce(plt, bricks);
+      };
+
+      BENCHMARK("Grid, scalar") {
+        return SearchGrid(plt, bricks, false);
+      };
+
+      BENCHMARK("Grid, SIMD") {
+        return SearchGrid(plt, bricks, true);
+      };
+
+    }
+
+  }
+
+}
+
+
+
+// Every metric besides the sum of absolute differences has to convert each
+// color in a brick before searching it, and for CIELAB and OKLab that means
+// cube roots, so these show what each one adds to building the table.
+TEST_CASE(
+  "PaletteGrid - Nearest color search by metric",
+  "[.][benchmark][palettegrid][metric]")
+{
+
+  std::vector<int> plt = MakePalette(256),
+                   bricks = FirstBricks(BENCH_BRICKS);
+
+  int metrics[5] = { ColorMetric::SAD, ColorMetric::WRGB, ColorMetric::EUCLIDEAN,
+                     ColorMetric::LAB, ColorMetric::OKLAB };
+  const char* names[5] = { "sad", "wrgb", "euclidean", "lab", "oklab" };
+
+  for (int i = 0; i < 5; ++i) {
+
+    SECTION(names[i]) {
+
+      BENCHMARK("Grid, SIMD") {
+        return SearchGrid(plt, bricks, true, metrics[i]);
+      };
+
+    }
+
+  }
+
+}
+
+
+
+// CLUTer can't be constructed outside of Avisynth, so this reproduces its
+// packed RGB32 loop on a 1080p frame, once with a separate table for each
+// component, once with a single interleaved table of colors, and once with the
+// table of palette indices it uses now. The frame is the gradient from
+// MakeFrame, with just a little noise.
+static const int FRAME_W = 1920, FRAME_H = 1080;
+
+
+
+TEST_CASE(
+  "CLUTer - Lookup table layout",
+  "[.][benchmark][cluter]")
+{
+
+  std::vector<int> plt = MakePalette(256);
+  PaletteGrid grid(plt);
+
+  std::vector<unsigned char> vecYR(16777216), vecUG(16777216), vecVB(16777216);
+  std::vector<unsigned int> vecColor(16777216);
+  std::vector<unsigned char> vecIdx8(16777216);
+  std::vector<int> pltIdx(PaletteGrid::BRICK_SIZE);
+
+  for (int brick = 0; brick < PaletteGrid::BRICK_COUNT; ++brick) {
+
+    grid.fillBrick(brick, &pltIdx[0]);
+
+    for (int entry = 0; entry < PaletteGrid::BRICK_SIZE; ++entry) {
+
+      int outInt = plt[pltIdx[entry]],
+          packed = PaletteGrid::brickToColor(brick, entry);
+
+      vecYR[packed] = (outInt >> 16) & 255;
+      vecUG[packed] = (outInt >> 8) & 255;
+      vecVB[packed] = outInt & 255;
+      vecColor[packed] = outInt;
+      vecIdx8[packed] = static_cast<unsigned char>(pltIdx[entry]);
+
+    }
+
+  }
+
+  std::vector<unsigned char> src = MakeFrame(FRAME_W, FRAME_H, 3),
+                             dstPlanar(src.size()),
+                             dstInterleaved(src.size()),
+                             dstIndex(src.size());
+
+  BENCHMARK("Planar tables") {
+
+    for (size_t i = 0; i < src.size(); i += 4) {
+
+      int packed = (src[i + 2] << 16) | (src[i + 1] << 8) | src[i];
+
+      dstPlanar[i] = vecVB[packed];
+      dstPlanar[i + 1] = vecUG[packed];
+      dstPlanar[i + 2] = vecYR[packed];
+
+    }
+
+    return dstPlanar[0];
+
+  };
+
+  BENCHMARK("Interleaved table") {
+
+    for (size_t i = 0; i < src.size(); i += 4) {
+
+      int packed = (src[i + 2] << 16) | (src[i + 1] << 8) | src[i];
+      unsigned int outInt = vecColor[packed];
+
+      dstInterleaved[i] = outInt & 255;
+      dstInterleaved[i + 1] = (outInt >> 8) & 255;
+      dstInterleaved[i + 2] = (outInt >> 16) & 255;
+
+    }
+
+    return dstInterleaved[0];
+
+  };
+
+  BENCHMARK("Index table") {
+
+    for (size_t i = 0; i < src.size(); i += 4) {
+
+      int packed = (src[i + 2] << 16) | (src[i + 1] << 8) | src[i];
+      int outInt = plt[vecIdx8[packed]];
+
+      dstIndex[i] = outInt & 255;
+      dstIndex[i + 1] = (outInt >> 8) & 255;
+      dstIndex[i + 2] = (outInt >> 16) & 255;
+
+    }
+
+    return dstIndex[0];
+
+  };
+
+  CHECK(dstPlanar == dstInterleaved);
+  CHECK(dstPlanar == dstIndex);
+
+}
+
+
+
+
+// CLUTer hands the palette search a run of pixels at a time, which is what lets
+// it test several pixels at once.
+static const int SEARCH_RUN = 64;
+
+
+
+static unsigned char SearchFrame(
+  const std::vector<int>& plt, const PaletteSearch& search,
+  const std::vector<unsigned char>& src, std::vector<unsigned char>* dst)
+{
+
+  int packed[SEARCH_RUN], pltIdx[SEARCH_RUN];
+
+  for (size_t i = 0; i < src.size(); i += SEARCH_RUN * 4) {
+
+    int count = static_cast<int>(
+      std::min(src.size() - i, static_cast<size_t>(SEARCH_RUN * 4)) / 4);
+
+    for (int j = 0; j < count; ++j) {
+      const unsigned char* px = &src[i + j * 4];
+      packed[j] = (px[2] << 16) | (px[1] << 8) | px[0];
+    }
+
+    search.nearest(packed, pltIdx, count);
+
+    for (int j = 0; j < count; ++j) {
+      int outInt = plt[pltIdx[j]];
+      unsigned char* px = &(*dst)[i + j * 4];
+      px[0] = outInt & 255;
+      px[1] = (outInt >> 8) & 255;
+      px[2] = (outInt >> 16) & 255;
+    }
+
+  }
+
+  return (*dst)[0];
+
+}
+
+
+
+// Picking between searching the palette for every pixel and looking each one
+// up in a table comes down to how many colors there are to search, and how
+// well the table stays in cache. The first frame is the same gentle gradient
+// as above, which is about as kind to the table as real footage gets; the
+// second is mostly noise, which sends lookups all over it.
+TEST_CASE(
+  "CLUTer - Direct search against table lookup",
+  "[.][benchmark][cluter]")
+{
+
+  int sizes[5] = { 4, 8, 16, 32, 64 };
+
+  std::vector<unsigned char> gradient = MakeFrame(FRAME_W, FRAME_H, 3),
+                             noisy = MakeFrame(FRAME_W, FRAME_H, 63);
+
+  std::vector<unsigned char> tblIdx8(16777216);
+  std::vector<int> pltIdx(PaletteGrid::BRICK_SIZE);
+
+  for (int i = 0; i < 5; ++i) {
+
+    std::vector<int> plt = MakePalette(sizes[i]);
+
+    PaletteGrid grid(plt);
+    PaletteSearch search(plt), searchC(plt, false);
+
+    for (int brick = 0; brick < PaletteGrid::BRICK_COUNT; ++brick) {
+
+      grid.fillBrick(brick, &pltIdx[0]);
+
+      for (int entry = 0; entry < PaletteGrid::BRICK_SIZE; ++entry)
+        tblIdx8[PaletteGrid::brickToColor(brick, entry)] =
+          static_cast<unsigned char>(pltIdx[entry]);
+
+    }
+
+    SECTION(std::to_string(sizes[i]) + " colors") {
+
+      std::vector<unsigned char>* frames[2] = { &gradient, &noisy };
+      const char* names[2] = { "gradient", "noise" };
+
+      for (int f = 0; f < 2; ++f) {
+
+        const std::vector<unsigned char>& src = *frames[f];
+        std::vector<unsigned char> dstTable(src.size()),
+                                   dstDirect(src.size()),
+                                   dstDirectC(src.size());
+
+        BENCHMARK(std::string("Table, ") + names[f]) {
+
+          for (size_t j = 0; j < src.size(); j += 4) {
+
+            int packed = (src[j + 2] << 16) | (src[j + 1] << 8) | src[j];
+            int outInt = plt[tblIdx8[packed]];
+
+            dstTable[j] = outInt & 255;
+            dstTable[j + 1] = (outInt >> 8) & 255;
+            dstTable[j + 2] = (outInt >> 16) & 255;
+
+          }
+
+          return dstTable[0];
+
+        };
+
+        BENCHMARK(std::string("Direct, ") + names[f]) {
+          return SearchFrame(plt, search, src, &dstDirect);
+        };
+
+        BENCHMARK(std::string("Direct, scalar, ") + names[f]) {
+          return SearchFrame(plt, searchC, src, &dstDirectC);
+        };
+
+      }
+
+    }
+
+  }
+
+}
+
+
+
+// Picking a palette from a 1080p frame, first with one thread and no SIMD, then
+// with each in turn.
+TEST_CASE(
+  "PaletteQuantizer - Palette from a frame",
+  "[.][benchmark][palettequantizer]")
+{
+
+  std::vector<unsigned char> frame = MakeFrame(FRAME_W, FRAME_H, 63);
+  std::vector<int> packed;
+
+  for (size_t i = 0; i < frame.size(); i += 4)
+    packed.push_back((frame[i + 2] << 16) | (frame[i + 1] << 8) | frame[i]);
+
+  int methods[2] = { PaletteQuantizer::MEDIAN_CUT, PaletteQuantizer::KMEANS };
+  const char* names[2] = { "mediancut", "kmeans" };
+
+  for (int i = 0; i < 2; ++i) {
+
+    SECTION(names[i]) {
+
+      BENCHMARK("1 thread, scalar") {
+        return QuantizeFrame(packed, methods[i], 256, 1, false);
+      };
+
+      BENCHMARK("1 thread, SIMD") {
+        return QuantizeFrame(packed, methods[i], 256, 1, true);
+      };
+
+      BENCHMARK("4 threads, SIMD") {
+        return QuantizeFrame(packed, methods[i], 256, 4, true);
+      };
+
+    }
+
+  }
+
+}
+
+
+
+TEST_CASE(
+  "WorkerPool - Grid search split across the pool",
+  "[.][benchmark][workerpool]")
+{
+
+  std::vector<int> plt = MakePalette(256),
+                   bricks = FirstBricks(BENCH_BRICKS);
+
+  BENCHMARK("1 thread") {
+    return SearchGridPooled(plt, bricks, 1);
+  };
+
+  BENCHMARK("4 threads") {
+    return SearchGridPooled(plt, bricks, 4);
+  };
+
+}
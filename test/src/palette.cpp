@@ -0,0 +1,340 @@
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "../include/catch/catch.hpp"
+
+#include "../../src/ColorMetric.h"
+#include "../../src/interface.h"
+#include "../../src/PaletteGrid.h"
+#include "../../src/PaletteQuantizer.h"
+#include "../../src/PaletteSearch.h"
+#include "../../src/PaletteTable.h"
+#include "../../src/WorkerPool.h"
+
+#include "util_palette.h"
+
+
+
+// These run the same searches as the benchmarks, just over far fewer colors, so
+// they're quick enough to check every time. CHECK_BRICKS bricks come to 65536
+// colors, picked from all over the color cube.
+static const int CHECK_BRICKS = 128;
+
+
+
+TEST_CASE(
+  "PaletteGrid - Grid search matches brute force",
+  "[palette][palettegrid]")
+{
+
+  int sizes[3] = { 16, 64, 256 };
+
+  std::vector<int> bricks = SpreadBricks(CHECK_BRICKS);
+
+  for (int i = 0; i < 3; ++i) {
+
+    std::vector<int> plt = MakePalette(sizes[i]);
+
+    SECTION(std::to_string(sizes[i]) + " colors") {
+
+      std::vector<int> ref = SearchBruteForce(plt, bricks);
+
+      CHECK(SearchGrid(plt, bricks, false) == ref);
+      CHECK(SearchGrid(plt, bricks, true) == ref);
+
+    }
+
+  }
+
+}
+
+
+
+// CLUTer hands a direct search whatever's left of a row at the end, so the
+// runs here are an odd length, to leave the SIMD search a few pixels over.
+static std::vector<int> SearchDirect(
+  const std::vector<int>& plt, const std::vector<int>& bricks, bool simd)
+{
+
+  const int RUN = 61;
+
+  PaletteSearch search(plt, simd);
+
+  std::vector<int> packed, out(bricks.size() * PaletteGrid::BRICK_SIZE);
+
+  for (size_t b = 0; b < bricks.size(); ++b)
+    for (int entry = 0; entry < PaletteGrid::BRICK_SIZE; ++entry)
+      packed.push_back(PaletteGrid::brickToColor(bricks[b], entry));
+
+  for (size_t i = 0; i < packed.size(); i += RUN)
+    search.nearest(&packed[i], &out[i],
+                   static_cast<int>(std::min(packed.size() - i,
+                                             static_cast<size_t>(RUN))));
+
+  return out;
+
+}
+
+
+
+TEST_CASE(
+  "PaletteSearch - Direct search matches the table",
+  "[palette][palettesearch]")
+{
+
+  int sizes[5] = { 4, 8, 16, 32, 64 };
+
+  std::vector<int> bricks = SpreadBricks(CHECK_BRICKS);
+
+  for (int i = 0; i < 5; ++i) {
+
+    std::vector<int> plt = MakePalette(sizes[i]);
+
+    SECTION(std::to_string(sizes[i]) + " colors") {
+
+      std::vector<int> ref = SearchGrid(plt, bricks, true);
+
+      CHECK(SearchDirect(plt, bricks, false) == ref);
+      CHECK(SearchDirect(plt, bricks, true) == ref);
+
+    }
+
+  }
+
+}
+
+
+
+// The brute force search for every other metric converts the palette and each
+// color to the metric's own space, then takes the same weighted sum of squares
+// PaletteGrid does, in the same order, so both round exactly alike. Only a
+// strictly closer entry wins, so ties go to the lower index.
+static std::vector<int> SearchBruteForceMetric(
+  const std::vector<int>& plt, const std::vector<int>& bricks, int metric,
+  int pixelType)
+{
+
+  ColorMetric space(metric, pixelType);
+
+  const float* w = space.weights();
+
+  std::vector<float> pltSpace(plt.size() * 3);
+  for (size_t i = 0; i < plt.size(); ++i)
+    space.toSpace(plt[i], &pltSpace[i * 3]);
+
+  std::vector<int> out;
+
+  for (size_t b = 0; b < bricks.size(); ++b) {
+
+    for (int entry = 0; entry < PaletteGrid::BRICK_SIZE; ++entry) {
+
+      float in[3];
+      space.toSpace(PaletteGrid::brickToColor(bricks[b], entry), in);
+
+      float best = 0.0f;
+      int outIdx = 0;
+
+      for (size_t i = 0; i < plt.size(); ++i) {
+
+        float dx = in[0] - pltSpace[i * 3],
+              dy = in[1] - pltSpace[i * 3 + 1],
+              dz = in[2] - pltSpace[i * 3 + 2];
+
+        float dist = w[0] * (dx * dx) + w[1] * (dy * dy) + w[2] * (dz * dz);
+
+        if (i == 0 || dist < best) {
+          best = dist;
+          outIdx = static_cast<int>(i);
+        }
+
+      }
+
+      out.push_back(outIdx);
+
+    }
+
+  }
+
+  return out;
+
+}
+
+
+
+TEST_CASE(
+  "PaletteGrid - Grid search by metric matches brute force",
+  "[palette][palettegrid][metric]")
+{
+
+  int sizes[2] = { 16, 256 };
+
+  int metrics[4] = { ColorMetric::WRGB, ColorMetric::EUCLIDEAN,
+                     ColorMetric::LAB, ColorMetric::OKLAB };
+  const char* names[4] = { "wrgb", "euclidean", "lab", "oklab" };
+
+  int pixelTypes[2] = { VideoInfo::CS_BGR32, VideoInfo::CS_YV12 };
+  const char* csps[2] = { "rgb32", "yv12" };
+
+  std::vector<int> bricks = SpreadBricks(CHECK_BRICKS);
+
+  for (int i = 0; i < 2; ++i) {
+
+    std::vector<int> plt = MakePalette(sizes[i]);
+
+    for (int j = 0; j < 4; ++j) {
+
+      for (int k = 0; k < 2; ++k) {
+
+        SECTION(std::to_string(sizes[i]) + " colors, " + names[j] + ", " +
+                csps[k]) {
+
+          std::vector<int> ref =
+            SearchBruteForceMetric(plt, bricks, metrics[j], pixelTypes[k]);
+
+          CHECK(SearchGrid(plt, bricks, false, metrics[j], pixelTypes[k]) ==
+                ref);
+          CHECK(SearchGrid(plt, bricks, true, metrics[j], pixelTypes[k]) ==
+                ref);
+
+        }
+
+      }
+
+    }
+
+  }
+
+}
+
+
+
+// Threads only change how the work gets split up, and SIMD only how the k-means
+// search gets done, so every combination has to come up with the same palette.
+// The frame is just big enough for the histogram to be split four ways.
+TEST_CASE(
+  "PaletteQuantizer - Palette doesn't depend on threads or SIMD",
+  "[palette][palettequantizer]")
+{
+
+  std::vector<unsigned char> frame = MakeFrame(640, 480, 63);
+  std::vector<int> packed;
+
+  for (size_t i = 0; i < frame.size(); i += 4)
+    packed.push_back((frame[i + 2] << 16) | (frame[i + 1] << 8) | frame[i]);
+
+  int methods[2] = { PaletteQuantizer::MEDIAN_CUT, PaletteQuantizer::KMEANS };
+  const char* names[2] = { "mediancut", "kmeans" };
+
+  for (int i = 0; i < 2; ++i) {
+
+    SECTION(names[i]) {
+
+      std::vector<int> ref = QuantizeFrame(packed, methods[i], 256, 1, false);
+
+      CHECK(QuantizeFrame(packed, methods[i], 256, 1, true) == ref);
+      CHECK(QuantizeFrame(packed, methods[i], 256, 4, true) == ref);
+      CHECK(QuantizeFrame(packed, methods[i], 256, 4, false) == ref);
+
+    }
+
+  }
+
+}
+
+
+
+// However many threads the bricks get dealt out to, including far more than
+// there are bricks to go around, each one is still searched exactly once.
+TEST_CASE(
+  "WorkerPool - Grid search split across the pool matches one thread",
+  "[palette][workerpool]")
+{
+
+  std::vector<int> plt = MakePalette(256),
+                   bricks = SpreadBricks(CHECK_BRICKS);
+
+  std::vector<int> ref = SearchGrid(plt, bricks, true);
+
+  CHECK(SearchGridPooled(plt, bricks, 1) == ref);
+  CHECK(SearchGridPooled(plt, bricks, 4) == ref);
+  CHECK(SearchGridPooled(plt, bricks, 256) == ref);
+
+}
+
+
+
+static std::vector<int> SortPalette(std::vector<int> plt)
+{
+
+  std::sort(plt.begin(), plt.end());
+  plt.erase(std::unique(plt.begin(), plt.end()), plt.end());
+
+  return plt;
+
+}
+
+
+
+static bool SameTable(const PaletteTable& a, const PaletteTable& b)
+{
+
+  return std::equal(a.table8(), a.table8() + 16777216, b.table8());
+
+}
+
+
+
+// An animated palette's table is patched from the last frame's when only a few
+// entries have changed, which each of these does to a palette of 64 colors:
+// one entry swapped for a new color, one added, and one taken away. The patched
+// table has to come out exactly like one built from scratch.
+TEST_CASE(
+  "PaletteTable - Patched tables match fresh ones",
+  "[palette][palettetable]")
+{
+
+  std::vector<int> plt = MakePalette(64);
+
+  std::vector<int> changed = plt, added = plt, removed = plt;
+
+  changed[20] = 0x808080;
+  changed = SortPalette(changed);
+
+  added.push_back(0xFF8000);
+  added = SortPalette(added);
+
+  removed.erase(removed.begin() + 40);
+
+  std::vector<int>* palettes[3] = { &changed, &added, &removed };
+  const char* changes[3] = { "changed", "added", "removed" };
+
+  int metrics[3] = { ColorMetric::SAD, ColorMetric::WRGB, ColorMetric::LAB };
+  const char* names[3] = { "sad", "wrgb", "lab" };
+
+  int threads = WorkerPool::maxThreads();
+
+  for (int i = 0; i < 3; ++i) {
+
+    SECTION(names[i]) {
+
+      PaletteTable base(plt, VideoInfo::CS_BGR32, metrics[i], false, false,
+                        threads, "", 0);
+
+      for (int j = 0; j < 3; ++j) {
+
+        PaletteTable patched(*palettes[j], VideoInfo::CS_BGR32, metrics[i],
+                             false, false, threads, "", &base),
+                     fresh(*palettes[j], VideoInfo::CS_BGR32, metrics[i],
+                           false, false, threads, "", 0);
+
+        INFO(changes[j]);
+        CHECK(SameTable(patched, fresh));
+
+      }
+
+    }
+
+  }
+
+}
@@ -0,0 +1,204 @@
+#include <cstdlib>
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+#include "../../src/ColorMetric.h"
+#include "../../src/PaletteGrid.h"
+#include "../../src/PaletteQuantizer.h"
+#include "../../src/WorkerPool.h"
+
+#include "util_palette.h"
+
+
+
+std::vector<int> MakePalette(int size)
+{
+
+  std::vector<int> plt;
+
+  srand(size);
+  for (int i = 0; i < size; ++i)
+    plt.push_back(((rand() & 255) << 16) | ((rand() & 255) << 8) | (rand() & 255));
+
+  std::sort(plt.begin(), plt.end());
+  plt.erase(std::unique(plt.begin(), plt.end()), plt.end());
+
+  return plt;
+
+}
+
+
+
+std::vector<int> FirstBricks(int count)
+{
+
+  std::vector<int> bricks;
+
+  for (int brick = 0; brick < count; ++brick)
+    bricks.push_back(brick);
+
+  return bricks;
+
+}
+
+
+
+// Stepping through the bricks by an odd number never lands on the same one
+// twice, and this one moves a few bricks along every axis at once, so even a
+// handful of them ends up scattered all over the color cube.
+std::vector<int> SpreadBricks(int count)
+{
+
+  const int STEP = (5 << 10) | (11 << 5) | 7;
+
+  std::vector<int> bricks;
+
+  for (int i = 0; i < count; ++i)
+    bricks.push_back((i * STEP) % PaletteGrid::BRICK_COUNT);
+
+  return bricks;
+
+}
+
+
+
+std::vector<int> SearchBruteForce(
+  const std::vector<int>& plt, const std::vector<int>& bricks)
+{
+
+  std::vector<int> out;
+
+  for (size_t b = 0; b < bricks.size(); ++b) {
+
+    for (int entry = 0; entry < PaletteGrid::BRICK_SIZE; ++entry) {
+
+      int color = PaletteGrid::brickToColor(bricks[b], entry);
+
+      int inYR = (color >> 16) & 255,
+          inUG = (color >> 8) & 255,
+          inVB = color & 255;
+
+      int sumPrev = 766, outIdx = 0;
+
+      for (size_t i = 0; i < plt.size(); ++i) {
+
+        int sumCur = abs(inYR - ((plt[i] >> 16) & 255)) +
+                     abs(inUG - ((plt[i] >> 8) & 255)) +
+                     abs(inVB - (plt[i] & 255));
+
+        if (sumCur < sumPrev) {
+          sumPrev = sumCur;
+          outIdx = static_cast<int>(i);
+        }
+
+      }
+
+      out.push_back(outIdx);
+
+    }
+
+  }
+
+  return out;
+
+}
+
+
+
+std::vector<int> SearchGrid(
+  const std::vector<int>& plt, const std::vector<int>& bricks, bool simd,
+  int metric, int pixelType)
+{
+
+  PaletteGrid grid(plt, simd, metric, pixelType);
+
+  std::vector<int> out(bricks.size() * PaletteGrid::BRICK_SIZE);
+
+  for (size_t b = 0; b < bricks.size(); ++b)
+    grid.fillBrick(bricks[b], &out[b * PaletteGrid::BRICK_SIZE]);
+
+  return out;
+
+}
+
+
+
+static void FillBricks(
+  const PaletteGrid* grid, const std::vector<int>* bricks,
+  std::vector<int>* out, int first, int last)
+{
+
+  for (int b = first; b < last; ++b)
+    grid->fillBrick((*bricks)[b], &(*out)[b * PaletteGrid::BRICK_SIZE]);
+
+}
+
+
+
+std::vector<int> SearchGridPooled(
+  const std::vector<int>& plt, const std::vector<int>& bricks, int threads)
+{
+
+  PaletteGrid grid(plt);
+
+  std::vector<int> out(bricks.size() * PaletteGrid::BRICK_SIZE);
+
+  WorkerPool::run(static_cast<int>(bricks.size()), threads,
+                  std::bind(FillBricks, &grid, &bricks, &out,
+                            std::placeholders::_1, std::placeholders::_2));
+
+  return out;
+
+}
+
+
+
+// A gradient with some noise thrown in, so neighboring pixels hit nearby, but
+// not identical, colors, as they tend to with real footage. The more noise
+// there is, the less neighboring pixels have in common.
+std::vector<unsigned char> MakeFrame(int width, int height, int noise)
+{
+
+  std::vector<unsigned char> frame(width * height * 4);
+
+  srand(1080);
+  for (int h = 0; h < height; ++h) {
+
+    for (int w = 0; w < width; ++w) {
+
+      unsigned char* px = &frame[(h * width + w) * 4];
+
+      px[0] = static_cast<unsigned char>((w * 255 / width) ^ (rand() & noise));
+      px[1] = static_cast<unsigned char>((h * 255 / height) ^ (rand() & noise));
+      px[2] = static_cast<unsigned char>(((w + h) * 255 / (width + height)) ^
+                                         (rand() & noise));
+      px[3] = 255;
+
+    }
+
+  }
+
+  return frame;
+
+}
+
+
+
+// Picking a palette from a frame, counting it into the histogram first, then
+// reducing that to the number of colors asked for.
+std::vector<int> QuantizeFrame(
+  const std::vector<int>& packed, int method, int colors, int threads,
+  bool simd)
+{
+
+  PaletteQuantizer quantizer(method, colors, threads, simd);
+  quantizer.addColors(packed);
+
+  std::vector<int> plt;
+  quantizer.quantize(&plt);
+
+  return plt;
+
+}
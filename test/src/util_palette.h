@@ -0,0 +1,42 @@
+#ifndef TURNSTILE_TEST_SRC_UTIL_PALETTE_H_INCLUDED
+#define TURNSTILE_TEST_SRC_UTIL_PALETTE_H_INCLUDED
+
+
+
+#include <vector>
+
+#include "../../src/ColorMetric.h"
+
+
+
+std::vector<int> MakePalette(int size);
+
+
+
+std::vector<int> FirstBricks(int count);
+
+std::vector<int> SpreadBricks(int count);
+
+
+
+std::vector<int> SearchBruteForce(
+  const std::vector<int>& plt, const std::vector<int>& bricks);
+
+std::vector<int> SearchGrid(
+  const std::vector<int>& plt, const std::vector<int>& bricks, bool simd,
+  int metric = ColorMetric::SAD, int pixelType = 0);
+
+std::vector<int> SearchGridPooled(
+  const std::vector<int>& plt, const std::vector<int>& bricks, int threads);
+
+
+
+std::vector<unsigned char> MakeFrame(int width, int height, int noise);
+
+std::vector<int> QuantizeFrame(
+  const std::vector<int>& packed, int method, int colors, int threads,
+  bool simd);
+
+
+
+#endif // TURNSTILE_TEST_SRC_UTIL_PALETTE_H_INCLUDED